@@ -0,0 +1,168 @@
+// Tokenizer throughput over real OPF files, once per scanning kernel, and
+// the arena usage of copying every token (to size the arenas of the library).
+//
+// Usage: xml_bench <file.opf|file.epub>...
+// EPUB files are opened and their OPF (from META-INF/container.xml) is used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "epubinfo/arena.h"
+#include "epubinfo/xml.h"
+#include "epubinfo/zip.h"
+
+#define TRIALS 5
+#define MIN_TRIAL_SECONDS 0.2
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *read_file(const char *filename, size_t *len) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *content = malloc(size + 1);
+    if (content && fread(content, 1, size, fp) != (size_t)size) {
+        free(content);
+        content = NULL;
+    }
+    fclose(fp);
+
+    if (content) {
+        content[size] = '\0';
+        *len = size;
+    }
+    return content;
+}
+
+static char *read_epub_opf(const char *filename, size_t *len) {
+    ZipArchive za = {0};
+    ZipDirectory dir = {0};
+    ZipEocdrHeader header;
+    char *container_content = NULL;
+    char *opf_content = NULL;
+
+    if (!zip_archive_open(&za, filename)) return NULL;
+    if (!zip_read_end_of_central_directory_record(&za, &header)) goto done;
+    if (!zip_read_central_directory(&za, &header, &dir, NULL)) goto done;
+
+    const ZipEntry *container = zip_find_entry_by_filename(&dir, "META-INF/container.xml");
+    if (!container) goto done;
+    container_content = zip_uncompress_entry(&za, container);
+    if (!container_content) goto done;
+
+    const char *fullpath = strstr(container_content, "full-path=\"");
+    if (!fullpath) goto done;
+    fullpath += strlen("full-path=\"");
+    const char *end = strchr(fullpath, '"');
+    if (!end) goto done;
+
+    const ZipEntry *opf = zip_find_entry(&dir, fullpath, end - fullpath);
+    if (!opf) goto done;
+    opf_content = zip_uncompress_entry(&za, opf);
+    if (opf_content) *len = opf->uncompressed_size;
+
+done:
+    free(container_content);
+    zip_directory_free(&dir);
+    zip_archive_close(&za);
+    return opf_content;
+}
+
+// Returns the number of tokens, to keep the loop from being optimized out.
+static size_t tokenize(const XmlScanner *scanner, char *content, size_t len) {
+    XmlParser parser;
+    xml_parser_init(&parser, content, len);
+    parser.scanner = scanner;
+
+    size_t tokens = 0;
+    while (1) {
+        XmlToken value = xml_next_token(&parser);
+        if (value.type == EOF_TAG || value.type == ERROR_TAG) break;
+        tokens++;
+    }
+    return tokens;
+}
+
+// Reports the best of TRIALS runs, each one at least MIN_TRIAL_SECONDS long.
+static void bench(const XmlScanner *scanner, char *content, size_t len) {
+    double best = 0;
+    size_t tokens = 0;
+
+    for (int trial = 0; trial < TRIALS; trial++) {
+        size_t iterations = 0;
+        double start = now_seconds();
+        double elapsed;
+
+        do {
+            tokens = tokenize(scanner, content, len);
+            iterations++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < MIN_TRIAL_SECONDS);
+
+        double mb_per_second = (double)len * iterations / elapsed / (1024 * 1024);
+        if (mb_per_second > best) best = mb_per_second;
+    }
+
+    printf("  %-7s %10.1f MB/s  (%zu tokens)\n", scanner->name, best, tokens);
+}
+
+// Copies every token with `xml_next` into an arena with the first block size
+// the package and metadata arenas use, and reports what it took.
+static void arena_usage(char *content, size_t len) {
+    Arena arena;
+    if (!arena_init(&arena, 4096, NULL)) return;
+
+    XmlParser parser;
+    xml_parser_init(&parser, content, len);
+    while (1) {
+        XmlValue value = xml_next(&arena, &parser);
+        if (value.type == EOF_TAG || value.type == ERROR_TAG || !value.content) break;
+    }
+
+    printf("  arena   %10zu bytes  (%zu allocations, %zu blocks, %zu bytes reserved)\n",
+           arena.high_water, arena.alloc_count, arena.block_count, arena.reserved);
+    arena_free(&arena);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <file.opf|file.epub>...\n", argv[0]);
+        return 1;
+    }
+
+    const XmlScanner *scanners[] = { &xml_scanner_scalar, &xml_scanner_sse2, &xml_scanner_avx2 };
+    const XmlScanner *best = xml_scanner_best();
+
+    for (int i = 1; i < argc; i++) {
+        size_t len = 0;
+        size_t name_len = strlen(argv[i]);
+        char *content = name_len > 5 && strcmp(&argv[i][name_len - 5], ".epub") == 0
+            ? read_epub_opf(argv[i], &len)
+            : read_file(argv[i], &len);
+
+        if (!content) {
+            printf("%s: can't read OPF\n", argv[i]);
+            continue;
+        }
+
+        printf("%s (%zu bytes)\n", argv[i], len);
+        for (size_t s = 0; s < sizeof(scanners) / sizeof(scanners[0]); s++) {
+            bench(scanners[s], content, len);
+            if (scanners[s] == best) break; // the CPU doesn't support the next ones
+        }
+        arena_usage(content, len);
+        free(content);
+    }
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "epubinfo/epubinfo.h"
+
+/// Growable output buffer, always null terminated once something was appended.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} StrBuf;
+
+/// Makes room for `len` more bytes (and the terminator).
+/// Both abort the program if there is no memory.
+void StrBuf_reserve(StrBuf *b, size_t len);
+void StrBuf_append(StrBuf *b, const char *s, size_t len);
+void StrBuf_puts(StrBuf *b, const char *s);
+void StrBuf_free(StrBuf *b);
+
+/// Appends `s` as a quoted JSON string (control characters escaped, UTF-8 kept as is).
+void json_append_string(StrBuf *b, const char *s);
+
+/// Appends one NDJSON record (with the final newline) for the book at `path`.
+/// `path` is NULL (printed as null) for books without one. `doc` is NULL when opening failed with `error`.
+void json_append_document(StrBuf *b, const char *path, EpubDocument *doc, EpubError error);
+
+typedef struct {
+    char *path;
+    uint64_t size;
+} Book;
+
+typedef struct {
+    Book *books;
+    size_t count;
+    size_t capacity;
+} BookList;
+
+/// Return 1 if `name` ends with ".epub" (any case).
+int is_epub(const char *name);
+
+/// Returns an `allocated` "dir/name". Aborts the program if there is no memory.
+char *path_join(const char *dir, const char *name);
+
+/// Takes ownership of `path`.
+void BookList_add(BookList *list, char *path, uint64_t size);
+
+/// Sorts by path and drops duplicates.
+void BookList_sort_unique(BookList *list);
+void BookList_free(BookList *list);
+
+typedef void (*WalkDirCallback)(void *user, const char *dir);
+
+/// Adds every .epub under `dir` to `list`, `on_dir` (may be NULL) is called for
+/// `dir` and every directory below it.
+void walk_tree(BookList *list, const char *dir, WalkDirCallback on_dir, void *user);
+
+/// `epubinfo <file>`: prints every dc: element of one book.
+int cmd_info(const char *filename);
+
+typedef struct {
+    const char *dir;
+    int threads;                // 0: one per CPU
+    int ordered;                // print in path order instead of as completed
+    const char *cache_path;     // may be NULL
+    int clear_cache;
+    int verify;                 // check the CRC-32 of every entry of every book
+} ScanOptions;
+
+/// `epubinfo -r <dir>`: opens every .epub under `dir` in parallel.
+int cmd_scan(const ScanOptions *options);
+
+/// `epubinfo --dedupe <dir>`: groups the books under `dir` holding the same files,
+/// reading only the central directory of each one.
+int cmd_dedupe(const char *dir, int threads);
+
+/// `epubinfo index build <dir> -o <index>` / `epubinfo index query <index> <field:value>...`:
+/// writes an inverted index of the metadata of a library, and answers conjunctive queries from it.
+int cmd_index(int argc, char **argv);
+
+/// `epubinfo watch <dir> -c <cache>`: keeps the cache in sync with `dir` (inotify).
+int cmd_watch(int argc, char **argv);
+
+/// `epubinfo serve --socket <path>`: answers requests over a Unix socket (protocol.h).
+int cmd_serve(int argc, char **argv);
+
+/// `epubinfo client --socket <path> <epub>...`: sends requests to `epubinfo serve`.
+int cmd_client(int argc, char **argv);
+
+/// `epubinfo text <epub>...`: prints the text of the spine and the extraction throughput.
+int cmd_text(int argc, char **argv);
+
+#endif
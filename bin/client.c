@@ -0,0 +1,200 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "protocol.h"
+
+// Test client for `epubinfo serve`: sends every file (`rounds` times) with at
+// most `depth` requests in flight, prints the JSON records and a latency summary.
+
+typedef struct {
+    const char *socket_path;
+    const char *cover_dir;      // may be NULL
+    int pass_fd;
+    int rounds;
+    int depth;
+    int quiet;
+} ClientOptions;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int u64_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int client_send(int sock, const ClientOptions *options, uint32_t id, const char *path) {
+    size_t path_len = strlen(path);
+    if (path_len > PROTOCOL_MAX_REQUEST_LEN - PROTOCOL_REQUEST_HEADER_LEN) path_len = 0;
+
+    unsigned char frame[4 + PROTOCOL_MAX_REQUEST_LEN] = {0};
+    put_le32(&frame[4], id);
+    frame[8] = options->pass_fd ? PROTOCOL_FD : PROTOCOL_PATH;
+    frame[9] = options->cover_dir ? PROTOCOL_WANT_COVER : 0;
+
+    size_t len = PROTOCOL_REQUEST_HEADER_LEN;
+    int fd = -1;
+    if (options->pass_fd) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) perror(path); // sent without a descriptor, the server answers with an error
+    } else {
+        memcpy(&frame[4 + len], path, path_len);
+        len += path_len;
+    }
+    put_le32(frame, len);
+
+    int ok = protocol_send(sock, frame, 4 + len, fd);
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+static int client_receive(int sock, const ClientOptions *options, StrBuf *buf, uint32_t *id, int *error) {
+    unsigned char header[4 + PROTOCOL_RESPONSE_HEADER_LEN];
+    if (!read_full(sock, header, sizeof(header))) return 0;
+
+    uint32_t len = get_le32(header);
+    *id = get_le32(&header[4]);
+    *error = header[8];
+    int has_cover = header[9] & PROTOCOL_HAS_COVER;
+    uint32_t json_len = get_le32(&header[12]);
+    if (len < PROTOCOL_RESPONSE_HEADER_LEN || json_len > len - PROTOCOL_RESPONSE_HEADER_LEN) return 0;
+
+    uint32_t body_len = len - PROTOCOL_RESPONSE_HEADER_LEN;
+    buf->len = 0;
+    StrBuf_reserve(buf, body_len);
+    if (!read_full(sock, buf->data, body_len)) return 0;
+    buf->len = body_len;
+
+    if (!options->quiet) fwrite(buf->data, 1, json_len, stdout);
+
+    if (has_cover && options->cover_dir) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%u.cover", options->cover_dir, *id);
+        FILE *f = fopen(path, "wb");
+        if (!f || fwrite(buf->data + json_len, 1, body_len - json_len, f) != body_len - json_len) perror(path);
+        if (f) fclose(f);
+    }
+    return 1;
+}
+
+static void client_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s client --socket <path> [--fd] [--cover <dir>] [-n rounds] [-p depth] [-q] <epub>...\n"
+            "\n"
+            "  --socket <path>  socket of `epubinfo serve`\n"
+            "  --fd             send open file descriptors instead of paths\n"
+            "  --cover <dir>    ask for covers, saved as <dir>/<request id>.cover\n"
+            "  -n <rounds>      send the list this many times (default: 1)\n"
+            "  -p <depth>       requests in flight (default: 16)\n"
+            "  -q               don't print the records\n",
+            program);
+}
+
+int cmd_client(int argc, char **argv) {
+    static const struct option long_options[] = {
+        { "socket", required_argument, NULL, 's' },
+        { "fd", no_argument, NULL, 'f' },
+        { "cover", required_argument, NULL, 'C' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    ClientOptions options = { .rounds = 1, .depth = 16 };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:p:q", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's': options.socket_path = optarg; break;
+            case 'f': options.pass_fd = 1; break;
+            case 'C': options.cover_dir = optarg; break;
+            case 'n': options.rounds = atoi(optarg); break;
+            case 'p': options.depth = atoi(optarg); break;
+            case 'q': options.quiet = 1; break;
+            default:
+                client_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!options.socket_path || optind == argc || options.rounds < 1 || options.depth < 1) {
+        client_usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(options.socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", options.socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, options.socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(options.socket_path);
+        if (sock >= 0) close(sock);
+        return 1;
+    }
+
+    char **files = &argv[optind];
+    size_t file_count = argc - optind;
+    size_t total = file_count * options.rounds;
+    uint64_t *sent_at = malloc(total * sizeof(uint64_t));
+    uint64_t *latency = malloc(total * sizeof(uint64_t));
+    if (!sent_at || !latency) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    StrBuf buf = {0};
+    size_t sent = 0, received = 0, errors = 0;
+    int ok = 1;
+    uint64_t start = now_ns();
+
+    // responses come back in order, so the request id is also the index
+    while (ok && received < total) {
+        while (sent < total && sent - received < (size_t)options.depth) {
+            sent_at[sent] = now_ns();
+            if (!client_send(sock, &options, sent, files[sent % file_count])) {
+                ok = 0;
+                break;
+            }
+            sent += 1;
+        }
+        if (!ok) break;
+
+        uint32_t id;
+        int error;
+        if (!client_receive(sock, &options, &buf, &id, &error) || id != received) {
+            ok = 0;
+            break;
+        }
+        latency[received] = now_ns() - sent_at[received];
+        if (error) errors += 1;
+        received += 1;
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    fflush(stdout);
+    if (!ok) fprintf(stderr, "Connection lost after %zu responses\n", received);
+
+    qsort(latency, received, sizeof(uint64_t), u64_compare);
+    size_t p50 = received ? (received * 50 + 99) / 100 - 1 : 0;
+    size_t p99 = received ? (received * 99 + 99) / 100 - 1 : 0;
+    fprintf(stderr, "requests: %zu, errors: %zu, time: %.3fs, %.1f requests/s, p50: %.3fms, p99: %.3fms\n",
+            received, errors, seconds, seconds > 0 ? received / seconds : 0.0,
+            received ? latency[p50] / 1e6 : 0.0, received ? latency[p99] / 1e6 : 0.0);
+
+    StrBuf_free(&buf);
+    free(sent_at);
+    free(latency);
+    close(sock);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cli.h"
+
+// Books are fingerprinted from the tail of their file only (central
+// directory, no entry is read), then sorted by fingerprint: books sharing
+// one hold the same files.
+
+typedef struct {
+    const Book *books;
+    size_t count;
+    uint64_t *fingerprints;
+    EpubError *errors;
+    atomic_size_t next;         // next book to fingerprint
+} Dedupe;
+
+static void *dedupe_worker(void *arg) {
+    Dedupe *dedupe = arg;
+    EpubContext *ctx = EpubContext_new();
+
+    size_t i;
+    while ((i = atomic_fetch_add(&dedupe->next, 1)) < dedupe->count) {
+        dedupe->errors[i] = ctx ? EpubContext_fingerprint_file(ctx, dedupe->books[i].path, &dedupe->fingerprints[i])
+                                : EPUB_ERROR_NO_MEMORY;
+    }
+
+    EpubContext_free(ctx);
+    return NULL;
+}
+
+static const uint64_t *sort_fingerprints; // qsort has no user pointer
+
+// By fingerprint, then by path (books are already in path order).
+static int dedupe_compare(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    if (sort_fingerprints[x] != sort_fingerprints[y]) return sort_fingerprints[x] < sort_fingerprints[y] ? -1 : 1;
+    return (x > y) - (x < y);
+}
+
+int cmd_dedupe(const char *dir, int threads) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    BookList list = {0};
+    walk_tree(&list, dir, NULL, NULL);
+    BookList_sort_unique(&list);
+
+    Dedupe dedupe = {
+        .books = list.books,
+        .count = list.count,
+        .fingerprints = malloc((list.count + 1) * sizeof(uint64_t)),
+        .errors = malloc((list.count + 1) * sizeof(EpubError)),
+    };
+    size_t *order = malloc((list.count + 1) * sizeof(size_t));
+    if (!dedupe.fingerprints || !dedupe.errors || !order) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((size_t)threads > list.count) threads = list.count > 0 ? (int)list.count : 1;
+
+    // the calling thread is the last worker
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    int started = 0;
+    for (int i = 1; workers && i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, dedupe_worker, &dedupe) == 0) started++;
+    }
+    dedupe_worker(&dedupe);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    size_t count = 0, errors = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        if (dedupe.errors[i] == EPUB_OK) {
+            order[count++] = i;
+        } else {
+            fprintf(stderr, "%s: %s\n", list.books[i].path, EpubError_string(dedupe.errors[i]));
+            errors++;
+        }
+    }
+    sort_fingerprints = dedupe.fingerprints;
+    qsort(order, count, sizeof(size_t), dedupe_compare);
+
+    // one record per group of two books or more
+    size_t groups = 0, duplicates = 0;
+    StrBuf record = {0};
+    for (size_t first = 0, last; first < count; first = last) {
+        uint64_t fingerprint = dedupe.fingerprints[order[first]];
+        for (last = first + 1; last < count && dedupe.fingerprints[order[last]] == fingerprint; last++) {}
+        if (last - first < 2) continue;
+
+        char hex[32];
+        snprintf(hex, sizeof(hex), "%016" PRIx64, fingerprint);
+        record.len = 0;
+        StrBuf_puts(&record, "{\"fingerprint\":\"");
+        StrBuf_puts(&record, hex);
+        StrBuf_puts(&record, "\",\"paths\":[");
+        for (size_t i = first; i < last; i++) {
+            if (i > first) StrBuf_puts(&record, ",");
+            json_append_string(&record, list.books[order[i]].path);
+        }
+        StrBuf_puts(&record, "]}\n");
+        fwrite(record.data, 1, record.len, stdout);
+
+        groups += 1;
+        duplicates += last - first - 1;
+    }
+    StrBuf_free(&record);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "books: %zu, errors: %zu, groups: %zu, duplicates: %zu, time: %.3fs, %.1f books/s\n",
+            list.count, errors, groups, duplicates, seconds, seconds > 0 ? list.count / seconds : 0.0);
+
+    BookList_free(&list);
+    free(dedupe.fingerprints);
+    free(dedupe.errors);
+    free(order);
+    return 0;
+}
@@ -0,0 +1,744 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cli.h"
+
+// Index file
+//
+// Bytes | Description
+// ------+-------------------------------------------------------------------------
+//     8 | Magic "EPUBINDX"
+//     4 | Version
+//     4 | Reserved
+//   8*7 | Book count, term count, offsets of the path table, term table, term
+//       | names and postings, file size
+//   8*b | Offset of the path of every book (null terminated), books are in path order
+//  24*t | Terms (IndexTerm), sorted by name, 8 bytes aligned
+//     n | Term names: a field code byte then the token
+//     m | Postings of every term
+//
+// Postings are the ids (path order) of the books holding the term, sorted,
+// stored as varint (LEB128) gaps. Lists longer than one block start with a
+// skip table: for every block of INDEX_BLOCK postings, the id before it (the
+// gaps restart from there) and the offset of its first gap, 4 bytes each.
+// Numbers are in native byte order, like the cache file.
+
+#define INDEX_FILE_MAGIC "EPUBINDX"
+#define INDEX_FILE_VERSION 1
+#define INDEX_BLOCK 128
+#define INDEX_MAX_TOKEN 64          // longer tokens are cut, at build and query time
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t book_count;
+    uint64_t term_count;
+    uint64_t paths;
+    uint64_t terms;
+    uint64_t names;
+    uint64_t postings;
+    uint64_t size;
+} IndexHeader;
+
+typedef struct {
+    uint64_t postings;          // absolute offset
+    uint32_t postings_len;      // bytes, skip table included
+    uint32_t count;
+    uint32_t name;              // offset from IndexHeader.names
+    uint32_t name_len;
+} IndexTerm;
+
+_Static_assert(sizeof(IndexHeader) % 8 == 0, "path offsets must stay 8 bytes aligned");
+_Static_assert(sizeof(IndexTerm) == 24, "IndexTerm is part of the file format");
+
+// Fields a query can name, the code is the first byte of the term.
+static const struct {
+    const char *name;
+    char code;
+} index_fields[] = {
+    { "title", 't' },
+    { "creator", 'c' },
+    { "author", 'c' },          // authors and creators share their terms
+    { "publisher", 'p' },
+    { "language", 'l' },
+    { "identifier", 'i' },
+};
+
+#define INDEX_FIELDS_MASK (EPUB_FIELD_TITLE | EPUB_FIELD_AUTHOR | EPUB_FIELD_CREATOR | \
+                           EPUB_FIELD_PUBLISHER | EPUB_FIELD_LANGUAGE | EPUB_FIELD_IDENTIFIER)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Reads the next token of `s` into `token` (INDEX_MAX_TOKEN bytes): a run of
+// ASCII letters and digits, lowercased, or of UTF-8 sequences kept as is.
+// Returns the end of the token, NULL when there is none left.
+static const char *index_next_token(const char *s, char *token, size_t *len) {
+    while (*s && (unsigned char)*s < 0x80 && !((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || (*s >= '0' && *s <= '9'))) s++;
+    if (!*s) return NULL;
+
+    *len = 0;
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        else if (c < 0x80 && !(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9')) break;
+        if (*len < INDEX_MAX_TOKEN) token[(*len)++] = (char)c;
+    }
+    // don't leave half a UTF-8 sequence at the cut
+    if (*len == INDEX_MAX_TOKEN) {
+        while (*len > 0 && ((unsigned char)token[*len - 1] & 0xc0) == 0x80) (*len)--;
+        if (*len > 0 && ((unsigned char)token[*len - 1] & 0x80)) (*len)--;
+    }
+    return s;
+}
+
+static int index_name_compare(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c) return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+// Build
+//
+// Workers tokenize the books they open, postings are gathered under a lock
+// in a hash table of terms. Books complete out of order, so each list is
+// sorted once every book is in.
+
+typedef struct {
+    uint32_t name;              // offset in IndexBuilder.names
+    uint32_t name_len;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *docs;
+} BuildTerm;
+
+typedef struct {
+    const Book *books;
+    pthread_mutex_t lock;
+    StrBuf names;
+    BuildTerm *terms;
+    size_t term_count;
+    size_t term_capacity;
+    uint32_t *slots;            // open addressing (linear probing), term index + 1, 0 = empty
+    size_t slot_capacity;       // power of two
+    uint64_t postings;
+    size_t errors;
+    size_t cached;
+} IndexBuilder;
+
+static void *index_alloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (!p) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint32_t index_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static uint32_t *IndexBuilder_slot(const IndexBuilder *b, const char *name, size_t len) {
+    size_t mask = b->slot_capacity - 1;
+    for (size_t i = index_hash(name, len) & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = &b->slots[i];
+        if (!*slot) return slot;
+
+        const BuildTerm *term = &b->terms[*slot - 1];
+        if (term->name_len == len && memcmp(&b->names.data[term->name], name, len) == 0) return slot;
+    }
+}
+
+// Adds `doc` to the postings of `name`. Needs the lock.
+static void IndexBuilder_add(IndexBuilder *b, const char *name, size_t len, uint32_t doc) {
+    if ((b->term_count + 1) * 2 > b->slot_capacity) {
+        free(b->slots);
+        b->slot_capacity = b->slot_capacity ? b->slot_capacity * 2 : 4096;
+        b->slots = index_alloc(NULL, b->slot_capacity * sizeof(uint32_t));
+        memset(b->slots, 0, b->slot_capacity * sizeof(uint32_t));
+        for (size_t i = 0; i < b->term_count; i++) {
+            const BuildTerm *term = &b->terms[i];
+            *IndexBuilder_slot(b, &b->names.data[term->name], term->name_len) = i + 1;
+        }
+    }
+
+    uint32_t *slot = IndexBuilder_slot(b, name, len);
+    if (!*slot) {
+        if (b->term_count == b->term_capacity) {
+            b->term_capacity = b->term_capacity ? b->term_capacity * 2 : 1024;
+            b->terms = index_alloc(b->terms, b->term_capacity * sizeof(BuildTerm));
+        }
+        b->terms[b->term_count] = (BuildTerm){ .name = b->names.len, .name_len = len };
+        StrBuf_append(&b->names, name, len);
+        *slot = ++b->term_count;
+    }
+
+    BuildTerm *term = &b->terms[*slot - 1];
+    // a book adds all its terms at once, a repeated token is its last posting
+    if (term->count > 0 && term->docs[term->count - 1] == doc) return;
+    if (term->count == term->capacity) {
+        term->capacity = term->capacity ? term->capacity * 2 : 1;
+        term->docs = index_alloc(term->docs, term->capacity * sizeof(uint32_t));
+    }
+    term->docs[term->count++] = doc;
+    b->postings += 1;
+}
+
+static void IndexBuilder_add_value(IndexBuilder *b, char code, const char *value, uint32_t doc) {
+    char name[1 + INDEX_MAX_TOKEN];
+    size_t len;
+    name[0] = code;
+    while (value && (value = index_next_token(value, &name[1], &len))) {
+        if (len > 0) IndexBuilder_add(b, name, 1 + len, doc);
+    }
+}
+
+static void index_record(void *user, size_t index, const EpubBatchResult *result) {
+    IndexBuilder *b = user;
+    if (!result->doc) {
+        fprintf(stderr, "%s: %s\n", b->books[index].path, EpubError_string(result->error));
+        pthread_mutex_lock(&b->lock);
+        b->errors += 1;
+        pthread_mutex_unlock(&b->lock);
+        return;
+    }
+
+    const EpubMetadata *meta = EpubDocument_get_metadata(result->doc);
+    uint32_t doc = index;
+
+    pthread_mutex_lock(&b->lock);
+    if (result->cached) b->cached += 1;
+    IndexBuilder_add_value(b, 't', EpubMetadata_get_title(meta), doc);
+    for (int i = 0; i < EpubMetadata_get_creator_count(meta); i++) {
+        IndexBuilder_add_value(b, 'c', EpubMetadata_get_creator(meta, i), doc);
+    }
+    for (int i = 0; i < EpubMetadata_get_author_count(meta); i++) {
+        IndexBuilder_add_value(b, 'c', EpubMetadata_get_author(meta, i), doc);
+    }
+    IndexBuilder_add_value(b, 'p', EpubMetadata_get_publisher(meta), doc);
+    IndexBuilder_add_value(b, 'l', EpubMetadata_get_language(meta), doc);
+    for (int i = 0; i < EpubMetadata_get_identifier_count(meta); i++) {
+        IndexBuilder_add_value(b, 'i', EpubMetadata_get_identifier(meta, i), doc);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    EpubDocument_free(result->doc);
+}
+
+static const IndexBuilder *sort_builder; // qsort has no user pointer
+
+static int index_term_compare(const void *a, const void *b) {
+    const BuildTerm *x = &sort_builder->terms[*(const uint32_t *)a];
+    const BuildTerm *y = &sort_builder->terms[*(const uint32_t *)b];
+    return index_name_compare(&sort_builder->names.data[x->name], x->name_len,
+                              &sort_builder->names.data[y->name], y->name_len);
+}
+
+static int u32_compare(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void varint_append(StrBuf *out, uint32_t v) {
+    char buf[5];
+    size_t len = 0;
+    while (v >= 0x80) {
+        buf[len++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    buf[len++] = (char)v;
+    StrBuf_append(out, buf, len);
+}
+
+// Appends the postings of `docs` (sorted, unique) to `out`.
+static void index_encode_postings(StrBuf *out, const uint32_t *docs, uint32_t count) {
+    uint32_t blocks = (count + INDEX_BLOCK - 1) / INDEX_BLOCK;
+    size_t skips = out->len;
+    if (blocks > 1) {
+        StrBuf_reserve(out, (size_t)blocks * 8);
+        memset(&out->data[skips], 0, (size_t)blocks * 8);
+        out->len += (size_t)blocks * 8;
+    }
+
+    size_t data = out->len;
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (blocks > 1 && i % INDEX_BLOCK == 0) {
+            uint32_t skip[2] = { prev, (uint32_t)(out->len - data) };
+            memcpy(&out->data[skips + (size_t)(i / INDEX_BLOCK) * 8], skip, sizeof(skip));
+        }
+        varint_append(out, docs[i] - prev);
+        prev = docs[i];
+    }
+}
+
+static int index_write(const char *path, const IndexBuilder *b, size_t book_count) {
+    // terms in name order, postings sorted
+    uint32_t *order = index_alloc(NULL, (b->term_count + 1) * sizeof(uint32_t));
+    for (size_t i = 0; i < b->term_count; i++) {
+        BuildTerm *term = &b->terms[i];
+        qsort(term->docs, term->count, sizeof(uint32_t), u32_compare);
+        order[i] = i;
+    }
+    sort_builder = b;
+    qsort(order, b->term_count, sizeof(uint32_t), index_term_compare);
+
+    StrBuf names = {0}, postings = {0};
+    IndexTerm *terms = index_alloc(NULL, (b->term_count + 1) * sizeof(IndexTerm));
+    for (size_t i = 0; i < b->term_count; i++) {
+        const BuildTerm *term = &b->terms[order[i]];
+        terms[i] = (IndexTerm){ .postings = postings.len, .count = term->count, .name = names.len, .name_len = term->name_len };
+        StrBuf_append(&names, &b->names.data[term->name], term->name_len);
+        index_encode_postings(&postings, term->docs, term->count);
+        terms[i].postings_len = postings.len - terms[i].postings;
+    }
+
+    IndexHeader header = { .version = INDEX_FILE_VERSION, .book_count = book_count, .term_count = b->term_count };
+    memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.paths = sizeof(IndexHeader);
+    uint64_t offset = header.paths + book_count * 8;
+    uint64_t *path_offsets = index_alloc(NULL, (book_count + 1) * sizeof(uint64_t));
+    for (size_t i = 0; i < book_count; i++) {
+        path_offsets[i] = offset;
+        offset += strlen(b->books[i].path) + 1;
+    }
+    size_t padding = (8 - offset % 8) % 8;
+    header.terms = offset + padding;
+    header.names = header.terms + b->term_count * sizeof(IndexTerm);
+    header.postings = header.names + names.len;
+    header.size = header.postings + postings.len;
+    for (size_t i = 0; i < b->term_count; i++) terms[i].postings += header.postings;
+
+    int ok = names.len <= UINT32_MAX && postings.len <= UINT32_MAX;
+    if (!ok) fprintf(stderr, "%s: too many terms for the index format\n", path);
+
+    // written next to the index, then renamed over it
+    char *tmp = index_alloc(NULL, strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    FILE *f = ok ? fopen(tmp, "wb") : NULL;
+    if (ok && !f) {
+        perror(tmp);
+        ok = 0;
+    }
+    if (f) {
+        static const char zeros[8];
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(path_offsets, 8, book_count, f) == book_count;
+        for (size_t i = 0; ok && i < book_count; i++) ok = fputs(b->books[i].path, f) >= 0 && fputc('\0', f) == 0;
+        ok = ok && fwrite(zeros, 1, padding, f) == padding &&
+             fwrite(terms, sizeof(IndexTerm), b->term_count, f) == b->term_count &&
+             fwrite(names.data, 1, names.len, f) == names.len &&
+             fwrite(postings.data, 1, postings.len, f) == postings.len;
+        ok = fclose(f) == 0 && ok;
+        if (ok && rename(tmp, path) != 0) ok = 0;
+        if (!ok) {
+            perror(path);
+            unlink(tmp);
+        }
+    }
+
+    free(tmp);
+    free(path_offsets);
+    free(terms);
+    free(order);
+    StrBuf_free(&names);
+    StrBuf_free(&postings);
+    return ok;
+}
+
+static void index_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s index build <dir> -o <index> [-j threads] [-c cache]\n"
+            "       %s index query <index> [-n] <field:value>...\n"
+            "\n"
+            "  -o <index>    the index file to write (replaced atomically)\n"
+            "  -j <threads>  number of workers (default: one per CPU)\n"
+            "  -c <cache>    read unchanged books from (and add new ones to) a cache file\n"
+            "  -n            only print the number of matches\n"
+            "\n"
+            "Fields: title, creator (or author), publisher, language, identifier. Values are\n"
+            "split into words, books must hold every word of every term.\n",
+            program, program);
+}
+
+static int index_build(int argc, char **argv) {
+    const char *output = NULL, *cache_path = NULL;
+    int threads = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:j:c:")) != -1) {
+        switch (opt) {
+            case 'o': output = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            case 'c': cache_path = optarg; break;
+            default:
+                index_usage("epubinfo");
+                return 1;
+        }
+    }
+    if (optind + 1 != argc || !output || threads < 0) {
+        index_usage("epubinfo");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    EpubCache *cache = NULL;
+    if (cache_path) {
+        EpubError cache_err;
+        cache = EpubCache_new(cache_path, &cache_err);
+        if (!cache) {
+            fprintf(stderr, "%s: %s\n", cache_path, EpubError_string(cache_err));
+            return 1;
+        }
+    }
+
+    BookList list = {0};
+    walk_tree(&list, argv[optind], NULL, NULL);
+    BookList_sort_unique(&list);
+    if (list.count > UINT32_MAX) {
+        fprintf(stderr, "%s: too many books for the index format\n", argv[optind]);
+        EpubCache_free(cache);
+        BookList_free(&list);
+        return 1;
+    }
+
+    const char **filenames = index_alloc(NULL, (list.count + 1) * sizeof(*filenames));
+    for (size_t i = 0; i < list.count; i++) filenames[i] = list.books[i].path;
+
+    IndexBuilder builder = { .books = list.books };
+    pthread_mutex_init(&builder.lock, NULL);
+    EpubError err = EpubCache_open_batch_each(cache, filenames, list.count, INDEX_FIELDS_MASK, threads, index_record, &builder);
+
+    int ok = err == EPUB_OK;
+    if (!ok) fprintf(stderr, "Index failed: %s\n", EpubError_string(err));
+    else ok = index_write(output, &builder, list.count);
+
+    if (ok) {
+        struct stat st;
+        double seconds = (now_ns() - start) / 1e9;
+        fprintf(stderr, "books: %zu, errors: %zu, cached: %zu, terms: %zu, postings: %llu, size: %lld bytes, time: %.3fs\n",
+                list.count, builder.errors, builder.cached, builder.term_count, (unsigned long long)builder.postings,
+                stat(output, &st) == 0 ? (long long)st.st_size : -1LL, seconds);
+    }
+
+    for (size_t i = 0; i < builder.term_count; i++) free(builder.terms[i].docs);
+    free(builder.terms);
+    free(builder.slots);
+    StrBuf_free(&builder.names);
+    pthread_mutex_destroy(&builder.lock);
+    EpubCache_free(cache);
+    BookList_free(&list);
+    free(filenames);
+    return ok ? 0 : 1;
+}
+
+// Query
+//
+// The index is mapped and only the pages of the terms asked for are
+// touched. Lists are intersected from the shortest one: its books are the
+// candidates, every other list is only advanced to the next candidate and
+// skips the blocks before it.
+
+typedef struct {
+    const unsigned char *map;
+    size_t size;
+    const IndexHeader *header;
+    const IndexTerm *terms;
+} Index;
+
+static int Index_open(Index *index, const char *path) {
+    memset(index, 0, sizeof(*index));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(IndexHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    index->map = map;
+    index->size = st.st_size;
+    const IndexHeader *h = index->header = map;
+
+    // sections must be in order and inside the file
+    int ok = memcmp(h->magic, INDEX_FILE_MAGIC, sizeof(h->magic)) == 0 && h->version == INDEX_FILE_VERSION &&
+             h->size == index->size && h->paths == sizeof(IndexHeader) &&
+             h->terms >= h->paths && h->terms <= h->size && h->terms % 8 == 0 && h->book_count <= (h->terms - h->paths) / 8 &&
+             h->term_count <= (h->size - h->terms) / sizeof(IndexTerm) &&
+             h->names >= h->terms + h->term_count * sizeof(IndexTerm) && h->names <= h->postings && h->postings <= h->size;
+    if (!ok) {
+        munmap(map, index->size);
+        index->map = NULL;
+        return 0;
+    }
+    index->terms = (const IndexTerm *)&index->map[h->terms];
+    return 1;
+}
+
+static void Index_close(Index *index) {
+    if (index->map) munmap((void *)index->map, index->size);
+}
+
+// Returns the term `name`, or NULL if no book holds it (or its entry is invalid).
+static const IndexTerm *Index_find(const Index *index, const char *name, size_t len) {
+    const char *names = (const char *)&index->map[index->header->names];
+    uint64_t names_len = index->header->postings - index->header->names;
+
+    size_t lo = 0, hi = index->header->term_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const IndexTerm *term = &index->terms[mid];
+        if ((uint64_t)term->name + term->name_len > names_len) return NULL;
+
+        int c = index_name_compare(&names[term->name], term->name_len, name, len);
+        if (c == 0) {
+            int valid = term->postings >= index->header->postings && term->postings <= index->size &&
+                        term->postings_len <= index->size - term->postings;
+            return valid ? term : NULL;
+        }
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+// Walks the postings of one term.
+typedef struct {
+    const unsigned char *skips; // NULL with a single block
+    uint32_t blocks;
+    const unsigned char *data;  // first gap
+    const unsigned char *end;
+    const unsigned char *pos;
+    uint32_t count;
+    uint32_t index;             // postings read
+    uint32_t doc;               // last one read
+    int corrupt;
+} IndexCursor;
+
+static uint32_t read_u32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void IndexCursor_init(IndexCursor *c, const Index *index, const IndexTerm *term) {
+    memset(c, 0, sizeof(*c));
+    const unsigned char *start = &index->map[term->postings];
+    c->count = term->count;
+    c->end = start + term->postings_len;
+    c->blocks = (term->count + INDEX_BLOCK - 1) / INDEX_BLOCK;
+    if (c->blocks > 1) {
+        if ((uint64_t)c->blocks * 8 > term->postings_len) {
+            c->count = 0;
+            c->corrupt = 1;
+        } else {
+            c->skips = start;
+            start += (size_t)c->blocks * 8;
+        }
+    }
+    c->data = c->pos = start;
+}
+
+// Reads the next posting into `doc`. Return 0 at the end of the list.
+static int IndexCursor_next(IndexCursor *c) {
+    if (c->index >= c->count) return 0;
+
+    uint32_t gap = 0;
+    for (int shift = 0;; shift += 7) {
+        if (c->pos == c->end || shift > 28) {
+            c->corrupt = 1;
+            c->index = c->count;
+            return 0;
+        }
+        unsigned char byte = *c->pos++;
+        gap |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    c->doc += gap;
+    c->index += 1;
+    return 1;
+}
+
+// Moves to the first posting >= `target`, which may be the current one.
+// Return 0 if there is none.
+static int IndexCursor_seek(IndexCursor *c, uint32_t target) {
+    if (c->index > 0 && c->doc >= target) return 1;
+
+    // block b holds the postings after its skip id, up to the one of block b + 1
+    uint32_t current = c->index > 0 ? (c->index - 1) / INDEX_BLOCK : 0;
+    if (c->skips && current + 1 < c->blocks && read_u32(&c->skips[(size_t)(current + 1) * 8]) < target) {
+        uint32_t lo = current + 2, hi = c->blocks;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (read_u32(&c->skips[(size_t)mid * 8]) < target) lo = mid + 1;
+            else hi = mid;
+        }
+        uint32_t block = lo - 1;
+        uint32_t offset = read_u32(&c->skips[(size_t)block * 8 + 4]);
+        if (offset > (size_t)(c->end - c->data)) {
+            c->corrupt = 1;
+            c->index = c->count;
+            return 0;
+        }
+        c->doc = read_u32(&c->skips[(size_t)block * 8]);
+        c->pos = c->data + offset;
+        c->index = block * INDEX_BLOCK;
+    }
+
+    while (IndexCursor_next(c)) {
+        if (c->doc >= target) return 1;
+    }
+    return 0;
+}
+
+static int term_count_compare(const void *a, const void *b) {
+    const IndexTerm *x = *(const IndexTerm *const *)a, *y = *(const IndexTerm *const *)b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+// Parses "field:value" into the terms of its words, appended to `names`
+// (field code and token, each one prefixed by its length byte).
+static int index_parse_query(const char *arg, StrBuf *names) {
+    const char *colon = strchr(arg, ':');
+    if (!colon) return 0;
+
+    char code = 0;
+    for (size_t i = 0; i < sizeof(index_fields) / sizeof(index_fields[0]); i++) {
+        const char *field = index_fields[i].name;
+        if (strlen(field) == (size_t)(colon - arg) && strncmp(arg, field, colon - arg) == 0) code = index_fields[i].code;
+    }
+    if (!code) return 0;
+
+    char name[1 + INDEX_MAX_TOKEN];
+    size_t len;
+    const char *value = colon + 1;
+    name[0] = code;
+    int words = 0;
+    while ((value = index_next_token(value, &name[1], &len))) {
+        if (len == 0) continue;
+        char prefix = (char)(1 + len);
+        StrBuf_append(names, &prefix, 1);
+        StrBuf_append(names, name, 1 + len);
+        words++;
+    }
+    return words > 0;
+}
+
+static int index_query(int argc, char **argv) {
+    int count_only = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        switch (opt) {
+            case 'n': count_only = 1; break;
+            default:
+                index_usage("epubinfo");
+                return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        index_usage("epubinfo");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    StrBuf names = {0};
+    for (int i = optind + 1; i < argc; i++) {
+        if (!index_parse_query(argv[i], &names)) {
+            fprintf(stderr, "%s: expected field:value with a word, see epubinfo index\n", argv[i]);
+            StrBuf_free(&names);
+            return 1;
+        }
+    }
+
+    Index index;
+    if (!Index_open(&index, argv[optind])) {
+        fprintf(stderr, "%s: not a valid index\n", argv[optind]);
+        StrBuf_free(&names);
+        return 1;
+    }
+
+    // one missing term and nothing matches
+    size_t term_count = 0;
+    const IndexTerm **terms = index_alloc(NULL, (names.len / 2 + 1) * sizeof(*terms));
+    int missing = 0;
+    for (size_t pos = 0; pos < names.len && !missing; pos += 1 + (unsigned char)names.data[pos]) {
+        const IndexTerm *term = Index_find(&index, &names.data[pos + 1], (unsigned char)names.data[pos]);
+        if (term) terms[term_count++] = term;
+        else missing = 1;
+    }
+    qsort(terms, term_count, sizeof(*terms), term_count_compare);
+
+    uint32_t *matches = NULL;
+    size_t match_count = 0;
+    int corrupt = 0;
+    if (!missing && term_count > 0) {
+        IndexCursor cursor;
+        IndexCursor_init(&cursor, &index, terms[0]);
+        matches = index_alloc(NULL, ((size_t)terms[0]->count + 1) * sizeof(uint32_t));
+        while (IndexCursor_next(&cursor)) matches[match_count++] = cursor.doc;
+        corrupt |= cursor.corrupt;
+
+        for (size_t t = 1; t < term_count && match_count > 0; t++) {
+            IndexCursor_init(&cursor, &index, terms[t]);
+            size_t kept = 0;
+            for (size_t i = 0; i < match_count; i++) {
+                if (!IndexCursor_seek(&cursor, matches[i])) break;
+                if (cursor.doc == matches[i]) matches[kept++] = matches[i];
+            }
+            match_count = kept;
+            corrupt |= cursor.corrupt;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    if (count_only) {
+        printf("%zu\n", match_count);
+    } else {
+        const IndexHeader *h = index.header;
+        const uint64_t *path_offsets = (const uint64_t *)&index.map[h->paths];
+        for (size_t i = 0; i < match_count; i++) {
+            uint64_t offset = matches[i] < h->book_count ? path_offsets[matches[i]] : h->terms;
+            const char *path = offset < h->terms ? (const char *)&index.map[offset] : NULL;
+            if (path && memchr(path, '\0', h->terms - offset)) puts(path);
+            else corrupt = 1;
+        }
+    }
+    fflush(stdout);
+
+    if (corrupt) fprintf(stderr, "%s: the index is corrupt\n", argv[optind]);
+    fprintf(stderr, "matches: %zu, books: %llu, time: %.3fms\n", match_count,
+            (unsigned long long)index.header->book_count, elapsed / 1e6);
+
+    free(matches);
+    free(terms);
+    StrBuf_free(&names);
+    Index_close(&index);
+    return corrupt ? 1 : 0;
+}
+
+int cmd_index(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "build") == 0) return index_build(argc - 1, &argv[1]);
+    if (argc > 1 && strcmp(argv[1], "query") == 0) return index_query(argc - 1, &argv[1]);
+    index_usage("epubinfo");
+    return 1;
+}
@@ -0,0 +1,149 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "epubinfo/xml.h"
+#include "epubinfo/zip.h"
+
+#include "cli.h"
+
+// Prints every dc: element of one book, not only the fields the library keeps.
+int cmd_info(const char *filename) {
+    struct timespec real_start, real_end;
+    clock_gettime(CLOCK_MONOTONIC, &real_start);
+
+    ZipArchive za = {0};
+    if (!zip_archive_open(&za, filename)) {
+        printf("Error opening %s, error code: %d\n", filename, errno);
+        return 1;
+    }
+
+    if (!zip_valid_header(&za)) {
+        printf("Invalid zip header file. Exiting...\n");
+        zip_archive_close(&za);
+        return 1;
+    }
+
+    ZipEocdrHeader header;
+    int success = zip_read_end_of_central_directory_record(&za, &header);
+    if (!success) {
+        printf("Can't find End Of Central Directory Record\n");
+        zip_archive_close(&za);
+        return 1;
+    }
+
+    ZipDirectory dir = {0};
+    if (!zip_read_central_directory(&za, &header, &dir, NULL)) {
+        printf("Error reading Central Directory Record\n");
+        zip_archive_close(&za);
+        return 1;
+    }
+
+    // EPUB: META-INF/container.xml decompression
+    const ZipEntry *container = zip_find_entry_by_filename(&dir, "META-INF/container.xml");
+    if (container == NULL) {
+        printf("Invalid EPUB: `META-INF/container.xml` not found.\n");
+        zip_archive_close(&za);
+        zip_directory_free(&dir);
+        return 1;
+    }
+
+    // one decompressor for both entries
+    ZipInflater inflater = {0};
+    char *container_content = zip_inflater_uncompress_entry(&inflater, &za, container);
+    if (container_content == NULL) {
+        printf("Error uncompressing: META-INF/container.xml\n");
+        zip_inflater_free(&inflater);
+        zip_archive_close(&za);
+        zip_directory_free(&dir);
+        return 1;
+    }
+
+    // EPUB: find rootfile filename (xml parsing)
+    XmlParser parser = {0};
+    xml_parser_init(&parser, container_content, container->uncompressed_size);
+
+    XmlValueSlice opf_filename;
+    while (1) {
+        XmlToken value = xml_next_token(&parser);
+        if (value.type == EOF_TAG || value.type == ERROR_TAG) {
+            printf("Invalid epub: rootfile[full-path] not found.\n");
+            return 1;
+        }
+
+        // <rootfile full-path="..." />
+        if (xml_slice_tag_attribute(value.value, "full-path", &opf_filename)) break;
+    }
+
+    // EPUB: rootfile decompression
+    const ZipEntry *opf_entry = zip_find_entry(&dir, opf_filename.text, opf_filename.len);
+    if (opf_entry == NULL) {
+        printf("opf entry not found.\n");
+        return 1;
+    }
+
+    char *opf_content = zip_inflater_uncompress_entry(&inflater, &za, opf_entry);
+    zip_inflater_free(&inflater);
+    if (opf_content == NULL) {
+        printf("opf entry uncompression failed.\n");
+        return 1;
+    }
+
+    // EPUB: get book metadata (xml parsing)
+    // reset parser
+    xml_parser_init(&parser, opf_content, opf_entry->uncompressed_size);
+
+    // move parser cursor until metadata
+    int inside_metadata = 0;
+    while (!inside_metadata) {
+        XmlToken value = xml_next_token(&parser);
+        if (value.type == EOF_TAG || value.type == ERROR_TAG) {
+            printf("Invalid epub: metadata not found.\n");
+            return 1;
+        }
+        if (value.type == OPEN_TAG || value.type == CLOSE_TAG || value.type == SELF_CLOSE_TAG) {
+            if (xml_slice_equals(xml_slice_tag_name(value.value), "metadata")) inside_metadata = 1;
+        }
+    }
+
+    // start reading metadata
+    // reading until </metadata> is found
+    while (1) {
+        XmlToken value = xml_next_token(&parser);
+        if (value.type == EOF_TAG || value.type == ERROR_TAG) break;
+
+        if (value.type == CLOSE_TAG) {
+            if (xml_slice_equals(xml_slice_tag_name(value.value), "metadata")) break;
+        }
+
+        if (value.type == OPEN_TAG) {
+            XmlValueSlice tag_name = xml_slice_tag_name(value.value);
+            if (tag_name.len > 3 && memcmp(tag_name.text, "dc:", 3) == 0) {
+                XmlToken text = xml_next_token(&parser);
+                if (text.type != TEXT_TAG) {
+                    printf("Malformed epub (%.*s).\n", (int)tag_name.len - 3, &tag_name.text[3]);
+                    return 1;
+                }
+
+                printf("%.*s: %.*s\n", (int)tag_name.len - 3, &tag_name.text[3], (int)text.value.len, text.value.text);
+            }
+        }
+    }
+
+    zip_archive_close(&za);
+    zip_directory_free(&dir);
+    free(container_content);
+    free(opf_content);
+
+    clock_gettime(CLOCK_MONOTONIC, &real_end);
+    double real_time_ms = (real_end.tv_sec - real_start.tv_sec) * 1000.0 + (real_end.tv_nsec - real_start.tv_nsec) / 1e6;
+
+    printf("\nTotal time: %.3fms\n", real_time_ms);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cli.h"
+
+void StrBuf_reserve(StrBuf *b, size_t len) {
+    if (b->len + len + 1 > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 256;
+        while (b->len + len + 1 > capacity) capacity *= 2;
+
+        char *data = realloc(b->data, capacity);
+        if (!data) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        b->data = data;
+        b->capacity = capacity;
+    }
+}
+
+void StrBuf_append(StrBuf *b, const char *s, size_t len) {
+    StrBuf_reserve(b, len);
+    memcpy(&b->data[b->len], s, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+void StrBuf_puts(StrBuf *b, const char *s) {
+    StrBuf_append(b, s, strlen(s));
+}
+
+void StrBuf_free(StrBuf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+void json_append_string(StrBuf *b, const char *s) {
+    StrBuf_append(b, "\"", 1);
+
+    // copy runs of plain bytes at once
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        StrBuf_append(b, run, s - run);
+        run = s + 1;
+
+        char escape[8];
+        switch (c) {
+            case '"':  StrBuf_append(b, "\\\"", 2); break;
+            case '\\': StrBuf_append(b, "\\\\", 2); break;
+            case '\n': StrBuf_append(b, "\\n", 2); break;
+            case '\r': StrBuf_append(b, "\\r", 2); break;
+            case '\t': StrBuf_append(b, "\\t", 2); break;
+            default:
+                snprintf(escape, sizeof(escape), "\\u%04x", c);
+                StrBuf_append(b, escape, 6);
+        }
+    }
+
+    StrBuf_append(b, run, s - run);
+    StrBuf_append(b, "\"", 1);
+}
+
+static void json_append_field(StrBuf *b, const char *key, const char *value) {
+    StrBuf_puts(b, ",\"");
+    StrBuf_puts(b, key);
+    StrBuf_puts(b, "\":");
+    json_append_string(b, value);
+}
+
+static void json_append_list(StrBuf *b, const char *key, const EpubMetadata *meta,
+                             int (*count)(const EpubMetadata *), const char *(*get)(const EpubMetadata *, int)) {
+    StrBuf_puts(b, ",\"");
+    StrBuf_puts(b, key);
+    StrBuf_puts(b, "\":[");
+
+    int n = count(meta);
+    for (int i = 0; i < n; i++) {
+        if (i > 0) StrBuf_append(b, ",", 1);
+        json_append_string(b, get(meta, i));
+    }
+    StrBuf_append(b, "]", 1);
+}
+
+void json_append_document(StrBuf *b, const char *path, EpubDocument *doc, EpubError error) {
+    // every other field starts with a comma
+    StrBuf_puts(b, "{\"path\":");
+    if (path) json_append_string(b, path);
+    else StrBuf_puts(b, "null");
+
+    if (!doc) {
+        json_append_field(b, "error", EpubError_string(error));
+        StrBuf_puts(b, "}\n");
+        return;
+    }
+
+    const EpubMetadata *meta = EpubDocument_get_metadata(doc);
+    json_append_field(b, "title", EpubMetadata_get_title(meta));
+    json_append_field(b, "subtitle", EpubMetadata_get_subtitle(meta));
+    json_append_field(b, "language", EpubMetadata_get_language(meta));
+    json_append_field(b, "description", EpubMetadata_get_description(meta));
+    json_append_field(b, "publisher", EpubMetadata_get_publisher(meta));
+    json_append_list(b, "authors", meta, EpubMetadata_get_author_count, EpubMetadata_get_author);
+    json_append_list(b, "creators", meta, EpubMetadata_get_creator_count, EpubMetadata_get_creator);
+    json_append_list(b, "identifiers", meta, EpubMetadata_get_identifier_count, EpubMetadata_get_identifier);
+    StrBuf_puts(b, "}\n");
+}
@@ -1,163 +1,85 @@
-#include <inttypes.h>
-#include <stdint.h>
+#include <getopt.h>
 #include <stdio.h>
-#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
-
-#include <zlib.h>
-
-#include "epubinfo/xml.h"
-#include "epubinfo/arena.h"
-#include "epubinfo/zip.h"
-
+#include <unistd.h>
+
+#include "cli.h"
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s <epub_filename>\n"
+            "       %s -r <dir> [-j threads] [-u] [-c cache [-I]] [--verify]\n"
+            "       %s --dedupe <dir> [-j threads]\n"
+            "       %s watch <dir> -c <cache> [-j threads]\n"
+            "       %s serve --socket <path> [-j threads] [-c cache]\n"
+            "       %s client --socket <path> [--fd] [--cover <dir>] <epub>...\n"
+            "       %s text [-j threads] [-q] <epub>...\n"
+            "       %s index build <dir> -o <index> [-j threads] [-c cache]\n"
+            "       %s index query <index> [-n] <field:value>...\n"
+            "\n"
+            "  -r <dir>      scan every .epub under <dir>, one JSON record per line\n"
+            "  -j <threads>  number of workers (default: one per CPU)\n"
+            "  -u            print records as they complete instead of in path order\n"
+            "  -c <cache>    serve unchanged books from (and add new ones to) a cache file\n"
+            "  -I            clear the cache before scanning\n"
+            "  --verify      check every entry against its CRC-32, corrupt books are errors\n"
+            "  --dedupe <dir> group the books under <dir> holding the same files, one JSON\n"
+            "                record per group (only the end of each file is read)\n",
+            program, program, program, program, program, program, program, program, program);
+}
 
 int main(int argc, char** argv) {
-    if (argc < 2) {
-        printf("Usage: %s <epub_filename>\nExiting...", argv[0]);
-        return 1;
-    }
-
-    struct timespec real_start, real_end;
-    clock_gettime(CLOCK_MONOTONIC, &real_start);
-
-    FILE *fp = fopen(argv[1], "rb");
-    if (fp == NULL) {
-        printf("Error opening %s, error code: %d\n", argv[1], errno);
-        return 1;
-    }
-
-    if (!zip_valid_header(fp)) {
-        printf("Invalid zip header file. Exiting...\n");
-        fclose(fp);
-        return 1;
-    }
-
-    ZipEocdrHeader header;
-    int success = zip_read_end_of_central_directory_record(fp, &header);
-    if (!success) {
-        printf("Can't find End Of Central Directory Record\n");
-        fclose(fp);
-        return 1;
-    }
-
-    ZipEntry *entries = zip_read_central_directory(fp, header);
-    if (entries == NULL) {
-        printf("Error reading Central Directory Record\n");
-        fclose(fp);
-        return 1;
-    }
-
-    // EPUB: META-INF/container.xml decompression
-    ZipEntry *container = zip_find_entry_by_filename(entries, header.num_of_entries, "META-INF/container.xml");
-    if (container == NULL) {
-        printf("Invalid EPUB: `META-INF/container.xml` not found.\n");
-        fclose(fp);
-        free(entries);
-        return 1;
-    }
-
-    char *container_content = zip_uncompress_entry(fp, container);
-    if (container_content == NULL) {
-        printf("Error uncompressing: META-INF/container.xml\n");
-        fclose(fp);
-        free(entries);
-        return 1;
+    if (argc > 1 && strcmp(argv[1], "watch") == 0) return cmd_watch(argc - 1, &argv[1]);
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) return cmd_serve(argc - 1, &argv[1]);
+    if (argc > 1 && strcmp(argv[1], "client") == 0) return cmd_client(argc - 1, &argv[1]);
+    if (argc > 1 && strcmp(argv[1], "text") == 0) return cmd_text(argc - 1, &argv[1]);
+    if (argc > 1 && strcmp(argv[1], "index") == 0) return cmd_index(argc - 1, &argv[1]);
+
+    ScanOptions scan = { .ordered = 1 };
+    const char *dedupe_dir = NULL;
+
+    static const struct option options[] = {
+        { "verify", no_argument, NULL, 'V' },
+        { "dedupe", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:j:uc:I", options, NULL)) != -1) {
+        switch (opt) {
+            case 'r': scan.dir = optarg; break;
+            case 'j': scan.threads = atoi(optarg); break;
+            case 'u': scan.ordered = 0; break;
+            case 'c': scan.cache_path = optarg; break;
+            case 'I': scan.clear_cache = 1; break;
+            case 'V': scan.verify = 1; break;
+            case 'D': dedupe_dir = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
     }
 
-    // EPUB: find rootfile filename (xml parsing)
-    XmlParser parser = {0};
-    parser.content = container_content;
-    Arena arena = {0};
-    arena_init(&arena, 1024);
-
-    XmlValue value = {0};
-    char *opf_filename;
-    while (1) {
-        value = xml_next(&arena, &parser);
-        if (value.type == EOF_TAG || value.type == ERROR_TAG) {
-            printf("Invalid epub: rootfile[full-path] not found.\n");
+    if (dedupe_dir) {
+        if (optind != argc || scan.dir || scan.threads < 0) {
+            usage(argv[0]);
             return 1;
         }
-        // <rootfile full-path="..." />
-        if (value.type != SELF_CLOSE_TAG) {
-            arena_reset(&arena);
-        }
-
-        char *fullpath = xml_tag_get_attribute(&arena, value.content, "full-path");
-        if (fullpath != NULL) {
-            opf_filename = fullpath;
-            break;
-        }
-    }
-
-    // EPUB: rootfile decompression
-    ZipEntry *opf_entry = zip_find_entry_by_filename(entries, header.num_of_entries, opf_filename);
-    if (opf_entry == NULL) {
-        printf("opf entry not found.\n");
-        return 1;
-    }
-
-    char *opf_content = zip_uncompress_entry(fp, opf_entry);
-    if (opf_content == NULL) {
-        printf("opf entry uncompression failed.\n");
-        return 1;
+        return cmd_dedupe(dedupe_dir, scan.threads);
     }
 
-    // EPUB: get book metadata (xml parsing)
-    // We are not using opf_filename anymore so it's safe to reset the arena
-    arena_reset(&arena);
-
-    // reset parser
-    parser.cursor = 0;
-    parser.content = opf_content;
-
-    // move parser cursor until metadata
-    int inside_metadata = 0;
-    while (!inside_metadata) {
-        XmlValue value = xml_next(&arena, &parser);
-        if (value.type == OPEN_TAG || value.type == CLOSE_TAG || value.type == SELF_CLOSE_TAG) {
-            char *name = xml_tag_get_name(&arena, value.content);
-            if (strcmp(name, "metadata") == 0) inside_metadata = 1;
+    if (scan.dir) {
+        if (optind != argc || scan.threads < 0 || (scan.clear_cache && !scan.cache_path)) {
+            usage(argv[0]);
+            return 1;
         }
-        arena_reset(&arena);
+        return cmd_scan(&scan);
     }
 
-    // start reading metadata
-    // reading until </metadata> is found
-    while (1) {
-        XmlValue value = xml_next(&arena, &parser);
-        if (value.type == CLOSE_TAG) {
-            char *tag_name = xml_tag_get_name(&arena, value.content);
-            if (strcmp(tag_name, "metadata") == 0) break;
-        }
-
-        if (value.type == OPEN_TAG) {
-            char *tag_name = xml_tag_get_name(&arena, value.content);
-            if (tag_name[0] == 'd' && tag_name[1] == 'c' && tag_name[2] == ':') {
-                XmlValue text = xml_next(&arena, &parser);
-                if (text.type != TEXT_TAG) {
-                    printf("Malformed epub (%s).\n", &tag_name[3]);
-                    return 1;
-                }
-
-                printf("%s: %s\n", &tag_name[3], text.content);
-            }
-        }
-
-        arena_reset(&arena);
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
     }
-
-    fclose(fp);
-    free(entries);
-    free(container_content);
-    free(opf_content);
-    arena_free(&arena);
-
-    clock_gettime(CLOCK_MONOTONIC, &real_end);
-    double real_time_ms = (real_end.tv_sec - real_start.tv_sec) * 1000.0 + (real_end.tv_nsec - real_start.tv_nsec) / 1e6;
-
-    printf("\nTotal time: %.3fms\n", real_time_ms);
-    return 0;
+    return cmd_info(argv[optind]);
 }
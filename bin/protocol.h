@@ -0,0 +1,66 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// `epubinfo serve` protocol, over a Unix stream socket
+//
+// Every message is a frame: a 4 bytes length followed by that many bytes.
+// Numbers are little-endian. A connection carries any number of requests,
+// a client can send the next ones before reading the responses (pipelining),
+// responses come back in request order.
+//
+// Request
+//
+// Bytes | Description
+// ------+-------------------------------------------------------------------------
+//     4 | Request id, echoed in the response
+//     1 | Kind: PROTOCOL_PATH or PROTOCOL_FD
+//     1 | Flags: PROTOCOL_WANT_COVER
+//     2 | Reserved
+//     n | Path of the book (PROTOCOL_PATH only, not null terminated)
+//
+// A PROTOCOL_FD request carries an open file descriptor of the book as
+// SCM_RIGHTS data, sent with the frame in a single sendmsg.
+//
+// Response
+//
+// Bytes | Description
+// ------+-------------------------------------------------------------------------
+//     4 | Request id
+//     1 | EpubError (0 on success)
+//     1 | Flags: PROTOCOL_HAS_COVER
+//     2 | Reserved
+//     4 | JSON length
+//     n | JSON record, the same one `epubinfo -r` prints
+//     m | Cover bytes (the rest of the frame), only with PROTOCOL_HAS_COVER
+
+#define PROTOCOL_PATH 1
+#define PROTOCOL_FD 2
+
+#define PROTOCOL_WANT_COVER 0x01
+#define PROTOCOL_HAS_COVER 0x01
+
+#define PROTOCOL_REQUEST_HEADER_LEN 8
+#define PROTOCOL_RESPONSE_HEADER_LEN 12
+#define PROTOCOL_MAX_REQUEST_LEN (PROTOCOL_REQUEST_HEADER_LEN + 4096)
+
+void put_le32(unsigned char *p, uint32_t value);
+uint32_t get_le32(const unsigned char *p);
+
+/// Reads exactly `len` bytes. Return 1 on success, 0 on error or end of stream.
+int read_full(int fd, void *buf, size_t len);
+
+/// Writes exactly `len` bytes. Return 1 on success, 0 on error.
+int write_full(int fd, const void *buf, size_t len);
+
+/// Reads a frame length, and the file descriptor sent with it if any
+/// (`*passed_fd` = -1 otherwise). Return 1 on success, 0 on error or end of stream.
+int protocol_read_length(int sock, uint32_t *len, int *passed_fd);
+
+/// Sends `len` bytes in one sendmsg, with `passed_fd` as SCM_RIGHTS data if it's not -1.
+/// Return 1 on success, 0 on error.
+int protocol_send(int sock, const void *buf, size_t len, int passed_fd);
+
+#endif
@@ -0,0 +1,144 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cli.h"
+
+typedef struct {
+    const Book *books;
+    int ordered;
+    int verify;
+    pthread_mutex_t lock;
+    char **pending;             // ordered mode: records waiting for the ones before them
+    size_t next;                // ordered mode: next record to print
+    uint64_t *latency_ns;
+    size_t errors;
+    size_t cached;
+} Scan;
+
+static int u64_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted `values`.
+static uint64_t percentile(const uint64_t *values, size_t count, unsigned p) {
+    if (count == 0) return 0;
+    size_t rank = (count * p + 99) / 100;
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+static void scan_record(void *user, size_t index, const EpubBatchResult *result) {
+    Scan *scan = user;
+    const char *path = scan->books[index].path;
+    EpubDocument *doc = result->doc;
+    EpubError error = result->error;
+
+    // runs on the worker that opened the book, books are verified in parallel
+    if (doc && scan->verify) {
+        const char *entry;
+        error = EpubDocument_verify(doc, &entry);
+        if (error != EPUB_OK) {
+            fprintf(stderr, "%s: %s: %s\n", path, entry ? entry : "-", EpubError_string(error));
+            EpubDocument_free(doc);
+            doc = NULL;
+        }
+    }
+
+    StrBuf record = {0};
+    json_append_document(&record, path, doc, error);
+    int failed = doc == NULL;
+    EpubDocument_free(doc);
+    scan->latency_ns[index] = result->elapsed_ns;
+
+    pthread_mutex_lock(&scan->lock);
+    if (failed) scan->errors += 1;
+    if (result->cached) scan->cached += 1;
+
+    if (!scan->ordered) {
+        fwrite(record.data, 1, record.len, stdout);
+        StrBuf_free(&record);
+    } else {
+        scan->pending[index] = record.data;
+        while (scan->pending[scan->next]) {
+            fputs(scan->pending[scan->next], stdout);
+            free(scan->pending[scan->next]);
+            scan->pending[scan->next] = NULL;
+            scan->next += 1;
+        }
+    }
+    pthread_mutex_unlock(&scan->lock);
+}
+
+int cmd_scan(const ScanOptions *options) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    EpubCache *cache = NULL;
+    if (options->cache_path) {
+        EpubError cache_err;
+        cache = EpubCache_new(options->cache_path, &cache_err);
+        if (!cache) {
+            fprintf(stderr, "%s: %s\n", options->cache_path, EpubError_string(cache_err));
+            return 1;
+        }
+        if (options->clear_cache && EpubCache_clear(cache) != 0) {
+            fprintf(stderr, "%s: can't clear the cache\n", options->cache_path);
+            EpubCache_free(cache);
+            return 1;
+        }
+    }
+
+    BookList list = {0};
+    walk_tree(&list, options->dir, NULL, NULL);
+    BookList_sort_unique(&list);
+
+    uint64_t total_bytes = 0;
+    const char **filenames = malloc((list.count + 1) * sizeof(*filenames));
+    Scan scan = {
+        .books = list.books,
+        .ordered = options->ordered,
+        .verify = options->verify,
+        .pending = calloc(list.count + 1, sizeof(*scan.pending)), // + 1: sentinel for the flush loop
+        .latency_ns = malloc((list.count + 1) * sizeof(*scan.latency_ns)),
+    };
+    if (!filenames || !scan.pending || !scan.latency_ns) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    pthread_mutex_init(&scan.lock, NULL);
+
+    for (size_t i = 0; i < list.count; i++) {
+        filenames[i] = list.books[i].path;
+        total_bytes += list.books[i].size;
+    }
+
+    EpubError err = EpubCache_open_batch_each(cache, filenames, list.count, EPUB_FIELD_ALL, options->threads, scan_record, &scan);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (err != EPUB_OK) {
+        fprintf(stderr, "Scan failed: %s\n", EpubError_string(err));
+    } else {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        qsort(scan.latency_ns, list.count, sizeof(*scan.latency_ns), u64_compare);
+
+        fprintf(stderr, "books: %zu, errors: %zu, cached: %zu, time: %.3fs, %.1f books/s, %.1f MB/s, p50: %.3fms, p99: %.3fms\n",
+                list.count, scan.errors, scan.cached, seconds,
+                seconds > 0 ? list.count / seconds : 0.0,
+                seconds > 0 ? total_bytes / 1e6 / seconds : 0.0,
+                percentile(scan.latency_ns, list.count, 50) / 1e6,
+                percentile(scan.latency_ns, list.count, 99) / 1e6);
+    }
+
+    EpubCache_free(cache);
+    pthread_mutex_destroy(&scan.lock);
+    BookList_free(&list);
+    free(filenames);
+    free(scan.pending);
+    free(scan.latency_ns);
+    return err == EPUB_OK ? 0 : 1;
+}
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE // memfd_create
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "protocol.h"
+
+// Every worker owns a warm context and waits on one epoll set shared by all
+// of them, holding the listening socket and every open connection, so there
+// is no dispatch queue between them. A readable connection is taken by a
+// single worker (EPOLLONESHOT) for one request and then handed back: idle
+// connections hold no worker, and the requests of a connection are still
+// served in order.
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    EpubCache *cache;           // may be NULL
+} Server;
+
+// A client that stops in the middle of a frame, or doesn't read its
+// responses, only holds a worker this long before its connection is closed.
+#define SERVE_IO_TIMEOUT_SEC 5
+
+typedef struct {
+    Server *server;
+    EpubContext *ctx;
+    int cover_fd;               // memfd the cover is extracted to, -1 if unavailable
+    StrBuf json;
+    unsigned char request[PROTOCOL_MAX_REQUEST_LEN];
+} ServeWorker;
+
+static const char *socket_path;
+
+static void serve_stop(int sig) {
+    (void)sig;
+    unlink(socket_path);
+    _exit(0);
+}
+
+static int64_t fd_size(void *ctx) {
+    struct stat st;
+    return fstat(*(int *)ctx, &st) == 0 ? st.st_size : -1;
+}
+
+static int fd_read_at(void *ctx, uint64_t offset, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(*(int *)ctx, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Extracts the cover to the worker memfd, returns its size or -1.
+static off_t serve_cover(ServeWorker *worker, EpubDocument *doc) {
+    if (worker->cover_fd < 0) return -1;
+    if (ftruncate(worker->cover_fd, 0) != 0 || lseek(worker->cover_fd, 0, SEEK_SET) != 0) return -1;
+    if (EpubDocument_write_cover(doc, worker->cover_fd) != EPUB_OK) return -1;
+    return lseek(worker->cover_fd, 0, SEEK_CUR);
+}
+
+static int serve_request(ServeWorker *worker, int conn, size_t len, int passed_fd) {
+    const unsigned char *req = worker->request;
+    uint32_t id = get_le32(req);
+    int kind = req[4];
+    int flags = req[5];
+
+    EpubDocument *doc = NULL;
+    EpubError err = EPUB_ERROR_INVALID_ARGUMENT;
+    const char *path = NULL;
+    char path_buf[PROTOCOL_MAX_REQUEST_LEN];
+
+    if (kind == PROTOCOL_PATH && len > PROTOCOL_REQUEST_HEADER_LEN) {
+        size_t path_len = len - PROTOCOL_REQUEST_HEADER_LEN;
+        memcpy(path_buf, &req[PROTOCOL_REQUEST_HEADER_LEN], path_len);
+        path_buf[path_len] = '\0';
+        path = path_buf;
+
+        if (worker->server->cache) {
+            doc = EpubCache_open_file(worker->server->cache, worker->ctx, path, EPUB_FIELD_ALL, &err);
+        } else {
+            doc = EpubContext_open_file(worker->ctx, path, EPUB_FIELD_ALL, &err);
+        }
+    } else if (kind == PROTOCOL_FD && passed_fd >= 0) {
+        // `passed_fd` outlives the document, the cover is read through it too
+        EpubReader reader = { &passed_fd, fd_size, fd_read_at };
+        doc = EpubContext_open_reader(worker->ctx, &reader, EPUB_FIELD_ALL, &err);
+    }
+
+    // the frame header is filled in front of the record once the sizes are known
+    unsigned char header[4 + PROTOCOL_RESPONSE_HEADER_LEN] = {0};
+    worker->json.len = 0;
+    StrBuf_append(&worker->json, (const char *)header, sizeof(header));
+    json_append_document(&worker->json, path, doc, err);
+    size_t json_len = worker->json.len - sizeof(header);
+
+    off_t cover_size = -1;
+    if (doc && (flags & PROTOCOL_WANT_COVER)) cover_size = serve_cover(worker, doc);
+    EpubDocument_free(doc);
+    if (cover_size > 0 && PROTOCOL_RESPONSE_HEADER_LEN + json_len + (uint64_t)cover_size > UINT32_MAX) {
+        cover_size = -1; // doesn't fit in a frame
+    }
+
+    unsigned char *frame = (unsigned char *)worker->json.data;
+    put_le32(&frame[0], PROTOCOL_RESPONSE_HEADER_LEN + json_len + (cover_size > 0 ? cover_size : 0));
+    put_le32(&frame[4], id);
+    frame[8] = err;
+    frame[9] = cover_size >= 0 ? PROTOCOL_HAS_COVER : 0;
+    put_le32(&frame[12], json_len);
+    if (!write_full(conn, frame, worker->json.len)) return 0;
+
+    // the image goes from the memfd to the socket without a copy in user space
+    off_t offset = 0;
+    while (cover_size > 0 && offset < cover_size) {
+        ssize_t sent = sendfile(conn, worker->cover_fd, &offset, cover_size - offset);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return 0;
+    }
+    return 1;
+}
+
+// Serves the next request of `conn`. Return 0 once the connection is done.
+static int serve_connection(ServeWorker *worker, int conn) {
+    uint32_t len;
+    int passed_fd;
+    if (!protocol_read_length(conn, &len, &passed_fd)) return 0;
+
+    int ok = len >= PROTOCOL_REQUEST_HEADER_LEN && len <= PROTOCOL_MAX_REQUEST_LEN &&
+             read_full(conn, worker->request, len) &&
+             serve_request(worker, conn, len, passed_fd);
+    if (passed_fd >= 0) close(passed_fd);
+    return ok;
+}
+
+// Adds the pending connections to the epoll set. Return 0 if the listening
+// socket failed.
+static int serve_accept(Server *server) {
+    while (1) {
+        int conn = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EMFILE || errno == ENFILE) return 1;
+            perror("accept");
+            return 0;
+        }
+
+        struct timeval timeout = { SERVE_IO_TIMEOUT_SEC, 0 };
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = conn };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, conn, &event) != 0) close(conn);
+    }
+}
+
+static void *serve_worker(void *arg) {
+    Server *server = arg;
+    ServeWorker *worker = calloc(1, sizeof(ServeWorker));
+    if (!worker) return NULL;
+
+    worker->server = server;
+    worker->ctx = EpubContext_new();
+    worker->cover_fd = memfd_create("epubinfo-cover", MFD_CLOEXEC);
+    if (!worker->ctx) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    while (1) {
+        struct epoll_event event;
+        int n = epoll_wait(server->epoll_fd, &event, 1, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        if (n == 0) continue;
+
+        int fd = event.data.fd;
+        if (fd == server->listen_fd) {
+            if (!serve_accept(server)) break;
+        } else if (!(event.events & EPOLLIN) || !serve_connection(worker, fd)) {
+            close(fd); // also leaves the epoll set
+            continue;
+        }
+
+        // back in the set, a pipelined request already buffered wakes the next worker at once
+        event.events = EPOLLIN | EPOLLONESHOT;
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    EpubContext_free(worker->ctx);
+    if (worker->cover_fd >= 0) close(worker->cover_fd);
+    StrBuf_free(&worker->json);
+    free(worker);
+    return NULL;
+}
+
+static void serve_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s serve --socket <path> [-j threads] [-c cache]\n"
+            "\n"
+            "  --socket <path>  Unix socket to listen on\n"
+            "  -j <threads>     number of workers (default: one per CPU)\n"
+            "  -c <cache>       serve unchanged books from (and add new ones to) a cache file\n",
+            program);
+}
+
+int cmd_serve(int argc, char **argv) {
+    static const struct option options[] = {
+        { "socket", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int threads = 0;
+    const char *cache_path = NULL;
+    socket_path = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:c:", options, NULL)) != -1) {
+        switch (opt) {
+            case 's': socket_path = optarg; break;
+            case 'j': threads = atoi(optarg); break;
+            case 'c': cache_path = optarg; break;
+            default:
+                serve_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!socket_path || optind != argc || threads < 0) {
+        serve_usage(argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    Server server = { .listen_fd = -1, .epoll_fd = -1 };
+    if (cache_path) {
+        EpubError err;
+        server.cache = EpubCache_new(cache_path, &err);
+        if (!server.cache) {
+            fprintf(stderr, "%s: %s\n", cache_path, EpubError_string(err));
+            return 1;
+        }
+    }
+
+    // a socket left behind by a previous daemon is replaced
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+
+    // non-blocking: a worker woken for the listening socket accepts until it's drained
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (server.listen_fd < 0 || bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(server.listen_fd, SOMAXCONN) != 0) {
+        perror(socket_path);
+        if (server.listen_fd >= 0) close(server.listen_fd);
+        EpubCache_free(server.cache);
+        return 1;
+    }
+
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = server.listen_fd };
+    if (server.epoll_fd < 0 || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event) != 0) {
+        perror("epoll");
+        if (server.epoll_fd >= 0) close(server.epoll_fd);
+        unlink(socket_path);
+        close(server.listen_fd);
+        EpubCache_free(server.cache);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // a client going away only ends its connection
+    signal(SIGINT, serve_stop);
+    signal(SIGTERM, serve_stop);
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    fprintf(stderr, "Listening on %s with %d workers\n", socket_path, threads);
+
+    // the calling thread is the last worker
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_worker, &server) == 0) pthread_detach(thread);
+    }
+    serve_worker(&server);
+
+    unlink(socket_path);
+    close(server.epoll_fd);
+    close(server.listen_fd);
+    EpubCache_free(server.cache);
+    return 1;
+}
@@ -0,0 +1,97 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cli.h"
+
+// Prints the text of every book, chapters separated by a blank line, and the
+// throughput of the whole pipeline (read, inflate, tokenize, decode) on stderr.
+
+typedef struct {
+    int quiet;
+    int chapter;                // last chapter printed, -1 before the first
+} TextOutput;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int text_print(void *user, int chapter, const char *text, size_t len) {
+    TextOutput *out = user;
+    if (out->quiet) return 0;
+
+    if (chapter != out->chapter && out->chapter >= 0) fputc('\n', stdout);
+    out->chapter = chapter;
+    return fwrite(text, 1, len, stdout) != len; // stop once stdout is gone
+}
+
+static void text_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s text [-j threads] [-q] <epub>...\n"
+            "\n"
+            "  -j <threads>  chapters read at once (default: one per CPU)\n"
+            "  -q            don't print the text, only the throughput\n",
+            program);
+}
+
+int cmd_text(int argc, char **argv) {
+    int threads = 0;
+    TextOutput out = {0};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:q")) != -1) {
+        switch (opt) {
+            case 'j': threads = atoi(optarg); break;
+            case 'q': out.quiet = 1; break;
+            default:
+                text_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind == argc || threads < 0) {
+        text_usage(argv[0]);
+        return 1;
+    }
+
+    EpubContext *ctx = EpubContext_new();
+    if (!ctx) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    EpubTextStats total = {0};
+    int failed = 0;
+    uint64_t start = now_ns();
+
+    for (int i = optind; i < argc; i++) {
+        EpubError err;
+        EpubDocument *doc = EpubContext_open_file(ctx, argv[i], EPUB_FIELD_ALL, &err);
+        if (doc) {
+            EpubTextStats stats;
+            out.chapter = -1;
+            err = EpubDocument_extract_text(doc, threads, text_print, &out, &stats);
+            if (!out.quiet && out.chapter >= 0) fputc('\n', stdout);
+
+            total.chapters += stats.chapters;
+            total.compressed_bytes += stats.compressed_bytes;
+            total.input_bytes += stats.input_bytes;
+            total.text_bytes += stats.text_bytes;
+            EpubDocument_free(doc);
+        }
+        if (err != EPUB_OK) {
+            fprintf(stderr, "%s: %s\n", argv[i], EpubError_string(err));
+            failed = 1;
+        }
+    }
+
+    EpubContext_free(ctx);
+    fflush(stdout);
+    double seconds = (now_ns() - start) / 1e9;
+    fprintf(stderr, "books: %d, chapters: %llu, input: %.1f MB (%.1f MB compressed), text: %.1f MB, time: %.3fs, %.1f MB/s\n",
+            argc - optind, (unsigned long long)total.chapters, total.input_bytes / 1e6, total.compressed_bytes / 1e6,
+            total.text_bytes / 1e6, seconds, seconds > 0 ? total.input_bytes / 1e6 / seconds : 0.0);
+    return failed;
+}
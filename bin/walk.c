@@ -0,0 +1,100 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "cli.h"
+
+int is_epub(const char *name) {
+    size_t len = strlen(name);
+    return len > 5 && strcasecmp(&name[len - 5], ".epub") == 0;
+}
+
+char *path_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    size_t path_len = dir_len + slash + strlen(name);
+
+    char *path = malloc(path_len + 1);
+    if (!path) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    snprintf(path, path_len + 1, "%s%s%s", dir, slash ? "/" : "", name);
+    return path;
+}
+
+void BookList_add(BookList *list, char *path, uint64_t size) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        Book *books = realloc(list->books, capacity * sizeof(*books));
+        if (!books) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        list->books = books;
+        list->capacity = capacity;
+    }
+
+    list->books[list->count++] = (Book){ .path = path, .size = size };
+}
+
+static int book_compare(const void *a, const void *b) {
+    return strcmp(((const Book *)a)->path, ((const Book *)b)->path);
+}
+
+void BookList_sort_unique(BookList *list) {
+    if (list->count == 0) return;
+    qsort(list->books, list->count, sizeof(*list->books), book_compare);
+
+    size_t kept = 1;
+    for (size_t i = 1; i < list->count; i++) {
+        if (strcmp(list->books[i].path, list->books[kept - 1].path) == 0) {
+            free(list->books[i].path);
+        } else {
+            list->books[kept++] = list->books[i];
+        }
+    }
+    list->count = kept;
+}
+
+void BookList_free(BookList *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->books[i].path);
+    free(list->books);
+    memset(list, 0, sizeof(*list));
+}
+
+// Symlinked directories are not followed, so there are no cycles.
+void walk_tree(BookList *list, const char *dir, WalkDirCallback on_dir, void *user) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return;
+    }
+    if (on_dir) on_dir(user, dir);
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (ent->d_type != DT_DIR && ent->d_type != DT_UNKNOWN && !is_epub(ent->d_name)) continue;
+
+        char *path = path_join(dir, ent->d_name);
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            walk_tree(list, path, on_dir, user);
+            free(path);
+            continue;
+        }
+
+        // symlinked books are fine, the size is the one of the target
+        if (is_epub(ent->d_name) && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            BookList_add(list, path, st.st_size);
+        } else {
+            free(path);
+        }
+    }
+
+    closedir(d);
+}
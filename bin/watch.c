@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+
+// Keeps a cache in sync with a library directory. Every directory of the
+// tree has an inotify watch, books that are written or moved in are opened
+// through the cache (so it gets a new record), the rest of the tree is never
+// read again. Only a queue overflow, where events were lost, walks the
+// whole tree: unchanged books are cache hits there, so no EPUB is read.
+// The device and inode of every book are remembered, so the cache entry of a
+// book deleted or moved away can still be dropped once it can't be stat'd.
+
+#define WATCH_DIR_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+
+// A book of the tree, with the identity its cache entry is keyed by.
+typedef struct {
+    char *path;
+    uint64_t dev;
+    uint64_t ino;
+    int gone;                   // removed, dropped by the next compaction
+} WatchBook;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int live;                   // still the identity of a book (moved within the tree)
+} WatchId;
+
+typedef struct {
+    int fd;                     // inotify instance
+    char **dirs;                // path of every watch descriptor, NULL if unused
+    size_t dir_capacity;
+    size_t dir_count;
+    int out_of_watches;         // warned once
+    EpubCache *cache;
+    int threads;
+    WatchBook *books;           // sorted by path
+    size_t book_count;
+    WatchId *stale;             // identities of removed or replaced books
+    size_t stale_count;
+    size_t stale_capacity;
+} Watch;
+
+typedef struct {
+    const char *const *paths;
+    int print_hits;
+    pthread_mutex_t lock;       // output
+    size_t updated;
+} WatchBatch;
+
+static char *xstrdup(const char *s) {
+    char *copy = strdup(s);
+    if (!copy) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return copy;
+}
+
+static void Watch_add_dir(void *user, const char *dir) {
+    Watch *w = user;
+    int wd = inotify_add_watch(w->fd, dir, WATCH_DIR_MASK);
+    if (wd < 0) {
+        if (errno != ENOSPC) perror(dir);
+        else if (!w->out_of_watches) fprintf(stderr, "Out of inotify watches, raise fs.inotify.max_user_watches\n");
+        w->out_of_watches |= errno == ENOSPC;
+        return;
+    }
+
+    if ((size_t)wd >= w->dir_capacity) {
+        size_t capacity = w->dir_capacity ? w->dir_capacity : 256;
+        while ((size_t)wd >= capacity) capacity *= 2;
+        char **dirs = realloc(w->dirs, capacity * sizeof(char *));
+        if (!dirs) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        memset(&dirs[w->dir_capacity], 0, (capacity - w->dir_capacity) * sizeof(char *));
+        w->dirs = dirs;
+        w->dir_capacity = capacity;
+    }
+
+    // a directory moved inside the tree keeps its watch descriptor
+    if (w->dirs[wd]) free(w->dirs[wd]);
+    else w->dir_count += 1;
+    w->dirs[wd] = xstrdup(dir);
+}
+
+static void Watch_forget(Watch *w, int wd) {
+    if (wd < 0 || (size_t)wd >= w->dir_capacity || !w->dirs[wd]) return;
+    free(w->dirs[wd]);
+    w->dirs[wd] = NULL;
+    w->dir_count -= 1;
+}
+
+// Drops the watches of `dir` and of every directory below it.
+static void Watch_remove_tree(Watch *w, const char *dir) {
+    size_t len = strlen(dir);
+    for (size_t wd = 0; wd < w->dir_capacity; wd++) {
+        const char *path = w->dirs[wd];
+        if (path && strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            inotify_rm_watch(w->fd, wd);
+            Watch_forget(w, wd);
+        }
+    }
+}
+
+static void watch_record(void *user, size_t index, const EpubBatchResult *result) {
+    WatchBatch *batch = user;
+
+    if (!result->cached || batch->print_hits) {
+        StrBuf record = {0};
+        json_append_document(&record, batch->paths[index], result->doc, result->error);
+
+        pthread_mutex_lock(&batch->lock);
+        fwrite(record.data, 1, record.len, stdout);
+        batch->updated += 1;
+        pthread_mutex_unlock(&batch->lock);
+        StrBuf_free(&record);
+    }
+    EpubDocument_free(result->doc);
+}
+
+static void watch_removed(const char *path) {
+    StrBuf record = {0};
+    StrBuf_puts(&record, "{\"path\":");
+    json_append_string(&record, path);
+    StrBuf_puts(&record, ",\"removed\":true}\n");
+    fwrite(record.data, 1, record.len, stdout);
+    StrBuf_free(&record);
+}
+
+static void Watch_stale(Watch *w, uint64_t dev, uint64_t ino) {
+    if (w->stale_count == w->stale_capacity) {
+        size_t capacity = w->stale_capacity ? w->stale_capacity * 2 : 64;
+        WatchId *stale = realloc(w->stale, capacity * sizeof(WatchId));
+        if (!stale) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        w->stale = stale;
+        w->stale_capacity = capacity;
+    }
+    w->stale[w->stale_count++] = (WatchId){ dev, ino, 0 };
+}
+
+// Index of the first book whose path isn't before `path`.
+static size_t Watch_lower_bound(const Watch *w, const char *path) {
+    size_t lo = 0, hi = w->book_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(w->books[mid].path, path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Merges `books` (sorted) into the known books, with their current identity.
+// A path that now holds another file makes the old identity stale.
+static void Watch_remember(Watch *w, const BookList *books) {
+    if (books->count == 0) return;
+
+    WatchBook *merged = malloc((w->book_count + books->count) * sizeof(WatchBook));
+    if (!merged) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    size_t i = 0, j = 0, n = 0;
+    while (i < w->book_count || j < books->count) {
+        int cmp = i == w->book_count ? 1 : j == books->count ? -1 : strcmp(w->books[i].path, books->books[j].path);
+        if (cmp < 0) {
+            merged[n++] = w->books[i++];
+            continue;
+        }
+
+        // a book that can't be stat'd is gone again, its removal event follows
+        struct stat st;
+        int found = stat(books->books[j].path, &st) == 0;
+        if (cmp == 0) {
+            WatchBook book = w->books[i++];
+            if (found && (book.dev != (uint64_t)st.st_dev || book.ino != (uint64_t)st.st_ino)) {
+                Watch_stale(w, book.dev, book.ino);
+                book.dev = st.st_dev;
+                book.ino = st.st_ino;
+            }
+            merged[n++] = book;
+        } else if (found) {
+            merged[n++] = (WatchBook){ xstrdup(books->books[j].path), st.st_dev, st.st_ino, 0 };
+        }
+        j++;
+    }
+
+    free(w->books);
+    w->books = merged;
+    w->book_count = n;
+}
+
+// Drops the books of `removed` (sorted paths, one ending with '/' stands for every
+// book below that directory), with a removal record for each one.
+static void Watch_forget_books(Watch *w, const BookList *removed) {
+    size_t dropped = 0;
+    for (size_t r = 0; r < removed->count; r++) {
+        const char *path = removed->books[r].path;
+        size_t len = strlen(path);
+        int dir = len > 0 && path[len - 1] == '/';
+
+        for (size_t i = Watch_lower_bound(w, path); i < w->book_count; i++) {
+            WatchBook *book = &w->books[i];
+            if (dir ? strncmp(book->path, path, len) != 0 : strcmp(book->path, path) != 0) break;
+            if (book->gone) continue; // also below a removed directory
+
+            watch_removed(book->path);
+            Watch_stale(w, book->dev, book->ino);
+            book->gone = 1;
+            dropped++;
+        }
+    }
+    if (dropped == 0) return;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < w->book_count; i++) {
+        if (w->books[i].gone) free(w->books[i].path);
+        else w->books[kept++] = w->books[i];
+    }
+    w->book_count = kept;
+    fflush(stdout);
+}
+
+// Adds the known books missing from `books` (sorted) to `removed`, once events were lost.
+static void Watch_find_missing(const Watch *w, const BookList *books, BookList *removed) {
+    size_t j = 0;
+    for (size_t i = 0; i < w->book_count; i++) {
+        while (j < books->count && strcmp(books->books[j].path, w->books[i].path) < 0) j++;
+        if (j == books->count || strcmp(books->books[j].path, w->books[i].path) != 0) {
+            BookList_add(removed, xstrdup(w->books[i].path), 0);
+        }
+    }
+}
+
+static int watch_id_compare(const void *a, const void *b) {
+    const WatchId *x = a, *y = b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+// Drops the cache entries of the stale identities no known book holds anymore.
+// A book moved within the tree keeps its entry, and is a hit at its new path.
+static void Watch_invalidate_stale(Watch *w) {
+    if (w->stale_count == 0) return;
+    qsort(w->stale, w->stale_count, sizeof(WatchId), watch_id_compare);
+    size_t unique = 1;
+    for (size_t i = 1; i < w->stale_count; i++) {
+        if (watch_id_compare(&w->stale[i], &w->stale[unique - 1]) != 0) w->stale[unique++] = w->stale[i];
+    }
+
+    for (size_t i = 0; i < w->book_count; i++) {
+        WatchId id = { w->books[i].dev, w->books[i].ino, 0 };
+        WatchId *found = bsearch(&id, w->stale, unique, sizeof(WatchId), watch_id_compare);
+        if (found) found->live = 1;
+    }
+    for (size_t i = 0; i < unique; i++) {
+        if (!w->stale[i].live) EpubCache_invalidate_id(w->cache, w->stale[i].dev, w->stale[i].ino);
+    }
+    w->stale_count = 0;
+}
+
+// Opens `books` through the cache and prints them. A hit is a book that didn't
+// change, it's only printed with `print_hits` (a book moved to a new path).
+// Returns the number of books printed.
+static size_t Watch_update(Watch *w, BookList *books, int print_hits) {
+    BookList_sort_unique(books);
+    Watch_remember(w, books);
+    if (books->count == 0) return 0;
+
+    const char **paths = malloc(books->count * sizeof(char *));
+    if (!paths) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < books->count; i++) paths[i] = books->books[i].path;
+
+    WatchBatch batch = { .paths = paths, .print_hits = print_hits };
+    pthread_mutex_init(&batch.lock, NULL);
+    EpubCache_open_batch_each(w->cache, paths, books->count, EPUB_FIELD_ALL, w->threads, watch_record, &batch);
+    pthread_mutex_destroy(&batch.lock);
+    fflush(stdout);
+
+    free(paths);
+    return batch.updated;
+}
+
+// Handles one read() worth of events, books are collected in `changed`, the
+// paths of deleted or moved away books in `removed` (a directory as "dir/").
+// Return 1 if events were lost and the tree must be walked again.
+static int Watch_handle(Watch *w, const char *buf, size_t len, BookList *changed, BookList *removed) {
+    int overflow = 0;
+
+    for (size_t offset = 0; offset < len;) {
+        const struct inotify_event *ev = (const struct inotify_event *)&buf[offset];
+        offset += sizeof(struct inotify_event) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            overflow = 1;
+            continue;
+        }
+        if (ev->mask & IN_IGNORED) {
+            Watch_forget(w, ev->wd); // the directory is gone
+            continue;
+        }
+        if (ev->wd < 0 || (size_t)ev->wd >= w->dir_capacity || !w->dirs[ev->wd] || ev->len == 0) continue;
+
+        char *path = path_join(w->dirs[ev->wd], ev->name);
+        if (ev->mask & IN_ISDIR) {
+            // a new directory may already have books by the time its watch is added
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO)) walk_tree(changed, path, Watch_add_dir, w);
+            if (ev->mask & IN_MOVED_FROM) Watch_remove_tree(w, path);
+            if (ev->mask & (IN_MOVED_FROM | IN_DELETE)) BookList_add(removed, path_join(path, ""), 0);
+            free(path);
+        } else if (is_epub(ev->name) && (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) {
+            // books are read once written, IN_CREATE alone would catch half copied files
+            BookList_add(changed, path, 0);
+        } else if (is_epub(ev->name) && (ev->mask & (IN_DELETE | IN_MOVED_FROM))) {
+            BookList_add(removed, path, 0);
+        } else {
+            free(path);
+        }
+    }
+
+    return overflow;
+}
+
+static void watch_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s watch <dir> -c <cache> [-j threads]\n"
+            "\n"
+            "  -c <cache>    cache file kept in sync with <dir>\n"
+            "  -j <threads>  number of workers (default: one per CPU)\n",
+            program);
+}
+
+int cmd_watch(int argc, char **argv) {
+    Watch w = { .fd = -1 };
+    const char *cache_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:j:")) != -1) {
+        switch (opt) {
+            case 'c': cache_path = optarg; break;
+            case 'j': w.threads = atoi(optarg); break;
+            default:
+                watch_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!cache_path || optind + 1 != argc || w.threads < 0) {
+        watch_usage(argv[0]);
+        return 1;
+    }
+    const char *root = argv[optind];
+
+    EpubError err;
+    w.cache = EpubCache_new(cache_path, &err);
+    if (!w.cache) {
+        fprintf(stderr, "%s: %s\n", cache_path, EpubError_string(err));
+        return 1;
+    }
+
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if (w.fd < 0) {
+        perror("inotify_init1");
+        EpubCache_free(w.cache);
+        return 1;
+    }
+
+    // Watches go in before the first pass, a book written meanwhile is seen
+    // by the pass or by an event (at worst by both, the second is a hit).
+    BookList books = {0};
+    walk_tree(&books, root, Watch_add_dir, &w);
+    size_t total = books.count;
+    size_t updated = Watch_update(&w, &books, 0);
+    BookList_free(&books);
+    fprintf(stderr, "Watching %zu directories, %zu books, %zu updated\n", w.dir_count, total, updated);
+
+    // big enough for many events, each one is at most NAME_MAX + 1 bytes past its header
+    static char buf[1 << 16] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(w.fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("inotify");
+            break;
+        }
+
+        BookList changed = {0}, removed = {0};
+        int overflow = Watch_handle(&w, buf, n, &changed, &removed);
+        if (overflow) {
+            fprintf(stderr, "Events were lost, walking %s again\n", root);
+            BookList_free(&changed);
+            BookList_free(&removed);
+            walk_tree(&changed, root, Watch_add_dir, &w);
+            BookList_sort_unique(&changed);
+            Watch_find_missing(&w, &changed, &removed);
+        }
+
+        // removals first: a book deleted and written again at the same path is a new one
+        BookList_sort_unique(&removed);
+        Watch_forget_books(&w, &removed);
+        Watch_update(&w, &changed, !overflow);
+        Watch_invalidate_stale(&w);
+        BookList_free(&changed);
+        BookList_free(&removed);
+    }
+
+    for (size_t i = 0; i < w.book_count; i++) free(w.books[i].path);
+    free(w.books);
+    free(w.stale);
+    for (size_t i = 0; i < w.dir_capacity; i++) free(w.dirs[i]);
+    free(w.dirs);
+    close(w.fd);
+    EpubCache_free(w.cache);
+    return 1;
+}
@@ -0,0 +1,21 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+
+#include "epubinfo.h"
+
+/// Internal allocations go through these, with the allocator of the context
+/// or document that owns the memory. `NULL` is the C library allocator.
+
+void* epub_malloc(const EpubAllocator *allocator, size_t size);
+
+/// Zeroed memory, returns `NULL` if `count * size` overflows.
+void* epub_calloc(const EpubAllocator *allocator, size_t count, size_t size);
+
+void* epub_realloc(const EpubAllocator *allocator, void *ptr, size_t size);
+
+/// `ptr` may be `NULL`.
+void epub_free(const EpubAllocator *allocator, void *ptr);
+
+#endif
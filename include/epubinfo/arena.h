@@ -3,14 +3,48 @@
 #ifndef ARENA_H
 #define ARENA_H
 
+#include "alloc.h"
+
+typedef struct ArenaBlock ArenaBlock;
+
+/// Bump allocator over a chain of blocks.
+/// When the current block is full a new one (at least twice as big) is linked,
+/// so allocations only fail when malloc does.
 typedef struct {
-    unsigned char *buffer;
-    size_t capacity;
-    size_t offset;
+    ArenaBlock *current;    // newest block, older ones are linked from it
+    size_t block_size;      // size of the next block
+    const EpubAllocator *allocator; // blocks come from it, NULL = malloc
+
+    // usage statistics
+    size_t reserved;        // bytes reserved by all blocks
+    size_t used;            // bytes handed out (alignment padding included)
+    size_t high_water;      // max value of `used`
+    size_t alloc_count;     // successful arena_alloc calls
+    size_t block_count;
 } Arena;
 
-int arena_init(Arena *arena, size_t size);
+/// Savepoint, see `arena_mark` and `arena_rewind`.
+typedef struct {
+    ArenaBlock *block;
+    size_t offset;
+    size_t used;
+} ArenaMark;
+
+/// `size` is the size of the first block, blocks are allocated with `allocator` (may be NULL).
+int arena_init(Arena *arena, size_t size, const EpubAllocator *allocator);
+
+/// Returns `NULL` if there is no memory.
 void* arena_alloc(Arena *arena, size_t size, size_t align);
+
+ArenaMark arena_mark(const Arena *arena);
+
+/// Releases every allocation made after `mark`.
+/// Marks taken before an `arena_reset` must not be used after it.
+/// Blocks linked after the mark are freed.
+void arena_rewind(Arena *arena, ArenaMark mark);
+
+/// Releases every allocation. Chained blocks are merged into a single
+/// block big enough for the whole previous usage.
 void arena_reset(Arena *arena);
 void arena_free(Arena *arena);
 
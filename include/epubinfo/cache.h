@@ -0,0 +1,82 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "epubinfo.h"
+
+// Cache file
+//
+// Bytes | Description
+// ------+-------------------------------------------------------------------------
+//     8 | Magic "EPUBCACH"
+//     4 | Version
+//     4 | Reserved
+//     n | Records, each one 8 bytes aligned
+//
+// Record
+//
+// Bytes | Description
+// ------+-------------------------------------------------------------------------
+//     4 | Magic
+//     4 | Record size (header included), multiple of 8
+//   8*4 | Device, inode, file size and modification time (ns) of the book
+//     4 | EpubField mask the metadata was read with
+//     4 | Kind (CacheRecordKind)
+//     4 | crc32 of the record, computed with this field set to 0
+//     4 | Reserved
+//     m | Packed metadata block (metadata.h), metadata records only
+//
+// Records are only ever appended to a file, so bytes a reader has mapped
+// never change. The last record of a (device, inode) wins. Compaction (on
+// clear, or once dead records outweigh live ones) writes the live records to
+// "<path>.tmp" under the file lock and renames it over the cache: processes
+// still on the old file move to the new one on their next refresh or append.
+// Numbers are in native byte order, the file isn't meant to be shared between
+// machines.
+
+#define CACHE_FILE_MAGIC "EPUBCACH"
+#define CACHE_FILE_VERSION 1
+#define CACHE_RECORD_MAGIC 0x52425045 // "EPBR"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} CacheFileHeader;
+
+typedef enum {
+    CACHE_RECORD_METADATA = 1,
+    CACHE_RECORD_INVALIDATE = 2,    // drops the entry of one book
+    CACHE_RECORD_CLEAR = 3,         // drops every previous record
+} CacheRecordKind;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t file_size;
+    int64_t mtime_ns;
+    uint32_t fields;
+    uint32_t kind;
+    uint32_t checksum;
+    uint32_t reserved;
+} CacheRecord;
+
+_Static_assert(sizeof(CacheFileHeader) % 8 == 0, "records must stay 8 bytes aligned");
+_Static_assert(sizeof(CacheRecord) % 8 == 0, "metadata must stay 8 bytes aligned");
+
+/// Same as `EpubCache_open_file`, `hit` (may be NULL) tells if the book was served from the cache.
+EpubDocument* cache_open_file(EpubCache *cache, EpubContext *ctx, const char *filename, unsigned fields,
+                              EpubError *error, int *hit);
+
+/// Creates a document holding a copy of `meta` and no archive, implemented in epubinfo.c.
+/// Functions reading entries open `filename` again. It allocates with `allocator` (may be NULL).
+/// Returns `NULL` if there is no memory.
+EpubDocument* EpubDocument_from_metadata(const EpubMetadata *meta, const char *filename, const EpubAllocator *allocator);
+
+/// Allocator of `ctx` (may be NULL), implemented in epubinfo.c.
+const EpubAllocator* EpubContext_allocator(const EpubContext *ctx);
+
+#endif
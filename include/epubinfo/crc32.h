@@ -0,0 +1,12 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// CRC-32 of zip entries (same convention as zlib's crc32: start with 0,
+/// feed the data in any number of calls). Uses PCLMULQDQ folding on x86-64
+/// and the CRC32 instructions on ARMv8 when the CPU has them, zlib otherwise.
+uint32_t zip_crc32(uint32_t crc, const void *data, size_t len);
+
+#endif
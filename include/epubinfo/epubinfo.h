@@ -1,17 +1,227 @@
 #ifndef EPUBINFO_H
 #define EPUBINFO_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 /// @brief An opaque handle representing a loaded EPUB document.
 typedef struct EpubDocument EpubDocument;
 
 /// @brief An opaque handle representing the metadata of an EPUB document.
 typedef struct EpubMetadata EpubMetadata;
 
+/// @brief Why a document couldn't be opened, or an operation on it failed.
+typedef enum {
+    EPUB_OK = 0,
+    EPUB_ERROR_IO,              ///< The file can't be opened or read, or an output can't be written.
+    EPUB_ERROR_ZIP,             ///< Not a zip archive, or a corrupt central directory.
+    EPUB_ERROR_NO_CONTAINER,    ///< META-INF/container.xml is missing.
+    EPUB_ERROR_NO_ROOTFILE,     ///< The container has no rootfile, or the OPF is missing.
+    EPUB_ERROR_INFLATE,         ///< An entry can't be decompressed.
+    EPUB_ERROR_NO_METADATA,     ///< The OPF has no <metadata>.
+    EPUB_ERROR_NO_MEMORY,
+    EPUB_ERROR_INVALID_ARGUMENT,
+    EPUB_ERROR_CHECKSUM,        ///< An entry doesn't match its CRC-32.
+    EPUB_ERROR_NO_COVER,        ///< The manifest has no cover image, or it isn't in the archive.
+} EpubError;
+
+/// @brief Returns a static, human readable description of `error`.
+const char* EpubError_string(EpubError error);
+
+/// @brief Metadata fields, combined as a bitmask by `EpubDocument_from_file_fields`.
+typedef enum {
+    EPUB_FIELD_TITLE       = 1u << 0,
+    EPUB_FIELD_SUBTITLE    = 1u << 1,
+    EPUB_FIELD_LANGUAGE    = 1u << 2,
+    EPUB_FIELD_DESCRIPTION = 1u << 3,
+    EPUB_FIELD_PUBLISHER   = 1u << 4,
+    EPUB_FIELD_AUTHOR      = 1u << 5,
+    EPUB_FIELD_CREATOR     = 1u << 6,
+    EPUB_FIELD_IDENTIFIER  = 1u << 7,
+    EPUB_FIELD_ALL         = (1u << 8) - 1,
+} EpubField;
+
 /// @brief Loads an EPUB document from a file.
 /// @param filename The path to the .epub file.
 /// @return A pointer to a new EpubDocument, or NULL on error.
 EpubDocument* EpubDocument_from_file(const char *filename);
 
+/// @brief Loads an EPUB document from a file, reading only some metadata fields.
+/// @note Fields not in `fields` are left empty. When only single valued fields are
+///       requested (title, subtitle, language, description, publisher), parsing and
+///       inflating the OPF stop as soon as all of them are found. List fields
+///       (author, creator, identifier) are complete only at the end of <metadata>.
+/// @param filename The path to the .epub file.
+/// @param fields A bitmask of `EpubField` values.
+/// @return A pointer to a new EpubDocument, or NULL on error.
+EpubDocument* EpubDocument_from_file_fields(const char *filename, unsigned fields);
+
+/// @brief Loads an EPUB document from a buffer holding the whole .epub file.
+/// @note The buffer is not copied and the library never writes to it or frees it.
+///       - The metadata (`EpubDocument_get_metadata`) is copied out of the buffer
+///         while opening, it never references `data`.
+///       - Reading entries later (`EpubDocument_save_cover`) reads from `data`, so the
+///         buffer must stay valid and unchanged until `EpubDocument_free`.
+///       If only the metadata is needed, the buffer can be released right after this
+///       call returns, as long as no function reading entries is called afterwards.
+/// @param data The EPUB (zip) bytes.
+/// @param len The size of `data` in bytes.
+/// @return A pointer to a new EpubDocument, or NULL on error.
+EpubDocument* EpubDocument_from_memory(const void *data, size_t len);
+
+/// @brief Same as `EpubDocument_from_memory`, reading only the fields in `fields`.
+/// @see EpubDocument_from_file_fields
+EpubDocument* EpubDocument_from_memory_fields(const void *data, size_t len, unsigned fields);
+
+/// @brief Random access input for `EpubDocument_from_reader`.
+/// @note Every `read_at` call is one ranged read, the library never reads past `size`.
+typedef struct {
+    /// @brief Passed back to the callbacks.
+    void *ctx;
+    /// @brief Returns the size of the EPUB in bytes, or -1 on error.
+    int64_t (*size)(void *ctx);
+    /// @brief Reads exactly `len` bytes at `offset` into `buf`.
+    /// @return 0 on success, non-zero on error (short reads are errors).
+    int (*read_at)(void *ctx, uint64_t offset, void *buf, size_t len);
+} EpubReader;
+
+/// @brief Loads an EPUB document through ranged reads.
+/// @note Opening typically issues three or four reads, each one fetches only what it needs:
+///       1. the tail of the archive (up to 64 KiB), with the end of central directory record;
+///       2. the central directory, skipped when it's already inside the tail;
+///       3. META-INF/container.xml;
+///       4. the OPF.
+///       An entry whose local header has an extra field longer than 256 bytes (rare)
+///       costs one more read, so opening takes at most six. Entries already inside a previous read are not read again, a small
+///       EPUB can be opened with a single read.
+///       `reader` is copied, but `reader->ctx` must stay valid until `EpubDocument_free`
+///       for functions reading entries later (`EpubDocument_save_cover`).
+/// @param reader The input callbacks.
+/// @return A pointer to a new EpubDocument, or NULL on error.
+EpubDocument* EpubDocument_from_reader(const EpubReader *reader);
+
+/// @brief Same as `EpubDocument_from_reader`, reading only the fields in `fields`.
+/// @see EpubDocument_from_file_fields
+EpubDocument* EpubDocument_from_reader_fields(const EpubReader *reader, unsigned fields);
+
+/// @brief Memory hooks, `user` is passed back to every call.
+/// `realloc` is called with `ptr` = NULL for new blocks, `free` is never called with NULL.
+typedef struct {
+    void* (*alloc)(void *user, size_t size);
+    void* (*realloc)(void *user, void *ptr, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} EpubAllocator;
+
+/// @brief Reusable state for opening documents: metadata arena, XML window and inflate state.
+/// @note A context is not thread safe, use one per thread. Documents opened with a
+///       context don't depend on it, they can outlive it and move between threads.
+typedef struct EpubContext EpubContext;
+
+/// @brief Creates a context.
+/// @return A new context, or NULL if there is no memory.
+EpubContext* EpubContext_new(void);
+
+/// @brief Creates a context whose memory, and the memory of every document opened
+///        with it (zlib state included), comes from `allocator`.
+/// @note `allocator` is not copied, it must outlive the context and these documents.
+///       It must be thread safe if `EpubDocument_extract_text` uses several threads.
+/// @return A new context, or NULL if `allocator` is incomplete or there is no memory.
+EpubContext* EpubContext_new_with_allocator(const EpubAllocator *allocator);
+
+/// @brief Frees a context, documents opened with it stay valid.
+void EpubContext_free(EpubContext *ctx);
+
+/// @brief Same as `EpubDocument_from_file_fields`, reusing the buffers of `ctx`.
+/// @note Nothing is printed, the reason of a failure is stored in `error` (may be NULL).
+EpubDocument* EpubContext_open_file(EpubContext *ctx, const char *filename, unsigned fields, EpubError *error);
+
+/// @brief Same as `EpubDocument_from_memory_fields`, reusing the buffers of `ctx`.
+EpubDocument* EpubContext_open_memory(EpubContext *ctx, const void *data, size_t len, unsigned fields, EpubError *error);
+
+/// @brief Same as `EpubDocument_from_reader_fields`, reusing the buffers of `ctx`.
+EpubDocument* EpubContext_open_reader(EpubContext *ctx, const EpubReader *reader, unsigned fields, EpubError *error);
+
+/// @brief Result of one file of `EpubDocument_open_batch`.
+typedef struct {
+    EpubDocument *doc;          ///< NULL on error, free it with `EpubDocument_free`.
+    EpubError error;
+    uint64_t elapsed_ns;        ///< Time spent opening the file.
+    int cached;                 ///< 1 if the metadata came from an `EpubCache`.
+} EpubBatchResult;
+
+/// @brief Called by `EpubDocument_open_batch_each` as soon as a file is opened.
+/// @note Runs on the worker thread that opened the file, callbacks for different files
+///       run concurrently. The callback owns `result->doc`.
+typedef void (*EpubBatchCallback)(void *user, size_t index, const EpubBatchResult *result);
+
+/// @brief Opens many files in parallel.
+/// @note Files are spread over `threads` workers (the calling thread is one of them),
+///       each with its own `EpubContext`. Idle workers steal half of the remaining files
+///       of a busy one, so slow books don't leave threads waiting. Nothing is printed.
+/// @param filenames The paths of the .epub files.
+/// @param count The number of paths, at most UINT32_MAX.
+/// @param fields A bitmask of `EpubField` values.
+/// @param threads The number of workers, 0 for one per online CPU.
+/// @param results An array of `count` results, `results[i]` is the result of `filenames[i]`.
+/// @return EPUB_OK when every file was processed (each result has its own error),
+///         EPUB_ERROR_INVALID_ARGUMENT or EPUB_ERROR_NO_MEMORY otherwise.
+EpubError EpubDocument_open_batch(const char *const *filenames, size_t count, unsigned fields, int threads, EpubBatchResult *results);
+
+/// @brief Same as `EpubDocument_open_batch`, handing every result to `callback` instead
+///        of storing them, so results can be consumed while the batch runs.
+EpubError EpubDocument_open_batch_each(const char *const *filenames, size_t count, unsigned fields, int threads,
+                                       EpubBatchCallback callback, void *user);
+
+/// @brief A persistent metadata cache, stored in one file.
+/// @note Books are keyed by (device, inode, size, modification time): a hit returns the
+///       stored metadata without opening the EPUB (only `stat` is called), a changed
+///       book simply misses and is parsed again. Entries are never dropped on their
+///       own, use `EpubCache_invalidate` or `EpubCache_clear`.
+///       The file is append-only and mapped in memory. Any number of processes can use
+///       the same file at once, appends are serialized with `flock` and records written
+///       by other processes are picked up on the next miss. A cache is thread safe.
+///       Replaced and dropped records are compacted away (the live ones are rewritten
+///       to a new file renamed over the old one) on `EpubCache_clear`, and once they
+///       take more room than the live ones.
+typedef struct EpubCache EpubCache;
+
+/// @brief Opens the cache file at `path`, creating it if it doesn't exist.
+/// @note A cache file that can't be written is opened read-only, books are then served
+///       from it but never added.
+/// @param path The cache file.
+/// @param error Why the cache can't be opened (may be NULL).
+/// @return A new cache, or NULL on error.
+EpubCache* EpubCache_new(const char *path, EpubError *error);
+
+/// @brief Closes the cache, documents opened with it stay valid.
+void EpubCache_free(EpubCache *cache);
+
+/// @brief Same as `EpubContext_open_file`, serving the metadata from `cache` when the book
+///        didn't change, and adding it to the cache otherwise.
+/// @note A hit must have been stored with at least the fields in `fields`.
+///       Documents served from the cache open the file again in `EpubDocument_save_cover`.
+/// @param ctx The context used on a miss, NULL for a temporary one.
+EpubDocument* EpubCache_open_file(EpubCache *cache, EpubContext *ctx, const char *filename, unsigned fields, EpubError *error);
+
+/// @brief Drops the entry of `filename`, the next open parses the book again.
+/// @return 0 on success, non-zero if the file can't be stat'd or the cache can't be written.
+int EpubCache_invalidate(EpubCache *cache, const char *filename);
+
+/// @brief Drops the entry of the book with this device and inode number (`st_dev`, `st_ino`),
+///        for files that were deleted or moved away and can't be stat'd anymore.
+/// @return 0 on success, non-zero if the cache can't be written.
+int EpubCache_invalidate_id(EpubCache *cache, uint64_t dev, uint64_t ino);
+
+/// @brief Drops every entry, the file is rewritten empty.
+/// @return 0 on success, non-zero if the cache can't be written.
+int EpubCache_clear(EpubCache *cache);
+
+/// @brief Same as `EpubDocument_open_batch_each`, opening files with `EpubCache_open_file`
+///        (`EpubBatchResult.cached` tells the hits). Without a cache (NULL) files are parsed.
+EpubError EpubCache_open_batch_each(EpubCache *cache, const char *const *filenames, size_t count, unsigned fields,
+                                    int threads, EpubBatchCallback callback, void *user);
+
 /// @brief Frees all memory associated with an EPUB document.
 /// @param doc The document to free.
 void EpubDocument_free(EpubDocument *doc);
@@ -22,6 +232,13 @@ void EpubDocument_free(EpubDocument *doc);
 /// @return A const pointer to the metadata.
 const EpubMetadata* EpubDocument_get_metadata(EpubDocument *doc);
 
+/// @brief Gets the size in bytes of the metadata block.
+/// @note The metadata is stored in one contiguous block without pointers, it can be
+///       copied with memcpy (to a 4 bytes aligned address) and read from the copy.
+/// @param meta The document metadata.
+/// @return The block size, or 0 if `meta` is NULL.
+size_t EpubMetadata_get_size(const EpubMetadata *meta);
+
 /// @brief Gets the document's title.
 /// @param meta The document metadata.
 /// @return The title string, or "" if not available.
@@ -77,10 +294,153 @@ int EpubMetadata_get_identifier_count(const EpubMetadata *meta);
 /// @return The identifier string, or NULL if the index is out of bounds.
 const char* EpubMetadata_get_identifier(const EpubMetadata *meta, int index);
 
+/// @brief An item of the OPF manifest.
+typedef struct {
+    const char *id;
+    const char *href;           ///< As written in the OPF.
+    const char *path;           ///< Archive path, `href` resolved against the OPF directory ("" if outside the archive:
+                                ///< an absolute URL such as "http:" or "data:", an absolute path, or above the root).
+    const char *media_type;
+    const char *properties;     ///< Space separated list, "" if none.
+} EpubManifestItem;
+
+/// @brief An entry of the OPF spine, in reading order.
+typedef struct {
+    const EpubManifestItem *item;
+    int linear;                 ///< 0 for `linear="no"`.
+} EpubSpineItem;
+
+/// @brief Gets the number of manifest items.
+/// @note The manifest and the spine are not read by the open functions, the first call to
+///       any manifest or spine function reads them from the OPF (for documents served from
+///       a cache, the file is opened again). Until that first call has returned, a document
+///       must not be used from several threads at once.
+///       Items, their strings and spine entries are valid for the lifetime of the document.
+/// @param doc The document.
+/// @return The number of items, or -1 if the OPF can't be read.
+int EpubDocument_get_manifest_count(EpubDocument *doc);
+
+/// @brief Gets a manifest item by index, in document order.
+/// @param doc The document.
+/// @param index The index of the item (from 0 to count-1).
+/// @return The item, or NULL if the index is out of bounds.
+const EpubManifestItem* EpubDocument_get_manifest_item(EpubDocument *doc, int index);
+
+/// @brief Finds a manifest item by id, with a hash lookup.
+/// @param doc The document.
+/// @param id The item id.
+/// @return The item, or NULL if there is none.
+const EpubManifestItem* EpubDocument_find_manifest_item(EpubDocument *doc, const char *id);
+
+/// @brief Gets the number of spine entries (itemrefs to unknown ids are skipped).
+/// @param doc The document.
+/// @return The number of entries, or -1 if the OPF can't be read.
+int EpubDocument_get_spine_count(EpubDocument *doc);
+
+/// @brief Gets a spine entry by index, in reading order.
+/// @param doc The document.
+/// @param index The index of the entry (from 0 to count-1).
+/// @return The entry, or NULL if the index is out of bounds.
+const EpubSpineItem* EpubDocument_get_spine_item(EpubDocument *doc, int index);
+
+/// @brief Writes the uncompressed content of a manifest item to `fd`, at its current offset.
+/// @param doc The document.
+/// @param item An item of this document.
+/// @param fd An open file descriptor (a file, a pipe or a socket).
+/// @return EPUB_OK on success, EPUB_ERROR_INVALID_ARGUMENT if the item isn't in the archive,
+///         EPUB_ERROR_INFLATE if it can't be extracted, EPUB_ERROR_IO if `fd` can't be written.
+EpubError EpubDocument_write_item(EpubDocument *doc, const EpubManifestItem *item, int fd);
+
+/// @brief Receives the plain text of the spine, see `EpubDocument_extract_text`.
+/// @param user The pointer given to `EpubDocument_extract_text`.
+/// @param chapter The spine index the text belongs to.
+/// @param text A piece of the chapter text (UTF-8, not null terminated), valid only during the call.
+/// @param len The length of `text` in bytes.
+/// @return 0 to continue, non-zero to stop the extraction.
+typedef int (*EpubTextCallback)(void *user, int chapter, const char *text, size_t len);
+
+/// @brief Totals of a text extraction.
+typedef struct {
+    uint64_t chapters;          ///< Spine entries read.
+    uint64_t compressed_bytes;  ///< Size of those entries in the archive.
+    uint64_t input_bytes;       ///< Size of those entries once inflated.
+    uint64_t text_bytes;        ///< Text handed to the callback.
+} EpubTextStats;
+
+/// @brief Extracts the plain text of every spine entry, in reading order.
+/// @note Entries are inflated in chunks and tokenized as they come, markup is dropped
+///       (with <head>, <script> and <style>), entities are decoded and whitespace is
+///       collapsed. Block elements (paragraphs, headings, list items, ...) end a line.
+///       Chapters are read by `threads` workers at once, each one buffers at most 64 KiB
+///       of text until the chapters before its own are delivered, so memory doesn't
+///       depend on the size of the book. Calls to `callback` never overlap and come in
+///       spine order, but may be made from any of the workers.
+///       With a reader, `read_at` is called from the workers concurrently.
+///       Entries that aren't (X)HTML, or aren't in the archive, are skipped. A tag or
+///       comment longer than 1 MiB ends its chapter with EPUB_ERROR_INFLATE.
+/// @param doc The document.
+/// @param threads Number of workers, 0 for one per CPU.
+/// @param callback Receives the text.
+/// @param user Passed back to `callback`.
+/// @param stats Set to the totals (may be NULL).
+/// @return EPUB_OK once every chapter was delivered or `callback` asked to stop, otherwise
+///         the first error (the text of the other chapters is still delivered).
+EpubError EpubDocument_extract_text(EpubDocument *doc, int threads, EpubTextCallback callback, void *user, EpubTextStats *stats);
+
+/// @brief Checks every file of the archive against the CRC-32 of the central directory.
+/// @note Entries are checksummed while they are inflated, in chunks, nothing is kept.
+/// @param doc The document.
+/// @param bad_entry Set to the archive path of the entry that failed (may be NULL), it lives
+///        as long as `doc`. Set to NULL on success.
+/// @return EPUB_OK if every entry matches, EPUB_ERROR_CHECKSUM on a mismatch, EPUB_ERROR_INFLATE
+///         if an entry can't be decompressed, EPUB_ERROR_IO if the archive can't be read.
+EpubError EpubDocument_verify(EpubDocument *doc, const char **bad_entry);
+
+/// @brief Fingerprints of a book for duplicate detection, see `EpubDocument_get_fingerprint`.
+typedef struct {
+    uint64_t archive;           ///< Hash of the sorted (file name, CRC-32, uncompressed size) of every file.
+    uint64_t metadata;          ///< Hash of the normalized title, authors and language, 0 without a title.
+} EpubFingerprint;
+
+/// @brief Computes the fingerprints of a document, no entry is inflated.
+/// @note `archive` only depends on the central directory: copies of a book holding the same
+///       files match whatever their entry order, compression or timestamps.
+///       `metadata` compares the title, the authors and creators (in any order) and the primary
+///       language subtag, ignoring ASCII case, punctuation and spacing. It only sees the fields
+///       the document was opened with, so compare documents opened with the same fields.
+/// @param doc The document.
+/// @param fingerprint Set to the fingerprints.
+/// @return EPUB_OK on success, EPUB_ERROR_IO if the archive of a cached document can't be read.
+EpubError EpubDocument_get_fingerprint(EpubDocument *doc, EpubFingerprint *fingerprint);
+
+/// @brief Computes the `archive` fingerprint of a file without opening it as a document.
+/// @note Only the end of the file is read: a few KiB with the central directory for most
+///       books, nothing is inflated and the OPF isn't parsed.
+/// @param ctx The context, for its allocator.
+/// @param filename The path of the archive.
+/// @param fingerprint Set to the same value as `EpubFingerprint.archive`.
+/// @return EPUB_OK on success, EPUB_ERROR_IO if the file can't be read, EPUB_ERROR_ZIP if it
+///         isn't a zip archive.
+EpubError EpubContext_fingerprint_file(EpubContext *ctx, const char *filename, uint64_t *fingerprint);
+
 /// @brief Finds the cover image in the EPUB and saves it to a file.
 /// @param doc The document.
 /// @param filename The output path to save the image (e.g., "cover.jpg").
-/// @return 0 on success, non-zero on failure (e.g., cover not found, can't write file).
-int EpubDocument_save_cover(const EpubDocument *doc, const char *filename);
+/// @note Nothing is printed, the caller reports the error (`EpubError_string`).
+/// @note The image is written to a temporary file in the same directory, renamed to
+///       `filename` once complete: on error an existing `filename` is left untouched.
+/// @note The cover is found in the manifest, which the first call reads like the manifest
+///       functions do (see `EpubDocument_get_manifest_count`).
+/// @return EPUB_OK on success, EPUB_ERROR_NO_COVER if there is no cover, EPUB_ERROR_IO if the
+///         file can't be written, EPUB_ERROR_INFLATE if the image can't be extracted.
+EpubError EpubDocument_save_cover(EpubDocument *doc, const char *filename);
+
+/// @brief Same as `EpubDocument_save_cover`, writing the image to `fd` at its current offset.
+/// @note Nothing is written if the cover isn't found. On an extraction error part of the
+///       image may have been written already.
+/// @param doc The document.
+/// @param fd An open file descriptor (a file, a pipe or a socket).
+/// @return EPUB_OK on success, otherwise an error as for `EpubDocument_save_cover`.
+EpubError EpubDocument_write_cover(EpubDocument *doc, int fd);
 
 #endif // EPUBINFO_H
@@ -0,0 +1,27 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdint.h>
+
+#include "epubinfo.h"
+#include "zip.h"
+
+// Bytes read from the end of a file by the first tail read of a
+// fingerprint, enough for the central directory of most books. The full
+// EOCDR search span is read when the record isn't in there.
+#define FINGERPRINT_TAIL_LEN 16384
+
+/// Hashes the (file name, CRC-32, uncompressed size) of every file of `dir`
+/// in name order, directories are skipped. Two archives holding the same
+/// files get the same value whatever their entry order, compression level
+/// or timestamps. Nothing is inflated, the names are sorted in a temporary
+/// array from the allocator of `dir`.
+EpubError fingerprint_directory(const ZipDirectory *dir, uint64_t *fingerprint);
+
+/// Hashes the title, the authors and creators (in any order) and the
+/// primary language subtag of `meta`. Values are compared ASCII case
+/// insensitively, with punctuation and runs of spaces folded to one space.
+/// Returns 0 if there's no title.
+uint64_t fingerprint_metadata(const EpubMetadata *meta);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include <stddef.h>
+
+/// Whole-buffer raw DEFLATE (RFC 1951) decoder, for entries whose
+/// uncompressed size is known up front. There is no streaming state: the
+/// input and the output are complete, so the hot loop decodes with a 64 bits
+/// bit buffer and table lookups, and copies matches 8 bytes at a time.
+/// The zip layer only uses it when built with ZIP_ONESHOT_INFLATE
+/// (`make ONESHOT_INFLATE=1`).
+
+/// Decodes the deflate stream `in` into `out`.
+/// Return 1 if the stream is valid and decodes to exactly `out_len` bytes,
+/// 0 otherwise (the content of `out` is then undefined).
+int inflate_oneshot(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len);
+
+#endif
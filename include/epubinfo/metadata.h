@@ -0,0 +1,92 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "epubinfo.h"
+
+typedef enum {
+    // single valued
+    METADATA_TITLE,
+    METADATA_SUBTITLE,
+    METADATA_LANGUAGE,
+    METADATA_DESCRIPTION,
+    METADATA_PUBLISHER,
+    // lists
+    METADATA_AUTHOR,
+    METADATA_CREATOR,
+    METADATA_IDENTIFIER,
+    METADATA_FIELD_COUNT,
+} MetadataField;
+
+#define METADATA_FIRST_LIST METADATA_AUTHOR
+#define METADATA_LIST_COUNT (METADATA_FIELD_COUNT - METADATA_FIRST_LIST)
+
+/// Maps the local name of a Dublin Core element ("title", "creator", ...) to its field.
+/// Returns -1 if the element isn't stored.
+int metadata_field_lookup(const char *name, size_t len);
+
+// Packed metadata block
+//
+// Bytes | Description
+// ------+-------------------------------------------------------------------------
+//     4 | Block size (header included)
+//   4*5 | Offset of title, subtitle, language, description and publisher (0 = missing)
+//   8*3 | Count and offset of the author, creator and identifier offset arrays
+//   4*n | String offsets of every list, in the same order
+//     m | Null terminated strings
+//
+// Offsets are relative to the start of the block and there are no pointers,
+// so the block can be memcpy'd anywhere (4 bytes aligned) and still be read.
+
+typedef struct {
+    uint32_t count;
+    uint32_t offset;
+} EpubMetadataList;
+
+struct EpubMetadata {
+    uint32_t size;
+    uint32_t fields[METADATA_FIRST_LIST];
+    EpubMetadataList lists[METADATA_LIST_COUNT];
+};
+
+typedef struct MetadataValue MetadataValue;
+
+/// Collects values while the OPF is parsed, then packs them in one block.
+typedef struct {
+    Arena arena;
+    MetadataValue *first;
+    MetadataValue *last;
+    uint32_t counts[METADATA_FIELD_COUNT];
+    size_t strings_size;
+} MetadataBuilder;
+
+/// The arena allocates with `allocator` (may be NULL).
+void MetadataBuilder_init(MetadataBuilder *b, const EpubAllocator *allocator);
+
+/// Drops every value, the arena memory is kept for the next document.
+void MetadataBuilder_reset(MetadataBuilder *b);
+
+/// Copies `text` to the builder. Single valued fields keep their first value.
+/// Return 1 on success, 0 if there is no memory.
+int MetadataBuilder_add(MetadataBuilder *b, MetadataField field, const char *text, size_t len);
+
+/// Returns the number of values added to `field`.
+uint32_t MetadataBuilder_count(const MetadataBuilder *b, MetadataField field);
+
+/// Size of the packed block, a multiple of 4.
+size_t MetadataBuilder_size(const MetadataBuilder *b);
+
+/// Packs the values in `block`, which must have `MetadataBuilder_size` bytes and be 4 bytes aligned.
+EpubMetadata *MetadataBuilder_pack(const MetadataBuilder *b, void *block);
+
+void MetadataBuilder_free(MetadataBuilder *b);
+
+/// Checks that the `size` bytes at `block` (4 bytes aligned) are a packed block
+/// whose offsets all stay inside it, for blocks read back from a file.
+/// Return 1 if the block can be read, 0 otherwise.
+int metadata_block_valid(const void *block, size_t size);
+
+#endif
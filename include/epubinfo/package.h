@@ -0,0 +1,47 @@
+#ifndef PACKAGE_H
+#define PACKAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "epubinfo.h"
+#include "tokenizer.h"
+#include "zip.h"
+
+/// Manifest and spine of the OPF.
+/// Strings live in `strings`, every href is resolved against the OPF
+/// directory once and looked up in the central directory.
+typedef struct {
+    Arena strings;
+    EpubManifestItem *items;
+    const ZipEntry **entries;   // entry of every item, NULL if it's not in the archive
+    size_t count;
+    uint32_t *index;            // open addressing (linear probing) over ids, item + 1, 0 = empty
+    size_t index_capacity;      // power of two
+    EpubSpineItem *spine;
+    size_t spine_count;
+    const char *cover_id;       // EPUB2 <meta name="cover" content="...">, NULL if none
+    const EpubAllocator *allocator;
+} EpubPackage;
+
+/// Reads the OPF from the start up to </spine>.
+/// `dir` must outlive the package, `opf_name` is the archive path of the OPF.
+/// Everything is allocated with `allocator` (may be NULL).
+/// `pkg` must be released with `EpubPackage_free`, even on error.
+EpubError EpubPackage_parse(EpubPackage *pkg, EntryTokenizer *t, const ZipDirectory *dir, const char *opf_name,
+                            const EpubAllocator *allocator);
+
+/// Returns `NULL` if no item has this id.
+const EpubManifestItem *EpubPackage_find(const EpubPackage *pkg, const char *id, size_t len);
+
+/// Returns `NULL` if the item isn't in the archive.
+const ZipEntry *EpubPackage_entry(const EpubPackage *pkg, const EpubManifestItem *item);
+
+/// The EPUB3 `properties="cover-image"` item, else the one the EPUB2 cover meta points to.
+/// Returns `NULL` if there is no cover.
+const EpubManifestItem *EpubPackage_cover(const EpubPackage *pkg);
+
+void EpubPackage_free(EpubPackage *pkg);
+
+#endif
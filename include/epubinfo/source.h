@@ -0,0 +1,49 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "epubinfo.h"
+#include "zip.h"
+
+/// Where the archive bytes of a document come from.
+/// A whole archive (a mapped file or a caller buffer) is used in place. With
+/// a reader, only the windows needed are fetched: the tail, the central
+/// directory and one entry at a time.
+typedef struct {
+    ZipArchive whole;           // valid when `reader` is NULL
+    const EpubReader *reader;
+    uint64_t size;              // archive size, reader only
+
+    ZipArchive tail;            // reader windows, `data` is allocated
+    ZipArchive cent_dir;
+    ZipArchive entry;
+    size_t read_count;          // read_at calls
+    size_t tail_hint;           // first tail read, 0 = the whole EOCDR search span
+    EpubError error;            // why the last fetch failed
+    const EpubAllocator *allocator; // windows and the central directory, NULL = malloc
+} ArchiveSource;
+
+/// `allocator` (may be NULL) is used for the central directory.
+void ArchiveSource_from_archive(ArchiveSource *src, const ZipArchive *za, const EpubAllocator *allocator);
+
+/// `allocator` (may be NULL) is used for the windows and the central directory.
+/// Return 1 on success, 0 if the reader can't tell the archive size.
+int ArchiveSource_from_reader(ArchiveSource *src, const EpubReader *reader, const EpubAllocator *allocator);
+
+/// Makes a source over the same archive that fetches its own windows, so
+/// entries can be read from several threads (each one with its own copy).
+void ArchiveSource_copy(ArchiveSource *dst, const ArchiveSource *src);
+
+/// Finds and parses the central directory.
+EpubError ArchiveSource_read_directory(ArchiveSource *src, ZipDirectory *dir);
+
+/// Returns a window containing the local header and data of `entry`, valid
+/// until the next call or `ArchiveSource_close`. Returns `NULL` on error (see `error`).
+const ZipArchive *ArchiveSource_entry(ArchiveSource *src, const ZipEntry *entry);
+
+/// Frees the fetched windows, a whole archive is left open.
+void ArchiveSource_close(ArchiveSource *src);
+
+#endif
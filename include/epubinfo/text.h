@@ -0,0 +1,18 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include "epubinfo.h"
+#include "package.h"
+#include "source.h"
+
+// Text buffered by a worker while it waits for its turn.
+#define TEXT_CHUNK 65536
+
+/// Extracts the text of the spine of `pkg` with `threads` workers (0: one per
+/// CPU), each one reading entries through its own copy of `src`.
+/// Buffers are allocated with the allocator of `src`.
+/// See `EpubDocument_extract_text`.
+EpubError text_extract_spine(const EpubPackage *pkg, const ArchiveSource *src, int threads,
+                             EpubTextCallback callback, void *user, EpubTextStats *stats);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stddef.h>
+
+#include "xml.h"
+#include "zip.h"
+
+// Initial size of the window entries are inflated into while tokenizing.
+// It only grows when a single token doesn't fit in it.
+#define ENTRY_TOKENIZER_CHUNK 16384
+
+// Largest window, a token that doesn't fit in it is an error.
+#define ENTRY_TOKENIZER_MAX (1 << 20)
+
+/// Tokenizes an entry while it's being inflated, keeping only a window of
+/// the content in memory. A zeroed tokenizer is ready to be opened.
+typedef struct {
+    ZipEntryStream stream;
+    XmlParser parser;
+    char *buffer;
+    size_t capacity;
+    const EpubAllocator *allocator; // window and zlib state, set before the first open
+    int text_pieces;            // text longer than the window comes in several TEXT_TAG tokens
+} EntryTokenizer;
+
+/// A tokenizer can be opened again without closing it, the window and the
+/// inflate state of the previous entry are reused.
+/// Return 1 on success, 0 otherwise.
+int EntryTokenizer_open(EntryTokenizer *t, const ZipArchive *za, const ZipEntry *entry);
+
+/// The token points into the window, it's valid until the next call.
+/// With `text_pieces`, text that fills the window is returned up to its end
+/// (less a reference cut short), so only tags grow the window.
+/// Inflate and memory errors, and tokens longer than ENTRY_TOKENIZER_MAX, are
+/// returned as `ERROR_TAG`.
+XmlToken EntryTokenizer_next(EntryTokenizer *t);
+
+void EntryTokenizer_close(EntryTokenizer *t);
+
+#endif
@@ -3,9 +3,35 @@
 #include <stddef.h>
 #include "arena.h"
 
+/// Byte scanning kernels used by the tokenizer.
+/// Every function returns `len` when nothing is found.
+typedef struct {
+    /// Offset of the '>' ending the tag at `content[0]`, skipping quoted attribute values.
+    size_t (*tag_end)(const char *content, size_t len);
+    /// Offset of the first '<'. Entity references ('&') are part of the text.
+    size_t (*text_end)(const char *content, size_t len);
+    /// Offset of the first non whitespace byte.
+    size_t (*whitespace)(const char *content, size_t len);
+    const char *name;
+} XmlScanner;
+
+extern const XmlScanner xml_scanner_scalar;
+extern const XmlScanner xml_scanner_sse2;   // same as scalar on non x86 targets
+extern const XmlScanner xml_scanner_avx2;   // same as scalar on non x86 targets
+
+/// Fastest scanner supported by the running CPU.
+const XmlScanner *xml_scanner_best(void);
+
+/// `content` doesn't need to be null terminated, only `length` bytes are read.
+/// In streaming mode (`partial` = 1) more content follows `length`: a token
+/// crossing that boundary is reported as PARTIAL_TAG without moving the cursor,
+/// so the caller can append data (see `xml_parser_compact`) and call xml_next again.
 typedef struct {
     size_t cursor;
     char *content;
+    size_t length;
+    int partial;
+    const XmlScanner *scanner;  // set by xml_parser_init
 } XmlParser;
 
 typedef enum {
@@ -18,6 +44,7 @@ typedef enum {
     TEXT_TAG,
     EOF_TAG,
     ERROR_TAG,
+    PARTIAL_TAG,
 } TagType;
 
 typedef struct {
@@ -25,17 +52,48 @@ typedef struct {
     char *content;
 } XmlValue;
 
+/// View into the parsed content, not null terminated.
 typedef struct {
-    char *text;
-    int len;
+    const char *text;
+    size_t len;
 } XmlValueSlice;
 
+/// Zero-copy token, `value` points into `XmlParser.content`.
+/// For tags it spans from '<' to '>' (both included).
+typedef struct {
+    TagType type;
+    XmlValueSlice value;
+} XmlToken;
+
 /// Gets the value of an attribute in a tag
+/// The value is copied to the arena, returns `NULL` if not found.
 char* xml_tag_get_attribute(Arena *arena, char *tag, char *name);
 
 /// Returns the XML tag name
+/// The name is copied to the arena.
 char* xml_tag_get_name(Arena *arena, char *tag);
 
+/// Returns the name of a tag token, prefix included ("dc:title").
+XmlValueSlice xml_slice_tag_name(XmlValueSlice tag);
+
+/// Splits a qualified name ("dc:title") and returns the local part ("title").
+/// If `prefix` isn't NULL it's set to the prefix ("dc"), empty if there is none.
+XmlValueSlice xml_slice_local_name(XmlValueSlice name, XmlValueSlice *prefix);
+
+/// Finds the value of the attribute `name` (quotes excluded) in a tag token.
+/// Return 1 if found, 0 otherwise.
+int xml_slice_tag_attribute(XmlValueSlice tag, const char *name, XmlValueSlice *value);
+
+/// Iterates the attributes of a tag token, `*offset` must start at 0.
+/// Return 1 and sets `name` and `value` (quotes excluded) for the next attribute, 0 at the end.
+int xml_slice_next_attribute(XmlValueSlice tag, size_t *offset, XmlValueSlice *name, XmlValueSlice *value);
+
+/// Return 1 if `slice` and the null terminated `str` are equal.
+int xml_slice_equals(XmlValueSlice slice, const char *str);
+
+/// Returns a null terminated copy of `slice` allocated in the arena.
+char* xml_slice_dup(Arena *arena, XmlValueSlice slice);
+
 /// Returns the XML tag type
 TagType get_tag_type(char *tag, int tag_len);
 
@@ -43,6 +101,28 @@ TagType get_tag_type(char *tag, int tag_len);
 /// Returns -1 if not found
 int xml_find_offset(char c, char *content);
 
+void xml_parser_init(XmlParser *parser, char *content, size_t length);
+
+/// Moves the unread bytes to the start of `content`.
+/// Returns the number of bytes left unread (the new `length`).
+size_t xml_parser_compact(XmlParser *parser);
+
+/// Returns the next token without copying it.
+/// The token is valid until `parser.content` is modified (e.g. by `xml_parser_compact`).
+XmlToken xml_next_token(XmlParser *parser);
+
+/// Decodes the character and entity references of a text token (`&amp;`, `&#233;`,
+/// `&#x2014;` and the common HTML ones such as `&nbsp;`) to UTF-8. Unknown or
+/// malformed references are kept as they are, invalid code points become U+FFFD.
+/// `out` needs `len` bytes, the output is never longer, and may be `text` itself.
+/// Returns the number of bytes written.
+size_t xml_decode_entities(const char *text, size_t len, char *out);
+
+/// Returns the length of the reference `text` may end with, cut short (from its '&'
+/// to the end), 0 if there is none. Text split there decodes the same in pieces.
+size_t xml_partial_reference(const char *text, size_t len);
+
+/// Same as `xml_next_token` but the token is copied (null terminated) to the arena.
 XmlValue xml_next(Arena *arena, XmlParser *parser);
 
 #endif
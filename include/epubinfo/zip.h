@@ -1,8 +1,11 @@
 #ifndef ZIP_H
 #define ZIP_H
 
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
+#include <zlib.h>
+
+#include "alloc.h"
 
 // ZIP Notes
 // ref: https://www.vadeen.com/posts/the-zip-file-format/
@@ -25,12 +28,34 @@
 #define EOCDR_OFF_CDIR_OFFSET        0x10  // 4 bytes
 #define EOCDR_OFF_COMMENT_LEN        0x14  // 2 bytes
 #define EOCDR_OFF_COMMENT            0x16  // n bytes
+#define EOCDR_MAX_COMMENT_LEN        0xFFFF
+
+// ZIP64 End of Central Directory Locator (right before the EOCDR)
+#define ZIP64_EOCDL_SIGNATURE        0x07064b50
+#define ZIP64_EOCDL_LEN              20
+#define ZIP64_EOCDL_OFF_EOCDR_OFFSET 0x08  // 8 bytes
+
+// ZIP64 End of Central Directory Record
+#define ZIP64_EOCDR_SIGNATURE        0x06064b50
+#define ZIP64_EOCDR_LEN_FIXED        56
+#define ZIP64_EOCDR_OFF_DISK_NUM     0x10  // 4 bytes
+#define ZIP64_EOCDR_OFF_START_CDIR_DISK 0x14  // 4 bytes
+#define ZIP64_EOCDR_OFF_ENTRIES_DISK 0x18  // 8 bytes
+#define ZIP64_EOCDR_OFF_TOTAL_ENTRIES 0x20 // 8 bytes
+#define ZIP64_EOCDR_OFF_CDIR_SIZE    0x28  // 8 bytes
+#define ZIP64_EOCDR_OFF_CDIR_OFFSET  0x30  // 8 bytes
+
+// ZIP64 extended information extra field
+#define ZIP64_EXTRA_ID               0x0001
+#define ZIP64_MARKER_16              0xFFFF
+#define ZIP64_MARKER_32              0xFFFFFFFF
 
 // Central Directory Record
 #define CDR_LEN_FIXED               46
 #define CDR_OFF_SIGNATURE           0x02014b50
 #define CDR_OFF_SIGNATURE_LEN       4
 #define CDR_OFF_COMPRESSION_METHOD  10
+#define CDR_OFF_CRC32               16
 #define CDR_OFF_COMPRESSED_SIZE     20
 #define CDR_OFF_UNCOMPRESSED_SIZE   24
 #define CDR_OFF_FILENAME_LEN        28
@@ -40,44 +65,215 @@
 #define CDR_OFF_FILENAME            46
 
 // Local File Header
+#define LFH_SIGNATURE               0x04034b50
 #define LFH_LEN_FIXED               30
+#define LFH_OFF_FILENAME_LEN        26
+#define LFH_OFF_EXTRA_FIELD_LEN     28
+
+// Bytes a reader needs from the end of the archive to find the EOCDR (and
+// the ZIP64 locator and record when they are right before it).
+#define ZIP_TAIL_SEARCH_LEN (EOCDR_LEN_NO_COMMENT + EOCDR_MAX_COMMENT_LEN + ZIP64_EOCDL_LEN + ZIP64_EOCDR_LEN_FIXED)
+
+// Compression methods
+#define ZIP_METHOD_STORED           0
+#define ZIP_METHOD_DEFLATED         8
 
+/// Read-only view over an archive, or over a window of it.
+/// `data` is either a private mapping of a file (`mapped` = 1) or a
+/// caller-owned buffer (`mapped` = 0) that must outlive the archive.
+/// `data[0]` is the byte at offset `base` of an archive of `archive_size`
+/// bytes, offsets read from the archive are always absolute.
 typedef struct {
-    uint16_t disk_num;
-    uint16_t start_cent_dir_disk;
-    uint16_t num_of_entries_disk;
-    uint16_t num_of_entries;
-    uint32_t size_cent_dir;
-    uint32_t cent_dir_offset;
+    const unsigned char *data;
+    size_t size;
+    int mapped;
+    int fd;                     // file behind the mapping, only valid if `mapped`
+    uint64_t base;
+    uint64_t archive_size;
+} ZipArchive;
+
+/// Values are widened to the ZIP64 sizes, they are taken from the ZIP64
+/// record when the archive has one.
+typedef struct {
+    uint32_t disk_num;
+    uint32_t start_cent_dir_disk;
+    uint64_t num_of_entries_disk;
+    uint64_t num_of_entries;
+    uint64_t size_cent_dir;
+    uint64_t cent_dir_offset;
 } ZipEocdrHeader;
 
 typedef struct {
-    uint32_t uncompressed_size;
-    uint32_t compressed_size;
-    uint32_t file_offset;
+    uint64_t uncompressed_size;
+    uint64_t compressed_size;
+    uint64_t file_offset;
+    uint32_t filename_offset;   // into ZipDirectory.names
     uint16_t filename_len;
-    uint16_t extra_field_len;
     uint16_t compression_method;
-    char filename[1024];
+    uint32_t crc32;             // of the uncompressed content
 } ZipEntry;
 
+typedef struct {
+    uint32_t hash;
+    uint32_t entry;             // index in ZipDirectory.entries + 1, 0 = empty
+} ZipIndexSlot;
+
+/// Parsed central directory.
+/// Entries, index and names live in a single allocation.
+typedef struct {
+    ZipEntry *entries;
+    size_t num_of_entries;
+    char *names;                // every name is null terminated
+    ZipIndexSlot *index;        // open addressing (linear probing) over file names
+    size_t index_capacity;      // power of two
+    const EpubAllocator *allocator; // owner of the block, NULL = malloc
+} ZipDirectory;
+
+// Largest entry inflated in one call by the one-shot decoder (inflate.h),
+// when it's built in (ZIP_ONESHOT_INFLATE). OPFs and chapters are well below.
+#define ZIP_ONESHOT_MAX (512 * 1024)
+
+/// Raw deflate decompressor. The zlib state is allocated on first use and
+/// only reset between entries. A zeroed inflater is ready to use, set
+/// `allocator` before the first use to route zlib's memory through it.
+typedef struct {
+    z_stream strm;
+    int initialized;
+    const EpubAllocator *allocator; // also used for zip_inflater_uncompress_entry results
+    int verify;                 // check the CRC-32 of every entry, computed while inflating
+} ZipInflater;
+
+/// Incremental reader over the content of one entry.
+/// Compressed input is read straight from the archive view.
+typedef struct {
+    ZipInflater inflater;
+    const unsigned char *input;
+    uint64_t input_left;
+    uint64_t output_left;
+    uint16_t compression_method;
+    int started;                // some output was read
+    uint32_t crc;               // of the output so far, if `inflater.verify`
+    uint32_t expected_crc;
+} ZipEntryStream;
+
+/// Maps `filename` read-only into memory.
+/// Return 1 on success, 0 otherwise.
+int zip_archive_open(ZipArchive *za, const char *filename);
+
+/// Wraps `size` bytes at `data` without copying them.
+/// The buffer must stay valid until `zip_archive_close`.
+void zip_archive_from_memory(ZipArchive *za, const void *data, size_t size);
+
+/// Unmaps the archive (if it was mapped). Safe to call on a zeroed archive.
+void zip_archive_close(ZipArchive *za);
+
+uint16_t read_le16(const unsigned char *p);
+uint32_t read_le32(const unsigned char *p);
+uint64_t read_le64(const unsigned char *p);
 
-int zip_valid_header(FILE *fp);
+/// Views `size` bytes of an archive of `archive_size` bytes, starting at offset `base`.
+/// Lookups outside the window fail as if the archive was truncated.
+void zip_archive_window(ZipArchive *za, const void *data, size_t size, uint64_t base, uint64_t archive_size);
 
+/// Return 1 if the window contains the `len` bytes at absolute offset `offset`.
+int zip_archive_contains(const ZipArchive *za, uint64_t offset, uint64_t len);
+
+int zip_valid_header(const ZipArchive *za);
+
+/// The window must reach the end of the archive.
+/// Only the last 64 KiB + 22 bytes of the archive are scanned, the first
+/// record (from the end) with a consistent comment length and central
+/// directory bounds wins. The ZIP64 record is followed when present.
 /// All values of header are initialized on success.
 /// Return 1 on success, 0 otherwise.
-int zip_read_end_of_central_directory_record(FILE *fp, ZipEocdrHeader *header);
+int zip_read_end_of_central_directory_record(const ZipArchive *za, ZipEocdrHeader *header);
+
+/// Parses the whole central directory in one pass and builds the file name index.
+/// The window must contain the central directory.
+/// `dir` is allocated with `allocator` (may be NULL) and must be released with `zip_directory_free`.
+/// Return 1 on success, 0 otherwise.
+int zip_read_central_directory(const ZipArchive *za, const ZipEocdrHeader *header, ZipDirectory *dir,
+                               const EpubAllocator *allocator);
+
+void zip_directory_free(ZipDirectory *dir);
+
+/// Return value is a reference to `dir.names`
+const char *zip_entry_filename(const ZipDirectory *dir, const ZipEntry *entry);
 
-/// Returns an `allocated` array of entries
-/// Array length is same as `header.num_of_entries`
-ZipEntry* zip_read_central_directory(FILE *fp, ZipEocdrHeader header);
+/// Returns a pointer to the raw (possibly compressed) entry bytes inside the archive.
+/// There are `entry->compressed_size` bytes available.
+/// Returns `NULL` if the local header is invalid or out of bounds.
+const unsigned char *zip_entry_raw_data(const ZipArchive *za, const ZipEntry *entry);
 
-/// Returns an `allocated` string with the entry content
+/// Zero-copy access to a stored (method 0) entry.
+/// The slice is not null terminated and lives as long as the archive.
+/// Returns `NULL` if the entry is compressed or invalid.
+const char *zip_entry_stored_data(const ZipArchive *za, const ZipEntry *entry, size_t *len);
+
+/// Writes the uncompressed content of the entry to `fd`, starting at its current offset.
+/// Stored entries are copied by the kernel (copy_file_range, sendfile) when the archive
+/// is a file, deflated entries are inflated in fixed size chunks.
+/// The zlib state comes from `allocator` (may be NULL).
+/// Returns EPUB_OK, EPUB_ERROR_INFLATE if the entry can't be read or EPUB_ERROR_IO if `fd`
+/// can't be written.
+EpubError zip_entry_extract_to_fd(const ZipArchive *za, const ZipEntry *entry, int fd, const EpubAllocator *allocator);
+
+/// Returns an `allocated`, null terminated string with the entry content
 /// Returns `NULL` on error.
-char *zip_uncompress_entry(FILE *fp, ZipEntry *entry);
+char *zip_uncompress_entry(const ZipArchive *za, const ZipEntry *entry);
+
+/// Same as `zip_uncompress_entry`, reusing the state of `inflater`.
+/// The result is allocated with `inflater->allocator`. With `inflater->verify`
+/// an entry whose content doesn't match its CRC-32 is an error.
+char *zip_inflater_uncompress_entry(ZipInflater *inflater, const ZipArchive *za, const ZipEntry *entry);
+
+/// Inflates the whole raw deflate stream `in` into `out`.
+/// Small outputs go through the one-shot decoder when it's built in.
+/// If `crc` isn't NULL the output is added to it chunk by chunk, while it's still in cache.
+/// Return 1 if it decodes to exactly `out_len` bytes, 0 otherwise.
+int zip_inflater_inflate(ZipInflater *inflater, const unsigned char *in, uint64_t in_len, unsigned char *out, uint64_t out_len,
+                         uint32_t *crc);
+
+/// Prepares the zlib state for a new deflate stream, allocating it only the first time.
+/// Return 1 on success, 0 otherwise.
+int zip_inflater_reset(ZipInflater *inflater);
+
+/// Frees the zlib state, the inflater can be used again.
+void zip_inflater_free(ZipInflater *inflater);
+
+/// Return 1 if a stream over `entry` inflates it in one call when the first
+/// read asks for the whole content (one-shot decoder built in, small entry).
+/// Readers can size their buffer for it.
+int zip_entry_oneshot(const ZipEntry *entry);
+
+/// Prepares a closed (or zeroed) `stream` to read `entry` in chunks,
+/// its inflater allocates with `allocator` (may be NULL). Set `inflater.verify`
+/// after opening to check the CRC-32 of the entries read.
+/// Return 1 on success, 0 otherwise.
+int zip_entry_stream_open(ZipEntryStream *stream, const ZipArchive *za, const ZipEntry *entry,
+                          const EpubAllocator *allocator);
+
+/// Same as `zip_entry_stream_open`, but a stream that was already used keeps
+/// its inflate state and only resets it (no allocation).
+/// Return 1 on success, 0 otherwise.
+int zip_entry_stream_reset(ZipEntryStream *stream, const ZipArchive *za, const ZipEntry *entry);
+
+/// Fills `buf` with up to `len` bytes of uncompressed content.
+/// A first read with room for the whole of a `zip_entry_oneshot` entry decodes it in one call.
+/// With `inflater.verify`, the read that reaches the end fails if the CRC-32 doesn't match.
+/// Returns the number of bytes written, 0 at the end of the entry and -1 on error (a
+/// deflate stream ending before the uncompressed size of the entry is an error).
+long zip_entry_stream_read(ZipEntryStream *stream, void *buf, size_t len);
+
+/// Can be called before the end of the entry to stop inflating early.
+void zip_entry_stream_close(ZipEntryStream *stream);
+
+/// Directories (names ending with '/') are never returned.
+/// Return value is a reference to `dir.entries`, `NULL` if not found.
+const ZipEntry* zip_find_entry(const ZipDirectory *dir, const char *name, size_t name_len);
 
 /// `filename` should be a null terminated string
-/// Return value is a reference to `entries`
-ZipEntry* zip_find_entry_by_filename(ZipEntry *entries, uint16_t num_of_entries, char *filename);
+/// Return value is a reference to `dir.entries`
+const ZipEntry* zip_find_entry_by_filename(const ZipDirectory *dir, const char *filename);
 
 #endif
@@ -0,0 +1,28 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "epubinfo/alloc.h"
+
+void* epub_malloc(const EpubAllocator *allocator, size_t size) {
+    return allocator ? allocator->alloc(allocator->user, size) : malloc(size);
+}
+
+void* epub_calloc(const EpubAllocator *allocator, size_t count, size_t size) {
+    if (!allocator) return calloc(count, size);
+    if (size && count > SIZE_MAX / size) return NULL;
+
+    void *ptr = allocator->alloc(allocator->user, count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void* epub_realloc(const EpubAllocator *allocator, void *ptr, size_t size) {
+    return allocator ? allocator->realloc(allocator->user, ptr, size) : realloc(ptr, size);
+}
+
+void epub_free(const EpubAllocator *allocator, void *ptr) {
+    if (!ptr) return;
+    if (allocator) allocator->free(allocator->user, ptr);
+    else free(ptr);
+}
@@ -1,40 +1,109 @@
 #include <stdint.h>
-#include <stdlib.h>
 #include "epubinfo/arena.h"
 
+struct ArenaBlock {
+    ArenaBlock *prev;
+    size_t capacity;
+    size_t offset;
+    unsigned char data[];
+};
+
 static inline uintptr_t align_forward(uintptr_t ptr, size_t alignment) {
     size_t mask = alignment - 1;
     return (ptr + mask) & ~mask;
 }
 
-int arena_init(Arena *arena, size_t size) {
-    arena->buffer = malloc(size);
-    if (!arena->buffer) return 0;
-    arena->capacity = size;
-    arena->offset = 0;
-    return 1;
+static ArenaBlock *arena_push_block(Arena *arena, size_t capacity) {
+    ArenaBlock *block = epub_malloc(arena->allocator, sizeof(ArenaBlock) + capacity);
+    if (!block) return NULL;
+
+    block->prev = arena->current;
+    block->capacity = capacity;
+    block->offset = 0;
+
+    arena->current = block;
+    arena->reserved += capacity;
+    arena->block_count += 1;
+    return block;
+}
+
+static void arena_pop_block(Arena *arena) {
+    ArenaBlock *block = arena->current;
+    arena->current = block->prev;
+    arena->reserved -= block->capacity;
+    arena->block_count -= 1;
+    epub_free(arena->allocator, block);
+}
+
+int arena_init(Arena *arena, size_t size, const EpubAllocator *allocator) {
+    arena->current = NULL;
+    arena->block_size = size ? size : 1024;
+    arena->allocator = allocator;
+    arena->reserved = 0;
+    arena->used = 0;
+    arena->high_water = 0;
+    arena->alloc_count = 0;
+    arena->block_count = 0;
+    return arena_push_block(arena, arena->block_size) != NULL;
 }
 
 void arena_free(Arena *arena) {
-    free(arena->buffer);
-    arena->buffer = NULL;
-    arena->offset = 0;
-    arena->capacity = 0;
+    while (arena->current) arena_pop_block(arena);
+    arena->used = 0;
 }
 
 void* arena_alloc(Arena *arena, size_t size, size_t alignment) {
-    uintptr_t current = (uintptr_t)(arena->buffer + arena->offset);
-    uintptr_t aligned = align_forward(current, alignment);
-    size_t new_offset = (aligned - (uintptr_t)arena->buffer) + size;
+    ArenaBlock *block = arena->current;
 
-    if (new_offset > arena->capacity) {
-        return NULL;
+    if (block) {
+        uintptr_t current = (uintptr_t)(block->data + block->offset);
+        uintptr_t aligned = align_forward(current, alignment);
+        size_t new_offset = (aligned - (uintptr_t)block->data) + size;
+
+        if (new_offset <= block->capacity) {
+            arena->used += new_offset - block->offset;
+            block->offset = new_offset;
+            goto done;
+        }
     }
 
-    arena->offset = new_offset;
-    return (void *)aligned;
+    // grow geometrically, and always enough for this allocation
+    size_t capacity = arena->block_size;
+    if (block) capacity *= 2;
+    if (capacity < size + alignment) capacity = size + alignment;
+
+    block = arena_push_block(arena, capacity);
+    if (!block) return NULL;
+    arena->block_size = capacity;
+
+    uintptr_t aligned = align_forward((uintptr_t)block->data, alignment);
+    block->offset = (aligned - (uintptr_t)block->data) + size;
+    arena->used += block->offset;
+
+done:
+    if (arena->used > arena->high_water) arena->high_water = arena->used;
+    arena->alloc_count += 1;
+    return block->data + block->offset - size;
+}
+
+ArenaMark arena_mark(const Arena *arena) {
+    ArenaMark mark = { arena->current, arena->current ? arena->current->offset : 0, arena->used };
+    return mark;
+}
+
+void arena_rewind(Arena *arena, ArenaMark mark) {
+    while (arena->current && arena->current != mark.block) arena_pop_block(arena);
+    if (arena->current) arena->current->offset = mark.offset;
+    arena->used = mark.used;
 }
 
 void arena_reset(Arena *arena) {
-    arena->offset = 0;
+    if (arena->block_count > 1) {
+        size_t capacity = arena->reserved;
+        while (arena->current) arena_pop_block(arena);
+        arena_push_block(arena, capacity);
+    }
+
+    if (arena->current) arena->current->offset = 0;
+    arena->used = 0;
 }
@@ -0,0 +1,177 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "epubinfo/epubinfo.h"
+#include "epubinfo/cache.h"
+
+// Work stealing over the index space of a batch.
+//
+// Each worker owns a range of indices packed in one 64 bits word
+// (begin << 32 | end). The owner takes indices from the front, an idle
+// worker steals the back half of the biggest range. Both sides update the
+// word with a CAS, so a range is never handed out twice.
+
+typedef struct {
+    _Atomic uint64_t range;
+    pthread_t thread;
+    int started;
+} BatchWorker;
+
+typedef struct {
+    EpubCache *cache;           // may be NULL
+    const char *const *filenames;
+    unsigned fields;
+    EpubBatchCallback callback;
+    void *user;
+    BatchWorker *workers;
+    int worker_count;
+} Batch;
+
+typedef struct {
+    Batch *batch;
+    int id;
+} BatchTask;
+
+static inline uint64_t range_pack(uint32_t begin, uint32_t end) {
+    return (uint64_t)begin << 32 | end;
+}
+
+static inline uint32_t range_begin(uint64_t range) { return range >> 32; }
+static inline uint32_t range_end(uint64_t range) { return (uint32_t)range; }
+
+static int batch_pop(BatchWorker *worker, uint32_t *index) {
+    uint64_t range = atomic_load(&worker->range);
+    while (range_begin(range) < range_end(range)) {
+        uint64_t next = range_pack(range_begin(range) + 1, range_end(range));
+        if (atomic_compare_exchange_weak(&worker->range, &range, next)) {
+            *index = range_begin(range);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Moves the back half of the biggest range to `thief`, which must be empty.
+// Return 0 when there is nothing left to steal.
+static int batch_steal(Batch *batch, int thief) {
+    while (1) {
+        int victim = -1;
+        uint32_t most = 0;
+        for (int i = 0; i < batch->worker_count; i++) {
+            uint64_t range = atomic_load(&batch->workers[i].range);
+            uint32_t left = range_end(range) - range_begin(range);
+            if (i != thief && range_begin(range) < range_end(range) && left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim < 0) return 0;
+
+        BatchWorker *w = &batch->workers[victim];
+        uint64_t range = atomic_load(&w->range);
+        uint32_t begin = range_begin(range), end = range_end(range);
+        if (begin >= end) continue;
+
+        uint32_t mid = begin + (end - begin) / 2;
+        if (atomic_compare_exchange_strong(&w->range, &range, range_pack(begin, mid))) {
+            atomic_store(&batch->workers[thief].range, range_pack(mid, end));
+            return 1;
+        }
+    }
+}
+
+static void *batch_run(void *arg) {
+    BatchTask *task = arg;
+    Batch *batch = task->batch;
+    BatchWorker *self = &batch->workers[task->id];
+
+    // Without a context every file still gets a result, there's just no reuse.
+    EpubContext *ctx = EpubContext_new();
+
+    do {
+        uint32_t i;
+        while (batch_pop(self, &i)) {
+            EpubBatchResult result = { NULL, EPUB_ERROR_NO_MEMORY, 0, 0 };
+            if (ctx) {
+                struct timespec start, end;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (batch->cache) {
+                    result.doc = cache_open_file(batch->cache, ctx, batch->filenames[i], batch->fields, &result.error, &result.cached);
+                } else {
+                    result.doc = EpubContext_open_file(ctx, batch->filenames[i], batch->fields, &result.error);
+                }
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                result.elapsed_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + end.tv_nsec - start.tv_nsec;
+            }
+            batch->callback(batch->user, i, &result);
+        }
+    } while (batch_steal(batch, task->id));
+
+    EpubContext_free(ctx);
+    return NULL;
+}
+
+static void batch_store(void *user, size_t index, const EpubBatchResult *result) {
+    EpubBatchResult *results = user;
+    results[index] = *result;
+}
+
+EpubError EpubDocument_open_batch(const char *const *filenames, size_t count, unsigned fields, int threads, EpubBatchResult *results) {
+    if (!results && count > 0) return EPUB_ERROR_INVALID_ARGUMENT;
+    return EpubDocument_open_batch_each(filenames, count, fields, threads, batch_store, results);
+}
+
+EpubError EpubDocument_open_batch_each(const char *const *filenames, size_t count, unsigned fields, int threads,
+                                       EpubBatchCallback callback, void *user) {
+    return EpubCache_open_batch_each(NULL, filenames, count, fields, threads, callback, user);
+}
+
+EpubError EpubCache_open_batch_each(EpubCache *cache, const char *const *filenames, size_t count, unsigned fields,
+                                    int threads, EpubBatchCallback callback, void *user) {
+    if ((!filenames || !callback) && count > 0) return EPUB_ERROR_INVALID_ARGUMENT;
+    if (count > UINT32_MAX) return EPUB_ERROR_INVALID_ARGUMENT;
+    if (count == 0) return EPUB_OK;
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((size_t)threads > count) threads = count;
+
+    BatchWorker *workers = calloc(threads, sizeof(BatchWorker));
+    BatchTask *tasks = calloc(threads, sizeof(BatchTask));
+    if (!workers || !tasks) {
+        free(workers);
+        free(tasks);
+        return EPUB_ERROR_NO_MEMORY;
+    }
+
+    Batch batch = { cache, filenames, fields, callback, user, workers, threads };
+
+    // contiguous slices, neighbouring files often live in the same directory
+    for (int i = 0; i < threads; i++) {
+        uint32_t begin = (uint64_t)count * i / threads;
+        uint32_t end = (uint64_t)count * (i + 1) / threads;
+        atomic_init(&workers[i].range, range_pack(begin, end));
+        tasks[i].batch = &batch;
+        tasks[i].id = i;
+    }
+
+    // worker 0 is the calling thread, the work of threads that fail to start is stolen
+    for (int i = 1; i < threads; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, batch_run, &tasks[i]) == 0;
+    }
+    batch_run(&tasks[0]);
+
+    for (int i = 1; i < threads; i++) {
+        if (workers[i].started) pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
+    free(tasks);
+    return EPUB_OK;
+}
@@ -0,0 +1,536 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "epubinfo/cache.h"
+#include "epubinfo/metadata.h"
+
+// The mapping reserves address space past the end of the file, so appends
+// usually don't need a new mapping. Pages past the end are never touched.
+#define CACHE_MIN_MAPPING (1u << 20)
+
+// The file is compacted once the records no book uses anymore (replaced,
+// invalidated or cleared) take more than this and more than the live ones.
+#define CACHE_COMPACT_MIN_DEAD (4u << 20)
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t offset;            // of the last record of the book, 0 = empty
+} CacheSlot;
+
+// Identity of a book on disk.
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+} CacheKey;
+
+struct EpubCache {
+    char *path;
+    int fd;
+    int writable;
+    pthread_rwlock_t lock;      // readers look up, writers append and remap
+    const unsigned char *map;
+    size_t map_capacity;        // mapped length, may be past the end of the file
+    uint64_t scanned;           // records before this offset are indexed
+    uint64_t live_bytes;        // size of the indexed metadata records
+    CacheSlot *slots;           // open addressing (linear probing) over (dev, ino)
+    size_t slot_capacity;       // power of two
+    size_t slot_count;
+};
+
+static int cache_key_from_path(const char *filename, CacheKey *key) {
+    struct stat st;
+    if (stat(filename, &st) != 0) return 0;
+
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->size = st.st_size;
+    key->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return 1;
+}
+
+static int cache_key_equals(const CacheKey *a, const CacheKey *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size && a->mtime_ns == b->mtime_ns;
+}
+
+static size_t cache_slot_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h ^ (h >> 29));
+}
+
+static CacheSlot *EpubCache_slot(const EpubCache *cache, uint64_t dev, uint64_t ino) {
+    size_t mask = cache->slot_capacity - 1;
+    for (size_t i = cache_slot_hash(dev, ino) & mask;; i = (i + 1) & mask) {
+        CacheSlot *slot = &cache->slots[i];
+        if (!slot->offset || (slot->dev == dev && slot->ino == ino)) return slot;
+    }
+}
+
+static int EpubCache_index(EpubCache *cache, uint64_t dev, uint64_t ino, uint64_t offset) {
+    if ((cache->slot_count + 1) * 2 > cache->slot_capacity) {
+        size_t capacity = cache->slot_capacity ? cache->slot_capacity * 2 : 1024;
+        CacheSlot *slots = calloc(capacity, sizeof(CacheSlot));
+        if (!slots) return 0;
+
+        CacheSlot *old = cache->slots;
+        size_t old_capacity = cache->slot_capacity;
+        cache->slots = slots;
+        cache->slot_capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].offset) *EpubCache_slot(cache, old[i].dev, old[i].ino) = old[i];
+        }
+        free(old);
+    }
+
+    CacheSlot *slot = EpubCache_slot(cache, dev, ino);
+    if (!slot->offset) cache->slot_count += 1;
+    *slot = (CacheSlot){ dev, ino, offset };
+    return 1;
+}
+
+static uint32_t cache_record_checksum(const CacheRecord *record) {
+    CacheRecord header = *record;
+    header.checksum = 0;
+
+    uLong crc = crc32(0, (const Bytef *)&header, sizeof(header));
+    return crc32(crc, (const Bytef *)(record + 1), record->size - sizeof(CacheRecord));
+}
+
+// Makes the first `size` bytes of the file readable through `cache->map`.
+static int EpubCache_map(EpubCache *cache, uint64_t size) {
+    if (size <= cache->map_capacity) return 1;
+    if (size > SIZE_MAX / 2) return 0;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t capacity = size * 2 > CACHE_MIN_MAPPING ? size * 2 : CACHE_MIN_MAPPING;
+    capacity = (capacity + page - 1) & ~(size_t)(page - 1);
+
+    void *map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED) return 0;
+
+    if (cache->map) munmap((void *)cache->map, cache->map_capacity);
+    cache->map = map;
+    cache->map_capacity = capacity;
+    return 1;
+}
+
+// Return 1 if another process compacted the cache into a new file.
+static int EpubCache_replaced(const EpubCache *cache) {
+    struct stat current, opened;
+    if (stat(cache->path, &current) != 0 || fstat(cache->fd, &opened) != 0) return 0;
+    return current.st_dev != opened.st_dev || current.st_ino != opened.st_ino;
+}
+
+static int cache_header_valid(int fd) {
+    CacheFileHeader header = {0}, found;
+    memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_FILE_VERSION;
+    return pread(fd, &found, sizeof(found), 0) == sizeof(found) && memcmp(&found, &header, sizeof(header)) == 0;
+}
+
+// Makes `fd` the cache file, nothing of it is indexed yet. Needs the write lock.
+static void EpubCache_switch(EpubCache *cache, int fd) {
+    if (cache->map) munmap((void *)cache->map, cache->map_capacity);
+    cache->map = NULL;
+    cache->map_capacity = 0;
+    close(cache->fd);
+    cache->fd = fd;
+
+    if (cache->slots) memset(cache->slots, 0, cache->slot_capacity * sizeof(CacheSlot));
+    cache->slot_count = 0;
+    cache->live_bytes = 0;
+    cache->scanned = sizeof(CacheFileHeader);
+}
+
+static int EpubCache_refresh(EpubCache *cache);
+
+// Moves to the file that replaced the one this cache has open. Needs the write lock.
+static int EpubCache_reopen(EpubCache *cache) {
+    int fd = open(cache->path, cache->writable ? O_RDWR | O_APPEND | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (!cache_header_valid(fd)) {
+        close(fd);
+        return 0;
+    }
+    EpubCache_switch(cache, fd);
+    return EpubCache_refresh(cache);
+}
+
+// Indexes the records appended since the last refresh, by this process or
+// another one. Needs the write lock.
+static int EpubCache_refresh(EpubCache *cache) {
+    if (EpubCache_replaced(cache)) return EpubCache_reopen(cache);
+
+    struct stat st;
+    if (fstat(cache->fd, &st) != 0) return 0;
+    uint64_t end = st.st_size;
+    if (end <= cache->scanned) return 1;
+    if (!EpubCache_map(cache, end)) return 0;
+
+    uint64_t offset = cache->scanned;
+    while (offset + sizeof(CacheRecord) <= end) {
+        const CacheRecord *record = (const CacheRecord *)&cache->map[offset];
+        if (record->magic != CACHE_RECORD_MAGIC || record->size < sizeof(CacheRecord) || record->size % 8 != 0) {
+            offset += 8; // garbage left by an interrupted append, look for the next record
+            continue;
+        }
+        if (offset + record->size > end) break; // still being written
+
+        if (cache_record_checksum(record) != record->checksum) {
+            offset += 8;
+            continue;
+        }
+
+        int ok = 1;
+        switch (record->kind) {
+            case CACHE_RECORD_METADATA:
+            case CACHE_RECORD_INVALIDATE: {
+                // the record the book had until now is dead
+                const CacheSlot *slot = cache->slot_capacity ? EpubCache_slot(cache, record->dev, record->ino) : NULL;
+                const CacheRecord *previous = slot && slot->offset ? (const CacheRecord *)&cache->map[slot->offset] : NULL;
+                ok = EpubCache_index(cache, record->dev, record->ino, offset);
+                if (!ok) break;
+                if (previous && previous->kind == CACHE_RECORD_METADATA) cache->live_bytes -= previous->size;
+                if (record->kind == CACHE_RECORD_METADATA) cache->live_bytes += record->size;
+                break;
+            }
+            case CACHE_RECORD_CLEAR:
+                if (cache->slots) memset(cache->slots, 0, cache->slot_capacity * sizeof(CacheSlot));
+                cache->slot_count = 0;
+                cache->live_bytes = 0;
+                break;
+        }
+        if (!ok) break;
+        offset += record->size;
+    }
+
+    cache->scanned = offset;
+    return 1;
+}
+
+static int cache_offset_compare(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Writes the header and the live records (none with `clear`), in file order.
+static int EpubCache_write_live(const EpubCache *cache, int fd, int clear) {
+    CacheFileHeader header = {0};
+    memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_FILE_VERSION;
+    if (!write_full(fd, &header, sizeof(header))) return 0;
+    if (clear || cache->slot_count == 0) return 1;
+
+    uint64_t *offsets = malloc(cache->slot_count * sizeof(uint64_t));
+    unsigned char *buf = malloc(1 << 16);
+    int ok = offsets && buf;
+    size_t count = 0, used = 0;
+    for (size_t i = 0; ok && i < cache->slot_capacity; i++) {
+        uint64_t offset = cache->slots[i].offset;
+        if (offset && ((const CacheRecord *)&cache->map[offset])->kind == CACHE_RECORD_METADATA) offsets[count++] = offset;
+    }
+    if (ok) qsort(offsets, count, sizeof(uint64_t), cache_offset_compare);
+
+    // records are copied as they are, their checksum doesn't depend on where they are
+    for (size_t i = 0; ok && i < count; i++) {
+        const CacheRecord *record = (const CacheRecord *)&cache->map[offsets[i]];
+        if (used + record->size > (1 << 16)) {
+            ok = write_full(fd, buf, used);
+            used = 0;
+        }
+        if (record->size > (1 << 16)) {
+            ok = ok && write_full(fd, record, record->size);
+        } else {
+            memcpy(&buf[used], record, record->size);
+            used += record->size;
+        }
+    }
+    ok = ok && write_full(fd, buf, used);
+
+    free(offsets);
+    free(buf);
+    return ok;
+}
+
+// Rewrites the live records (none with `clear`) to "<path>.tmp" and renames it
+// over the cache file, under the file lock. Other processes keep a valid
+// mapping of the old file and move to the new one on their next refresh or
+// append. Needs the write lock.
+static int EpubCache_compact(EpubCache *cache, int clear) {
+    if (!cache->writable || flock(cache->fd, LOCK_EX) != 0) return 0;
+
+    // with the lock no one else appends or compacts, the old file is complete
+    struct stat st;
+    int ok = !EpubCache_replaced(cache) && EpubCache_refresh(cache) && fstat(cache->fd, &st) == 0;
+
+    size_t tmp_len = strlen(cache->path) + sizeof(".tmp");
+    char *tmp = ok ? malloc(tmp_len) : NULL;
+    int fd = -1;
+    if (tmp) {
+        snprintf(tmp, tmp_len, "%s.tmp", cache->path);
+        fd = open(tmp, O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+    ok = fd >= 0 && fchmod(fd, st.st_mode & 07777) == 0 && EpubCache_write_live(cache, fd, clear) &&
+         fsync(fd) == 0 && rename(tmp, cache->path) == 0;
+
+    if (!ok) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        flock(cache->fd, LOCK_UN);
+        free(tmp);
+        return 0;
+    }
+
+    flock(cache->fd, LOCK_UN);
+    free(tmp);
+    EpubCache_switch(cache, fd);
+    return EpubCache_refresh(cache);
+}
+
+static void EpubCache_compact_if_needed(EpubCache *cache) {
+    struct stat st;
+    if (!cache->writable || fstat(cache->fd, &st) != 0) return;
+
+    uint64_t records = (uint64_t)st.st_size > sizeof(CacheFileHeader) ? st.st_size - sizeof(CacheFileHeader) : 0;
+    uint64_t dead = records > cache->live_bytes ? records - cache->live_bytes : 0;
+    // best effort, a cache that can't be compacted still works
+    if (dead > CACHE_COMPACT_MIN_DEAD && dead > cache->live_bytes) EpubCache_compact(cache, 0);
+}
+
+// Appends one record with a single write, `payload` follows the header.
+// Needs the write lock.
+static int EpubCache_append(EpubCache *cache, CacheRecord *record, const void *payload, size_t payload_size) {
+    if (!cache->writable) return 0;
+
+    record->magic = CACHE_RECORD_MAGIC;
+    record->size = (sizeof(CacheRecord) + payload_size + 7) & ~(size_t)7;
+    record->reserved = 0;
+    record->checksum = 0;
+
+    unsigned char *buf = calloc(1, record->size);
+    if (!buf) return 0;
+    memcpy(buf, record, sizeof(CacheRecord));
+    if (payload_size) memcpy(&buf[sizeof(CacheRecord)], payload, payload_size);
+    ((CacheRecord *)buf)->checksum = cache_record_checksum((const CacheRecord *)buf);
+
+    // a file replaced by a compaction while this process waited for the lock is left alone
+    int ok = 0, locked;
+    while ((locked = flock(cache->fd, LOCK_EX) == 0) && EpubCache_replaced(cache)) {
+        flock(cache->fd, LOCK_UN);
+        if (!EpubCache_reopen(cache)) locked = 0;
+        if (!locked) break;
+    }
+    if (locked) {
+        // an interrupted append may have left the end unaligned
+        struct stat st;
+        static const unsigned char zeros[8];
+        if (fstat(cache->fd, &st) == 0 && (st.st_size % 8 == 0 || write(cache->fd, zeros, 8 - st.st_size % 8) > 0)) {
+            ok = write(cache->fd, buf, record->size) == (ssize_t)record->size;
+        }
+        flock(cache->fd, LOCK_UN);
+    }
+    free(buf);
+
+    if (!ok || !EpubCache_refresh(cache)) return 0;
+    EpubCache_compact_if_needed(cache);
+    return 1;
+}
+
+EpubCache* EpubCache_new(const char *path, EpubError *error) {
+    EpubError err = EPUB_ERROR_INVALID_ARGUMENT;
+    EpubCache *cache = NULL;
+    if (!path) goto fail;
+
+    err = EPUB_ERROR_NO_MEMORY;
+    cache = calloc(1, sizeof(EpubCache));
+    if (!cache) goto fail;
+    cache->fd = -1;
+    pthread_rwlock_init(&cache->lock, NULL);
+    cache->path = strdup(path);
+    if (!cache->path) goto fail;
+
+    err = EPUB_ERROR_IO;
+    cache->writable = 1;
+    cache->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (cache->fd < 0) {
+        cache->writable = 0;
+        cache->fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (cache->fd < 0) goto fail;
+
+    // the first process to open an empty file writes the header
+    CacheFileHeader header = {0};
+    memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_FILE_VERSION;
+
+    struct stat st;
+    if (cache->writable && flock(cache->fd, LOCK_EX) == 0) {
+        if (fstat(cache->fd, &st) == 0 && st.st_size == 0) {
+            if (write(cache->fd, &header, sizeof(header)) != sizeof(header)) cache->writable = 0;
+        }
+        flock(cache->fd, LOCK_UN);
+    }
+
+    if (!cache_header_valid(cache->fd)) goto fail;
+
+    cache->scanned = sizeof(CacheFileHeader);
+    if (!EpubCache_refresh(cache)) goto fail;
+    EpubCache_compact_if_needed(cache);
+
+    if (error) *error = EPUB_OK;
+    return cache;
+
+fail:
+    EpubCache_free(cache);
+    if (error) *error = err;
+    return NULL;
+}
+
+void EpubCache_free(EpubCache *cache) {
+    if (!cache) return;
+
+    if (cache->map) munmap((void *)cache->map, cache->map_capacity);
+    if (cache->fd >= 0) close(cache->fd);
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache->slots);
+    free(cache->path);
+    free(cache);
+}
+
+// Returns a document built from the cached metadata of `key`, NULL on a miss.
+// Needs the read lock.
+static EpubDocument* EpubCache_lookup(const EpubCache *cache, const CacheKey *key, unsigned fields, const char *filename,
+                                      const EpubAllocator *allocator) {
+    if (!cache->slot_capacity) return NULL;
+
+    const CacheSlot *slot = EpubCache_slot(cache, key->dev, key->ino);
+    if (!slot->offset) return NULL;
+
+    const CacheRecord *record = (const CacheRecord *)&cache->map[slot->offset];
+    CacheKey stored = { record->dev, record->ino, record->file_size, record->mtime_ns };
+    if (record->kind != CACHE_RECORD_METADATA || !cache_key_equals(&stored, key)) return NULL;
+    if ((fields & record->fields) != fields) return NULL;
+
+    // the block is followed by the padding of the record
+    const EpubMetadata *meta = (const EpubMetadata *)(record + 1);
+    size_t payload_size = record->size - sizeof(CacheRecord);
+    if (payload_size < sizeof(EpubMetadata) || EpubMetadata_get_size(meta) > payload_size) return NULL;
+    if (!metadata_block_valid(meta, EpubMetadata_get_size(meta))) return NULL;
+    return EpubDocument_from_metadata(meta, filename, allocator);
+}
+
+EpubDocument* cache_open_file(EpubCache *cache, EpubContext *ctx, const char *filename, unsigned fields,
+                              EpubError *error, int *hit) {
+    if (hit) *hit = 0;
+    if (!cache || !filename) {
+        if (error) *error = EPUB_ERROR_INVALID_ARGUMENT;
+        return NULL;
+    }
+
+    CacheKey key;
+    if (!cache_key_from_path(filename, &key)) {
+        if (error) *error = EPUB_ERROR_IO;
+        return NULL;
+    }
+
+    fields &= EPUB_FIELD_ALL;
+    pthread_rwlock_rdlock(&cache->lock);
+    EpubDocument *doc = EpubCache_lookup(cache, &key, fields, filename, EpubContext_allocator(ctx));
+    pthread_rwlock_unlock(&cache->lock);
+
+    // another process may have added the book since the last refresh
+    if (!doc) {
+        pthread_rwlock_wrlock(&cache->lock);
+        EpubCache_refresh(cache);
+        doc = EpubCache_lookup(cache, &key, fields, filename, EpubContext_allocator(ctx));
+        pthread_rwlock_unlock(&cache->lock);
+    }
+
+    if (doc) {
+        if (error) *error = EPUB_OK;
+        if (hit) *hit = 1;
+        return doc;
+    }
+
+    EpubContext *owned = NULL;
+    if (!ctx) {
+        ctx = owned = EpubContext_new();
+        if (!ctx) {
+            if (error) *error = EPUB_ERROR_NO_MEMORY;
+            return NULL;
+        }
+    }
+    doc = EpubContext_open_file(ctx, filename, fields, error);
+    EpubContext_free(owned);
+
+    // a book modified while it was parsed isn't stored
+    CacheKey after;
+    if (doc && cache_key_from_path(filename, &after) && cache_key_equals(&key, &after)) {
+        const EpubMetadata *meta = EpubDocument_get_metadata(doc);
+        CacheRecord record = {
+            .dev = key.dev, .ino = key.ino, .file_size = key.size, .mtime_ns = key.mtime_ns,
+            .fields = fields, .kind = CACHE_RECORD_METADATA,
+        };
+
+        // the cache is best effort, a failed append still returns the document
+        pthread_rwlock_wrlock(&cache->lock);
+        EpubCache_append(cache, &record, meta, EpubMetadata_get_size(meta));
+        pthread_rwlock_unlock(&cache->lock);
+    }
+    return doc;
+}
+
+EpubDocument* EpubCache_open_file(EpubCache *cache, EpubContext *ctx, const char *filename, unsigned fields, EpubError *error) {
+    return cache_open_file(cache, ctx, filename, fields, error, NULL);
+}
+
+int EpubCache_invalidate(EpubCache *cache, const char *filename) {
+    CacheKey key;
+    if (!cache || !filename || !cache_key_from_path(filename, &key)) return 1;
+    return EpubCache_invalidate_id(cache, key.dev, key.ino);
+}
+
+int EpubCache_invalidate_id(EpubCache *cache, uint64_t dev, uint64_t ino) {
+    if (!cache) return 1;
+
+    CacheRecord record = { .dev = dev, .ino = ino, .kind = CACHE_RECORD_INVALIDATE };
+    pthread_rwlock_wrlock(&cache->lock);
+    int ok = EpubCache_append(cache, &record, NULL, 0);
+    pthread_rwlock_unlock(&cache->lock);
+    return !ok;
+}
+
+int EpubCache_clear(EpubCache *cache) {
+    if (!cache) return 1;
+
+    // a file that can't be replaced is cleared with a record instead
+    CacheRecord record = { .kind = CACHE_RECORD_CLEAR };
+    pthread_rwlock_wrlock(&cache->lock);
+    int ok = EpubCache_compact(cache, 1) || EpubCache_append(cache, &record, NULL, 0);
+    pthread_rwlock_unlock(&cache->lock);
+    return !ok;
+}
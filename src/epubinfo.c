@@ -1,303 +1,758 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "epubinfo/alloc.h"
+#include "epubinfo/crc32.h"
+#include "epubinfo/fingerprint.h"
 #include "epubinfo/zip.h"
 #include "epubinfo/xml.h"
 #include "epubinfo/epubinfo.h"
+#include "epubinfo/metadata.h"
+#include "epubinfo/source.h"
+#include "epubinfo/cache.h"
+#include "epubinfo/tokenizer.h"
+#include "epubinfo/package.h"
+#include "epubinfo/text.h"
 
 // internal declarations
-typedef struct StringArray StringArray;
-void StringArray_append(StringArray *arr, const char *value);
-void StringArray_free(StringArray *arr);
-
-struct StringArray {
-    char **items;
-    size_t count;
-    size_t capacity;
-};
-
-struct EpubMetadata {
-    char *title;
-    char *subtitle;
-    char *language;
-    char *description;
-    char *publisher;
-
-    StringArray author;
-    StringArray creator;
-    StringArray identifier;
-};
+static EpubDocument* EpubDocument_parse(EpubContext *ctx, ArchiveSource *src, const char *filename, unsigned fields, EpubError *error);
 
 struct EpubDocument {
-    char *filename;
-    ZipEntry *entries;
-    size_t num_of_entries;
-    EpubMetadata metadata;
-    uint8_t *cover_image;
-    size_t cover_image_size;
+    char *filename;             // NULL if opened from memory or a reader
+    const void *data;           // caller's buffer if opened from memory
+    size_t data_size;
+    EpubReader reader;          // `read_at` is set if opened from a reader
+    ZipDirectory dir;
+    const ZipEntry *opf_entry;  // into `dir`
+    EpubMetadata *metadata;
+    EpubPackage *package;       // manifest and spine, NULL until first used
+    const EpubAllocator *allocator; // of the context it was opened with
     char last_error[256];
 };
 
+#define DC_ELEMENTS_NAMESPACE "http://purl.org/dc/elements/1.1/"
+#define DC_TERMS_NAMESPACE "http://purl.org/dc/terms/"
+#define DC_MAX_PREFIXES 8
+#define DC_MAX_PREFIX_LEN 15
+
+// Prefixes bound to a Dublin Core namespace, declared on <package> or <metadata>.
+typedef struct {
+    char prefixes[DC_MAX_PREFIXES][DC_MAX_PREFIX_LEN + 1];
+    unsigned char lens[DC_MAX_PREFIXES];
+    int count;
+    int default_dc; // the default namespace (xmlns="...") is Dublin Core
+} DcNamespaces;
+
+static int is_dc_namespace(XmlValueSlice uri) {
+    return xml_slice_equals(uri, DC_ELEMENTS_NAMESPACE) || xml_slice_equals(uri, DC_TERMS_NAMESPACE);
+}
 
-void StringArray_append(StringArray *arr, const char *value) {
-    if (!value) return;
+static int DcNamespaces_find(const DcNamespaces *ns, XmlValueSlice prefix) {
+    for (int i = 0; i < ns->count; i++) {
+        if (ns->lens[i] == prefix.len && memcmp(ns->prefixes[i], prefix.text, prefix.len) == 0) return i;
+    }
+    return -1;
+}
 
-    if (arr->count == arr->capacity) {
-        // double the current capacity (starts at 4)
-        size_t new_capacity = arr->capacity ? arr->capacity * 2 : 4;
-        char **new_items = realloc(arr->items, sizeof(char*) * new_capacity);
+static void DcNamespaces_bind(DcNamespaces *ns, XmlValueSlice prefix, int dc) {
+    int i = DcNamespaces_find(ns, prefix);
+    if (!dc) {
+        // prefix rebound to another namespace
+        if (i >= 0) {
+            ns->count -= 1;
+            memcpy(ns->prefixes[i], ns->prefixes[ns->count], sizeof(ns->prefixes[i]));
+            ns->lens[i] = ns->lens[ns->count];
+        }
+        return;
+    }
+    if (i >= 0 || ns->count == DC_MAX_PREFIXES || prefix.len > DC_MAX_PREFIX_LEN) return;
 
-        // no memory
-        if (!new_items) return;
+    memcpy(ns->prefixes[ns->count], prefix.text, prefix.len);
+    ns->lens[ns->count] = prefix.len;
+    ns->count += 1;
+}
 
-        arr->items = new_items;
-        arr->capacity = new_capacity;
+// Records the namespace declarations of a tag.
+static void DcNamespaces_scan(DcNamespaces *ns, XmlValueSlice tag) {
+    size_t offset = 0;
+    XmlValueSlice name, value;
+    while (xml_slice_next_attribute(tag, &offset, &name, &value)) {
+        if (name.len < 5 || memcmp(name.text, "xmlns", 5) != 0) continue;
+
+        if (name.len == 5) {
+            ns->default_dc = is_dc_namespace(value);
+        } else if (name.text[5] == ':') {
+            XmlValueSlice prefix = { &name.text[6], name.len - 6 };
+            DcNamespaces_bind(ns, prefix, is_dc_namespace(value));
+        }
     }
+}
 
-    arr->items[arr->count] = strdup(value);
-    if (arr->items[arr->count] == NULL) return; // no memory
-    arr->count += 1;
+// Return 1 if the element `tag` named `prefix:local` is in a Dublin Core namespace.
+static int DcNamespaces_match(const DcNamespaces *ns, XmlValueSlice tag, XmlValueSlice prefix) {
+    if (prefix.len == 0) return ns->default_dc;
+    if (DcNamespaces_find(ns, prefix) >= 0) return 1;
+
+    // the element may declare its own prefix
+    size_t offset = 0;
+    XmlValueSlice name, value;
+    while (xml_slice_next_attribute(tag, &offset, &name, &value)) {
+        if (name.len == prefix.len + 6 && memcmp(name.text, "xmlns:", 6) == 0
+            && memcmp(&name.text[6], prefix.text, prefix.len) == 0) {
+            return is_dc_namespace(value);
+        }
+    }
+    return 0;
 }
 
-void StringArray_free(StringArray *arr) {
-    for (int i = 0; i < arr->count; i++) free(arr->items[i]);
-    free(arr->items);
+_Static_assert(EPUB_FIELD_TITLE == 1u << METADATA_TITLE && EPUB_FIELD_IDENTIFIER == 1u << METADATA_IDENTIFIER,
+               "EpubField bits must follow MetadataField");
+_Static_assert(EPUB_FIELD_ALL == (1u << METADATA_FIELD_COUNT) - 1, "EpubField bits must follow MetadataField");
+
+#define SINGLE_FIELDS_MASK ((1u << METADATA_FIRST_LIST) - 1)
+
+// Buffers reused by every document opened with the same context.
+struct EpubContext {
+    MetadataBuilder meta;
+    EntryTokenizer tokenizer;
+    const EpubAllocator *allocator;
+};
+
+static void EpubContext_init(EpubContext *ctx, const EpubAllocator *allocator) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->allocator = allocator;
+    ctx->tokenizer.allocator = allocator;
+    MetadataBuilder_init(&ctx->meta, allocator);
 }
 
-EpubDocument* EpubDocument_from_file(const char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error opening %s\n", filename);
-        return NULL;
+static void EpubContext_release(EpubContext *ctx) {
+    MetadataBuilder_free(&ctx->meta);
+    EntryTokenizer_close(&ctx->tokenizer);
+}
+
+EpubContext* EpubContext_new(void) {
+    return EpubContext_new_with_allocator(NULL);
+}
+
+EpubContext* EpubContext_new_with_allocator(const EpubAllocator *allocator) {
+    if (allocator && (!allocator->alloc || !allocator->realloc || !allocator->free)) return NULL;
+
+    EpubContext *ctx = epub_malloc(allocator, sizeof(EpubContext));
+    if (ctx) EpubContext_init(ctx, allocator);
+    return ctx;
+}
+
+void EpubContext_free(EpubContext *ctx) {
+    if (!ctx) return;
+    EpubContext_release(ctx);
+    epub_free(ctx->allocator, ctx);
+}
+
+const EpubAllocator* EpubContext_allocator(const EpubContext *ctx) {
+    return ctx ? ctx->allocator : NULL;
+}
+
+const char* EpubError_string(EpubError error) {
+    switch (error) {
+        case EPUB_OK:                     return "Success";
+        case EPUB_ERROR_IO:               return "Can't open or read the file";
+        case EPUB_ERROR_ZIP:              return "Invalid zip archive";
+        case EPUB_ERROR_NO_CONTAINER:     return "Invalid EPUB: container.xml not found";
+        case EPUB_ERROR_NO_ROOTFILE:      return "Invalid EPUB: rootfile not found";
+        case EPUB_ERROR_INFLATE:          return "Can't uncompress an entry";
+        case EPUB_ERROR_NO_METADATA:      return "Invalid EPUB: metadata not found";
+        case EPUB_ERROR_NO_MEMORY:        return "Out of memory";
+        case EPUB_ERROR_INVALID_ARGUMENT: return "Invalid argument";
+        case EPUB_ERROR_CHECKSUM:         return "CRC-32 mismatch";
+        case EPUB_ERROR_NO_COVER:         return "Cover not found";
     }
+    return "Unknown error";
+}
 
-    if (!zip_valid_header(fp)) {
-        fprintf(stderr, "Invalid zip header\n");
-        fclose(fp);
+static void set_error(EpubError *error, EpubError value) {
+    if (error) *error = value;
+}
+
+EpubDocument* EpubContext_open_file(EpubContext *ctx, const char *filename, unsigned fields, EpubError *error) {
+    if (!ctx || !filename) {
+        set_error(error, EPUB_ERROR_INVALID_ARGUMENT);
         return NULL;
     }
 
-    ZipEocdrHeader header;
-    if (!zip_read_end_of_central_directory_record(fp, &header)) {
-        fprintf(stderr, "Can't find End Of Central Directory Record\n");
-        fclose(fp);
+    ZipArchive za = {0};
+    if (!zip_archive_open(&za, filename)) {
+        set_error(error, EPUB_ERROR_IO);
         return NULL;
     }
 
-    ZipEntry *entries = zip_read_central_directory(fp, header);
-    if (!entries) {
-        fprintf(stderr, "Error reading Central Directory Record\n");
-        fclose(fp);
+    ArchiveSource src;
+    ArchiveSource_from_archive(&src, &za, ctx->allocator);
+    EpubDocument *doc = EpubDocument_parse(ctx, &src, filename, fields, error);
+    ArchiveSource_close(&src);
+    zip_archive_close(&za);
+    return doc;
+}
+
+EpubDocument* EpubContext_open_memory(EpubContext *ctx, const void *data, size_t len, unsigned fields, EpubError *error) {
+    if (!ctx || !data) {
+        set_error(error, EPUB_ERROR_INVALID_ARGUMENT);
         return NULL;
     }
 
-    ZipEntry *container = zip_find_entry_by_filename(entries, header.num_of_entries, "META-INF/container.xml");
-    if (!container) {
-        fprintf(stderr, "Invalid EPUB: container.xml not found\n");
-        fclose(fp);
-        free(entries);
+    ZipArchive za;
+    zip_archive_from_memory(&za, data, len);
+
+    ArchiveSource src;
+    ArchiveSource_from_archive(&src, &za, ctx->allocator);
+    EpubDocument *doc = EpubDocument_parse(ctx, &src, NULL, fields, error);
+    ArchiveSource_close(&src);
+    if (doc) {
+        doc->data = data;
+        doc->data_size = len;
+    }
+    return doc;
+}
+
+EpubDocument* EpubContext_open_reader(EpubContext *ctx, const EpubReader *reader, unsigned fields, EpubError *error) {
+    if (!ctx || !reader || !reader->size || !reader->read_at) {
+        set_error(error, EPUB_ERROR_INVALID_ARGUMENT);
         return NULL;
     }
 
-    char *container_content = zip_uncompress_entry(fp, container);
-    if (!container_content) {
-        fprintf(stderr, "Error uncompressing container.xml\n");
-        fclose(fp);
-        free(entries);
+    ArchiveSource src;
+    if (!ArchiveSource_from_reader(&src, reader, ctx->allocator)) {
+        set_error(error, EPUB_ERROR_IO);
         return NULL;
     }
 
-    XmlParser parser = {0};
-    parser.content = container_content;
-    Arena arena = {0};
-    arena_init(&arena, 1024);
+    EpubDocument *doc = EpubDocument_parse(ctx, &src, NULL, fields, error);
+    ArchiveSource_close(&src);
+    if (doc) doc->reader = *reader;
+    return doc;
+}
+
+// The one-shot functions use a temporary context and report errors on stderr.
+static EpubDocument* report_error(EpubDocument *doc, EpubError error, const char *filename) {
+    if (!doc) {
+        if (filename) fprintf(stderr, "%s: %s\n", filename, EpubError_string(error));
+        else fprintf(stderr, "%s\n", EpubError_string(error));
+    }
+    return doc;
+}
+
+EpubDocument* EpubDocument_from_file(const char *filename) {
+    return EpubDocument_from_file_fields(filename, EPUB_FIELD_ALL);
+}
+
+EpubDocument* EpubDocument_from_file_fields(const char *filename, unsigned fields) {
+    EpubContext ctx;
+    EpubContext_init(&ctx, NULL);
+    EpubError error = EPUB_OK;
+    EpubDocument *doc = EpubContext_open_file(&ctx, filename, fields, &error);
+    EpubContext_release(&ctx);
+    return report_error(doc, error, filename);
+}
+
+EpubDocument* EpubDocument_from_memory(const void *data, size_t len) {
+    return EpubDocument_from_memory_fields(data, len, EPUB_FIELD_ALL);
+}
+
+EpubDocument* EpubDocument_from_memory_fields(const void *data, size_t len, unsigned fields) {
+    EpubContext ctx;
+    EpubContext_init(&ctx, NULL);
+    EpubError error = EPUB_OK;
+    EpubDocument *doc = EpubContext_open_memory(&ctx, data, len, fields, &error);
+    EpubContext_release(&ctx);
+    return report_error(doc, error, NULL);
+}
+
+EpubDocument* EpubDocument_from_reader(const EpubReader *reader) {
+    return EpubDocument_from_reader_fields(reader, EPUB_FIELD_ALL);
+}
+
+EpubDocument* EpubDocument_from_reader_fields(const EpubReader *reader, unsigned fields) {
+    EpubContext ctx;
+    EpubContext_init(&ctx, NULL);
+    EpubError error = EPUB_OK;
+    EpubDocument *doc = EpubContext_open_reader(&ctx, reader, fields, &error);
+    EpubContext_release(&ctx);
+    return report_error(doc, error, NULL);
+}
+
+// Runs the EOCD -> central directory -> container.xml -> OPF pipeline over
+// an archive, `filename` is NULL for documents opened from memory or a reader.
+// The document, its packed metadata and its filename share one allocation.
+// `meta_block` is set to the `meta_size` bytes reserved for the metadata.
+static EpubDocument* EpubDocument_alloc(size_t meta_size, const char *filename, const EpubAllocator *allocator,
+                                        void **meta_block) {
+    size_t doc_size = (sizeof(EpubDocument) + 7) & ~(size_t)7;
+    size_t filename_size = filename ? strlen(filename) + 1 : 0;
+
+    unsigned char *block = epub_malloc(allocator, doc_size + meta_size + filename_size);
+    if (!block) return NULL;
+
+    EpubDocument *doc = (EpubDocument *)block;
+    memset(doc, 0, sizeof(EpubDocument));
+    doc->allocator = allocator;
+    if (filename) doc->filename = memcpy(&block[doc_size + meta_size], filename, filename_size);
+    *meta_block = &block[doc_size];
+    return doc;
+}
+
+EpubDocument* EpubDocument_from_metadata(const EpubMetadata *meta, const char *filename, const EpubAllocator *allocator) {
+    size_t meta_size = EpubMetadata_get_size(meta);
+    void *meta_block;
+    EpubDocument *doc = EpubDocument_alloc(meta_size, filename, allocator, &meta_block);
+    if (!doc) return NULL;
+
+    doc->metadata = memcpy(meta_block, meta, meta_size);
+    return doc;
+}
+
+static EpubDocument* EpubDocument_parse(EpubContext *ctx, ArchiveSource *src, const char *filename, unsigned fields, EpubError *error) {
+    ZipDirectory dir = {0};
+    EntryTokenizer *tokenizer = &ctx->tokenizer;
+    MetadataBuilder *meta = &ctx->meta;
+    MetadataBuilder_reset(meta);
+
+    EpubError err = ArchiveSource_read_directory(src, &dir);
+    if (err != EPUB_OK) goto fail;
+
+    const ZipEntry *container = zip_find_entry_by_filename(&dir, "META-INF/container.xml");
+    if (!container) {
+        err = EPUB_ERROR_NO_CONTAINER;
+        goto fail;
+    }
+
+    const ZipArchive *za = ArchiveSource_entry(src, container);
+    if (!za) {
+        err = src->error;
+        goto fail;
+    }
+    if (!EntryTokenizer_open(tokenizer, za, container)) {
+        err = EPUB_ERROR_INFLATE;
+        goto fail;
+    }
 
-    XmlValue value = {0};
-    char *opf_filename = NULL;
+    const ZipEntry *opf_entry = NULL;
     while (1) {
-        value = xml_next(&arena, &parser);
-        if (value.type == EOF_TAG || value.type == ERROR_TAG) {
-            fprintf(stderr, "Invalid epub: rootfile not found\n");
-            fclose(fp);
-            free(entries);
-            free(container_content);
-            arena_free(&arena);
-            return NULL;
+        XmlToken value = EntryTokenizer_next(tokenizer);
+        if (value.type == ERROR_TAG) {
+            err = EPUB_ERROR_INFLATE;
+            goto fail;
+        }
+        if (value.type == EOF_TAG) {
+            err = EPUB_ERROR_NO_ROOTFILE;
+            goto fail;
         }
 
-        char *fullpath = xml_tag_get_attribute(&arena, value.content, "full-path");
-        if (fullpath) {
-            opf_filename = strdup(fullpath);
+        XmlValueSlice fullpath;
+        if (xml_slice_tag_attribute(value.value, "full-path", &fullpath)) {
+            opf_entry = zip_find_entry(&dir, fullpath.text, fullpath.len);
             break;
         }
-        arena_reset(&arena);
     }
 
-    ZipEntry *opf_entry = zip_find_entry_by_filename(entries, header.num_of_entries, opf_filename);
     if (!opf_entry) {
-        fprintf(stderr, "opf entry not found\n");
-        fclose(fp);
-        free(entries);
-        free(container_content);
-        free(opf_filename);
-        arena_free(&arena);
-        return NULL;
+        err = EPUB_ERROR_NO_ROOTFILE;
+        goto fail;
     }
 
-    char *opf_content = zip_uncompress_entry(fp, opf_entry);
-    if (!opf_content) {
-        fprintf(stderr, "opf entry uncompression failed\n");
-        fclose(fp);
-        free(entries);
-        free(container_content);
-        free(opf_filename);
-        arena_free(&arena);
-        return NULL;
+    // Only <metadata> is needed, the OPF is inflated chunk by chunk and
+    // inflating stops as soon as </metadata> is found.
+    za = ArchiveSource_entry(src, opf_entry);
+    if (!za) {
+        err = src->error;
+        goto fail;
+    }
+    if (!EntryTokenizer_open(tokenizer, za, opf_entry)) {
+        err = EPUB_ERROR_INFLATE;
+        goto fail;
     }
 
-    arena_reset(&arena);
-    parser.cursor = 0;
-    parser.content = opf_content;
+    // "dc" is bound by every valid EPUB, keep it for books that forget the declaration
+    DcNamespaces ns = { .prefixes = { "dc" }, .lens = { 2 }, .count = 1 };
 
     int inside_metadata = 0;
     while (!inside_metadata) {
-        XmlValue v = xml_next(&arena, &parser);
+        XmlToken v = EntryTokenizer_next(tokenizer);
+        if (v.type == EOF_TAG || v.type == ERROR_TAG) {
+            err = v.type == EOF_TAG ? EPUB_ERROR_NO_METADATA : EPUB_ERROR_INFLATE;
+            goto fail;
+        }
+        if (v.type == OPEN_TAG || v.type == SELF_CLOSE_TAG) {
+            DcNamespaces_scan(&ns, v.value);
+        }
         if (v.type == OPEN_TAG || v.type == CLOSE_TAG || v.type == SELF_CLOSE_TAG) {
-            char *name = xml_tag_get_name(&arena, v.content);
-            if (strcmp(name, "metadata") == 0) inside_metadata = 1;
+            XmlValueSlice local = xml_slice_local_name(xml_slice_tag_name(v.value), NULL);
+            if (xml_slice_equals(local, "metadata")) inside_metadata = 1;
         }
-        arena_reset(&arena);
     }
 
-    EpubMetadata meta = {0};
-    while (1) {
-        XmlValue v = xml_next(&arena, &parser);
+    // Lists can only be complete at </metadata>, but once every requested single
+    // field is found the rest of the OPF doesn't need to be parsed or inflated.
+    fields &= EPUB_FIELD_ALL;
+    unsigned pending = fields & SINGLE_FIELDS_MASK;
+    int wants_lists = (fields & ~SINGLE_FIELDS_MASK) != 0;
+
+    while (pending || wants_lists) {
+        XmlToken v = EntryTokenizer_next(tokenizer);
+        if (v.type == EOF_TAG || v.type == ERROR_TAG) break;
+
         if (v.type == CLOSE_TAG) {
-            char *tag_name = xml_tag_get_name(&arena, v.content);
-            if (strcmp(tag_name, "metadata") == 0) break;
+            XmlValueSlice local = xml_slice_local_name(xml_slice_tag_name(v.value), NULL);
+            if (xml_slice_equals(local, "metadata")) break;
         }
 
         if (v.type == OPEN_TAG) {
-            char *tag_name = xml_tag_get_name(&arena, v.content);
-            if (strncmp(tag_name, "dc:", 3) == 0) {
-                XmlValue text = xml_next(&arena, &parser);
-                if (text.type == TEXT_TAG) {
-                    const char *field = &tag_name[3];
-                    // -- individual objects
-                    if (strcmp(field, "title") == 0)
-                        meta.title = strdup(text.content);
-                    else if (strcmp(field, "language") == 0)
-                        meta.language = strdup(text.content);
-                    else if (strcmp(field, "description") == 0)
-                        meta.description = strdup(text.content);
-                    else if (strcmp(field, "publisher") == 0)
-                        meta.publisher = strdup(text.content);
-                    else if (strcmp(field, "subject") == 0)
-                        meta.subtitle = strdup(text.content);
-
-                    // -- lists/arrays
-                    else if (strcmp(field, "creator") == 0)
-                        StringArray_append(&meta.creator, text.content);
-                    else if (strcmp(field, "identifier") == 0)
-                        StringArray_append(&meta.identifier, text.content);
-                    else if (strcmp(field, "author") == 0)
-                        StringArray_append(&meta.author, text.content);
-                }
+            // the tag slice is invalidated by the next token, resolve the field first
+            XmlValueSlice prefix;
+            XmlValueSlice local = xml_slice_local_name(xml_slice_tag_name(v.value), &prefix);
+            int field = metadata_field_lookup(local.text, local.len);
+            if (field < 0 || !(fields & (1u << field))) continue;
+            if (!DcNamespaces_match(&ns, v.value, prefix)) continue;
+
+            XmlToken text = EntryTokenizer_next(tokenizer);
+            if (text.type != TEXT_TAG) continue;
+
+            if (!MetadataBuilder_add(meta, field, text.value.text, text.value.len)) {
+                err = EPUB_ERROR_NO_MEMORY;
+                goto fail;
             }
+            pending &= ~(1u << field);
         }
-        arena_reset(&arena);
     }
 
-    EpubDocument *doc = calloc(1, sizeof(EpubDocument));
-    doc->filename = strdup(filename);
-    doc->entries = entries;
-    doc->num_of_entries = header.num_of_entries;
-    doc->metadata = meta;
+    void *meta_block;
+    EpubDocument *doc = EpubDocument_alloc(MetadataBuilder_size(meta), filename, ctx->allocator, &meta_block);
+    if (!doc) {
+        err = EPUB_ERROR_NO_MEMORY;
+        goto fail;
+    }
 
-    fclose(fp);
-    free(container_content);
-    free(opf_content);
-    arena_free(&arena);
-    free(opf_filename);
+    doc->dir = dir;
+    doc->opf_entry = opf_entry;
+    doc->metadata = MetadataBuilder_pack(meta, meta_block);
 
+    set_error(error, EPUB_OK);
     return doc;
+
+fail:
+    zip_directory_free(&dir);
+    set_error(error, err);
+    return NULL;
 }
 
 void EpubDocument_free(EpubDocument *doc) {
     if (!doc) return;
 
-    free(doc->entries);
-    free(doc->filename);
-    free(doc->cover_image);
+    if (doc->package) {
+        EpubPackage_free(doc->package);
+        epub_free(doc->allocator, doc->package);
+    }
+    zip_directory_free(&doc->dir);
+    epub_free(doc->allocator, doc);
+}
 
-    free(doc->metadata.title);
-    free(doc->metadata.language);
-    free(doc->metadata.description);
-    free(doc->metadata.subtitle);
-    free(doc->metadata.publisher);
+const EpubMetadata* EpubDocument_get_metadata(EpubDocument *doc) {
+    return doc ? doc->metadata : NULL;
+}
 
-    StringArray_free(&doc->metadata.author);
-    StringArray_free(&doc->metadata.creator);
-    StringArray_free(&doc->metadata.identifier);
+// Opens the archive bytes of `doc` (its file, caller buffer or reader), `za`
+// keeps the mapping of a file. Both must be closed by the caller.
+// Return 1 on success, 0 otherwise.
+static int EpubDocument_open_source(const EpubDocument *doc, ZipArchive *za, ArchiveSource *src) {
+    memset(za, 0, sizeof(*za));
+    if (doc->reader.read_at) return ArchiveSource_from_reader(src, &doc->reader, doc->allocator);
+
+    if (doc->filename) {
+        if (!zip_archive_open(za, doc->filename)) return 0;
+    } else {
+        zip_archive_from_memory(za, doc->data, doc->data_size);
+    }
+    ArchiveSource_from_archive(src, za, doc->allocator);
+    return 1;
+}
 
-    free(doc);
+// Documents served from a cache only have metadata, the central directory
+// and the OPF location are read from the file on first use.
+static int EpubDocument_load_archive(EpubDocument *doc) {
+    if (doc->opf_entry) return 1;
+    if (!doc->filename) return 0;
+
+    EpubContext ctx;
+    EpubContext_init(&ctx, doc->allocator);
+    EpubDocument *opened = EpubContext_open_file(&ctx, doc->filename, 0, NULL);
+    EpubContext_release(&ctx);
+    if (!opened) return 0;
+
+    // `opf_entry` points into `dir`, which is moved as is
+    doc->dir = opened->dir;
+    doc->opf_entry = opened->opf_entry;
+    memset(&opened->dir, 0, sizeof(opened->dir));
+    EpubDocument_free(opened);
+    return 1;
 }
 
-const EpubMetadata* EpubDocument_get_metadata(EpubDocument *doc) {
-    return doc ? &doc->metadata : NULL;
+// Parses the manifest and the spine on first use.
+// Returns `NULL` if the OPF can't be read.
+static const EpubPackage *EpubDocument_package(EpubDocument *doc) {
+    if (doc->package) return doc->package;
+    if (!EpubDocument_load_archive(doc)) return NULL;
+
+    ZipArchive za;
+    ArchiveSource src;
+    if (!EpubDocument_open_source(doc, &za, &src)) return NULL;
+
+    EpubPackage *package = epub_malloc(doc->allocator, sizeof(EpubPackage));
+    EntryTokenizer tokenizer = { .allocator = doc->allocator };
+    const ZipArchive *window = ArchiveSource_entry(&src, doc->opf_entry);
+    if (package && window && EntryTokenizer_open(&tokenizer, window, doc->opf_entry)) {
+        const char *opf_name = zip_entry_filename(&doc->dir, doc->opf_entry);
+        if (EpubPackage_parse(package, &tokenizer, &doc->dir, opf_name, doc->allocator) == EPUB_OK) {
+            doc->package = package;
+        } else {
+            EpubPackage_free(package);
+        }
+    }
+
+    if (!doc->package) epub_free(doc->allocator, package);
+    EntryTokenizer_close(&tokenizer);
+    ArchiveSource_close(&src);
+    zip_archive_close(&za);
+    return doc->package;
 }
 
-// title
-const char* EpubMetadata_get_title(const EpubMetadata *meta) {
-    return (meta && meta->title) ? meta->title : "";
+int EpubDocument_get_manifest_count(EpubDocument *doc) {
+    const EpubPackage *package = doc ? EpubDocument_package(doc) : NULL;
+    return package ? (int)package->count : -1;
 }
 
-const char* EpubMetadata_get_subtitle(const EpubMetadata *meta) {
-    return (meta && meta->subtitle) ? meta->subtitle : "";
+const EpubManifestItem* EpubDocument_get_manifest_item(EpubDocument *doc, int index) {
+    const EpubPackage *package = doc ? EpubDocument_package(doc) : NULL;
+    if (!package || index < 0 || (size_t)index >= package->count) return NULL;
+    return &package->items[index];
 }
 
-const char* EpubMetadata_get_language(const EpubMetadata *meta) {
-    return (meta && meta->language) ? meta->language : "";
+const EpubManifestItem* EpubDocument_find_manifest_item(EpubDocument *doc, const char *id) {
+    const EpubPackage *package = doc && id ? EpubDocument_package(doc) : NULL;
+    return package ? EpubPackage_find(package, id, strlen(id)) : NULL;
 }
 
+int EpubDocument_get_spine_count(EpubDocument *doc) {
+    const EpubPackage *package = doc ? EpubDocument_package(doc) : NULL;
+    return package ? (int)package->spine_count : -1;
+}
+
+const EpubSpineItem* EpubDocument_get_spine_item(EpubDocument *doc, int index) {
+    const EpubPackage *package = doc ? EpubDocument_package(doc) : NULL;
+    if (!package || index < 0 || (size_t)index >= package->spine_count) return NULL;
+    return &package->spine[index];
+}
+
+EpubError EpubDocument_extract_text(EpubDocument *doc, int threads, EpubTextCallback callback, void *user, EpubTextStats *stats) {
+    if (stats) memset(stats, 0, sizeof(*stats));
+    if (!doc || !callback) return EPUB_ERROR_INVALID_ARGUMENT;
+
+    const EpubPackage *package = EpubDocument_package(doc);
+    if (!package) return EPUB_ERROR_NO_ROOTFILE;
+
+    ZipArchive za;
+    ArchiveSource src;
+    if (!EpubDocument_open_source(doc, &za, &src)) return EPUB_ERROR_IO;
+
+    EpubError err = text_extract_spine(package, &src, threads, callback, user, stats);
+    ArchiveSource_close(&src);
+    zip_archive_close(&za);
+    return err;
+}
+
+// Size of the buffer entries are inflated into by EpubDocument_verify.
+#define VERIFY_CHUNK 65536
+
+// Checks one entry, `buf` is resized when a one-shot entry doesn't fit.
+static EpubError EpubDocument_verify_entry(const EpubDocument *doc, ZipEntryStream *stream, const ZipArchive *window,
+                                           const ZipEntry *entry, unsigned char **buf, size_t *capacity) {
+    // stored entries are checksummed in place
+    if (entry->compression_method == ZIP_METHOD_STORED) {
+        const unsigned char *data = zip_entry_raw_data(window, entry);
+        if (!data || entry->compressed_size != entry->uncompressed_size) return EPUB_ERROR_INFLATE;
+        return zip_crc32(0, data, entry->uncompressed_size) == entry->crc32 ? EPUB_OK : EPUB_ERROR_CHECKSUM;
+    }
+
+    if (zip_entry_oneshot(entry) && entry->uncompressed_size > *capacity) {
+        unsigned char *grown = epub_realloc(doc->allocator, *buf, entry->uncompressed_size);
+        if (!grown) return EPUB_ERROR_NO_MEMORY;
+        *buf = grown;
+        *capacity = entry->uncompressed_size;
+    }
+
+    if (!zip_entry_stream_reset(stream, window, entry)) return EPUB_ERROR_INFLATE;
+    long n;
+    while ((n = zip_entry_stream_read(stream, *buf, *capacity)) > 0) {}
+    // only a read that produced the whole entry has compared its CRC-32
+    if (stream->output_left > 0) return EPUB_ERROR_INFLATE;
+    if (n == 0 && stream->crc == stream->expected_crc) return EPUB_OK;
+    return stream->crc != stream->expected_crc ? EPUB_ERROR_CHECKSUM : EPUB_ERROR_INFLATE;
+}
+
+EpubError EpubDocument_verify(EpubDocument *doc, const char **bad_entry) {
+    if (bad_entry) *bad_entry = NULL;
+    if (!doc) return EPUB_ERROR_INVALID_ARGUMENT;
+    if (!EpubDocument_load_archive(doc)) return EPUB_ERROR_IO;
+
+    ZipArchive za;
+    ArchiveSource src;
+    if (!EpubDocument_open_source(doc, &za, &src)) return EPUB_ERROR_IO;
 
-const char* EpubMetadata_get_description(const EpubMetadata *meta) {
-    return (meta && meta->description) ? meta->description : "";
+    ZipEntryStream stream = { .inflater = { .allocator = doc->allocator, .verify = 1 } };
+    size_t capacity = VERIFY_CHUNK;
+    unsigned char *buf = epub_malloc(doc->allocator, capacity);
+    EpubError err = buf ? EPUB_OK : EPUB_ERROR_NO_MEMORY;
+
+    for (size_t i = 0; i < doc->dir.num_of_entries && err == EPUB_OK; i++) {
+        const ZipEntry *entry = &doc->dir.entries[i];
+        const char *name = zip_entry_filename(&doc->dir, entry);
+        if (entry->filename_len > 0 && name[entry->filename_len - 1] == '/') continue; // directory
+
+        const ZipArchive *window = ArchiveSource_entry(&src, entry);
+        err = window ? EpubDocument_verify_entry(doc, &stream, window, entry, &buf, &capacity) : src.error;
+        if (err != EPUB_OK && bad_entry) *bad_entry = name;
+    }
+
+    zip_entry_stream_close(&stream);
+    epub_free(doc->allocator, buf);
+    ArchiveSource_close(&src);
+    zip_archive_close(&za);
+    return err;
 }
 
-const char* EpubMetadata_get_publisher(const EpubMetadata *meta) {
-    return (meta && meta->publisher) ? meta->publisher : "";
+EpubError EpubDocument_get_fingerprint(EpubDocument *doc, EpubFingerprint *fingerprint) {
+    if (!doc || !fingerprint) return EPUB_ERROR_INVALID_ARGUMENT;
+    if (!EpubDocument_load_archive(doc)) return EPUB_ERROR_IO;
+
+    EpubError err = fingerprint_directory(&doc->dir, &fingerprint->archive);
+    if (err != EPUB_OK) return err;
+    fingerprint->metadata = fingerprint_metadata(doc->metadata);
+    return EPUB_OK;
 }
 
+// EpubReader over an open file, `ctx` points to the descriptor.
+static int64_t file_reader_size(void *ctx) {
+    struct stat st;
+    return fstat(*(int *)ctx, &st) == 0 ? (int64_t)st.st_size : -1;
+}
 
-int EpubMetadata_get_author_count(const EpubMetadata *meta) {
-    return meta ? (int)meta->author.count : 0;
+static int file_reader_read_at(void *ctx, uint64_t offset, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(*(int *)ctx, p, len, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
 }
 
-const char* EpubMetadata_get_author(const EpubMetadata *meta, int index) {
-    return (meta && index >= 0 && index < (int)meta->author.count)
-        ? meta->author.items[index]
-        : NULL;
+EpubError EpubContext_fingerprint_file(EpubContext *ctx, const char *filename, uint64_t *fingerprint) {
+    if (!ctx || !filename || !fingerprint) return EPUB_ERROR_INVALID_ARGUMENT;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return EPUB_ERROR_IO;
+#ifdef POSIX_FADV_RANDOM
+    // a few KiB at the end are read, readahead would fetch much more
+    posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+
+    EpubReader reader = { &fd, file_reader_size, file_reader_read_at };
+    ArchiveSource src;
+    ZipDirectory dir = {0};
+    EpubError err = EPUB_ERROR_IO;
+    if (ArchiveSource_from_reader(&src, &reader, ctx->allocator)) {
+        src.tail_hint = FINGERPRINT_TAIL_LEN;
+        err = ArchiveSource_read_directory(&src, &dir);
+        if (err == EPUB_OK) err = fingerprint_directory(&dir, fingerprint);
+        zip_directory_free(&dir);
+        ArchiveSource_close(&src);
+    }
+    close(fd);
+    return err;
 }
 
+// Writes `entry` to `out_fd`, or to `filename` if `out_fd` is -1. The file is
+// written under a temporary name next to it and renamed over `filename` only
+// once complete, so a failed extraction leaves an existing file as it was.
+static EpubError EpubDocument_extract(const EpubDocument *doc, const ZipEntry *entry, const char *filename, int out_fd) {
+    ZipArchive za;
+    ArchiveSource src;
+    if (!EpubDocument_open_source(doc, &za, &src)) return EPUB_ERROR_IO;
+
+    int fd = -1;
+    char *tmp = NULL;
+    EpubError err = EPUB_OK;
+    if (out_fd < 0) {
+        size_t tmp_size = strlen(filename) + sizeof(".XXXXXX");
+        tmp = epub_malloc(doc->allocator, tmp_size);
+        if (tmp) {
+            snprintf(tmp, tmp_size, "%s.XXXXXX", filename);
+            fd = mkstemp(tmp);
+        }
+        // mkstemp creates the file 0600, a replaced file keeps its mode
+        struct stat st;
+        mode_t mode = stat(filename, &st) == 0 ? st.st_mode & 07777 : 0644;
+        if (fd < 0 || fchmod(fd, mode) != 0) err = tmp ? EPUB_ERROR_IO : EPUB_ERROR_NO_MEMORY;
+    }
+
+    if (err == EPUB_OK) {
+        const ZipArchive *window = ArchiveSource_entry(&src, entry);
+        err = window ? zip_entry_extract_to_fd(window, entry, out_fd < 0 ? fd : out_fd, doc->allocator) : src.error;
+    }
 
-int EpubMetadata_get_creator_count(const EpubMetadata *meta) {
-    return meta ? (int)meta->creator.count : 0;
+    if (fd >= 0) {
+        if (close(fd) != 0 && err == EPUB_OK) err = EPUB_ERROR_IO;
+        if (err == EPUB_OK && rename(tmp, filename) != 0) err = EPUB_ERROR_IO;
+        if (err != EPUB_OK) unlink(tmp);
+    }
+    epub_free(doc->allocator, tmp);
+    ArchiveSource_close(&src);
+    zip_archive_close(&za);
+    return err;
+}
+
+EpubError EpubDocument_write_item(EpubDocument *doc, const EpubManifestItem *item, int fd) {
+    if (!doc || !item || fd < 0) return EPUB_ERROR_INVALID_ARGUMENT;
+    const EpubPackage *package = EpubDocument_package(doc);
+    if (!package) return EPUB_ERROR_NO_ROOTFILE;
+    const ZipEntry *entry = EpubPackage_entry(package, item);
+    if (!entry) return EPUB_ERROR_INVALID_ARGUMENT;
+    return EpubDocument_extract(doc, entry, NULL, fd);
 }
 
-const char* EpubMetadata_get_creator(const EpubMetadata *meta, int index) {
-    return (meta && index >= 0 && index < (int)meta->creator.count)
-        ? meta->creator.items[index]
-        : NULL;
+// Writes the cover to `out_fd`, or to a new `filename` if `out_fd` is -1.
+// The output file is only created once the cover entry is found.
+static EpubError EpubDocument_extract_cover(EpubDocument *doc, const char *filename, int out_fd) {
+    const EpubPackage *package = EpubDocument_package(doc);
+    if (!package) return EPUB_ERROR_NO_ROOTFILE;
+
+    const EpubManifestItem *cover = EpubPackage_cover(package);
+    const ZipEntry *entry = cover ? EpubPackage_entry(package, cover) : NULL;
+    if (!entry) return EPUB_ERROR_NO_COVER;
+    return EpubDocument_extract(doc, entry, filename, out_fd);
 }
 
-int EpubMetadata_get_identifier_count(const EpubMetadata *meta) {
-    return meta ? (int)meta->identifier.count : 0;
+EpubError EpubDocument_save_cover(EpubDocument *doc, const char *filename) {
+    if (!doc || !filename) return EPUB_ERROR_INVALID_ARGUMENT;
+    return EpubDocument_extract_cover(doc, filename, -1);
 }
 
-const char* EpubMetadata_get_identifier(const EpubMetadata *meta, int index) {
-    return (meta && index >= 0 && index < (int)meta->identifier.count)
-        ? meta->identifier.items[index]
-        : NULL;
+EpubError EpubDocument_write_cover(EpubDocument *doc, int fd) {
+    if (!doc || fd < 0) return EPUB_ERROR_INVALID_ARGUMENT;
+    return EpubDocument_extract_cover(doc, NULL, fd);
 }
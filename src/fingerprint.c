@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "epubinfo/alloc.h"
+#include "epubinfo/fingerprint.h"
+#include "epubinfo/metadata.h"
+
+// FNV-1a 64 over the values, then a final mix (splitmix64) so every bit of
+// the result depends on every input byte.
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+static uint64_t fnv_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * FNV_PRIME;
+    return h;
+}
+
+static uint64_t fnv_u64(uint64_t h, uint64_t v) {
+    for (int i = 0; i < 8; i++) h = (h ^ ((v >> (i * 8)) & 0xff)) * FNV_PRIME;
+    return h;
+}
+
+static uint64_t mix64(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
+
+typedef struct {
+    const char *name;
+    uint64_t size;
+    uint32_t crc32;
+    uint16_t len;
+} FingerprintFile;
+
+static int FingerprintFile_compare(const void *a, const void *b) {
+    const FingerprintFile *x = a, *y = b;
+    int c = memcmp(x->name, y->name, x->len < y->len ? x->len : y->len);
+    if (c) return c;
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    // duplicate names, the order must still not depend on the archive
+    if (x->crc32 != y->crc32) return x->crc32 < y->crc32 ? -1 : 1;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    return 0;
+}
+
+EpubError fingerprint_directory(const ZipDirectory *dir, uint64_t *fingerprint) {
+    FingerprintFile *files = NULL;
+    if (dir->num_of_entries > 0) {
+        files = epub_malloc(dir->allocator, dir->num_of_entries * sizeof(FingerprintFile));
+        if (!files) return EPUB_ERROR_NO_MEMORY;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < dir->num_of_entries; i++) {
+        const ZipEntry *entry = &dir->entries[i];
+        const char *name = zip_entry_filename(dir, entry);
+        if (entry->filename_len > 0 && name[entry->filename_len - 1] == '/') continue; // directory
+
+        files[count++] = (FingerprintFile){ name, entry->uncompressed_size, entry->crc32, entry->filename_len };
+    }
+    if (count > 1) qsort(files, count, sizeof(FingerprintFile), FingerprintFile_compare);
+
+    uint64_t h = FNV_OFFSET;
+    for (size_t i = 0; i < count; i++) {
+        h = fnv_u64(h, files[i].len);
+        h = fnv_bytes(h, files[i].name, files[i].len);
+        h = fnv_u64(h, files[i].crc32);
+        h = fnv_u64(h, files[i].size);
+    }
+    *fingerprint = mix64(fnv_u64(h, count));
+
+    epub_free(dir->allocator, files);
+    return EPUB_OK;
+}
+
+// Hashes `len` bytes of `s` into `*h`: ASCII letters are lowercased, other
+// ASCII characters that aren't digits are separators, runs of separators
+// count as one space and leading and trailing ones are dropped. UTF-8
+// sequences are hashed as is. Returns the number of bytes hashed.
+static size_t fnv_normalized(uint64_t *h, const char *s, size_t len) {
+    size_t hashed = 0;
+    int separator = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        else if (c < 0x80 && !(c >= 'a' && c <= 'z') && !(c >= '0' && c <= '9')) {
+            separator = 1;
+            continue;
+        }
+
+        if (separator && hashed > 0) {
+            *h = (*h ^ ' ') * FNV_PRIME;
+            hashed++;
+        }
+        separator = 0;
+        *h = (*h ^ c) * FNV_PRIME;
+        hashed++;
+    }
+    return hashed;
+}
+
+uint64_t fingerprint_metadata(const EpubMetadata *meta) {
+    const char *title = EpubMetadata_get_title(meta);
+    uint64_t h = FNV_OFFSET;
+    if (fnv_normalized(&h, title, strlen(title)) == 0) return 0;
+
+    // Books list their authors as dc:creator or as author, in no particular
+    // order: each name is hashed alone and the hashes are added up.
+    uint64_t names = 0;
+    for (int i = 0; i < EpubMetadata_get_author_count(meta); i++) {
+        const char *name = EpubMetadata_get_author(meta, i);
+        uint64_t n = FNV_OFFSET;
+        if (fnv_normalized(&n, name, strlen(name)) > 0) names += mix64(n);
+    }
+    for (int i = 0; i < EpubMetadata_get_creator_count(meta); i++) {
+        const char *name = EpubMetadata_get_creator(meta, i);
+        uint64_t n = FNV_OFFSET;
+        if (fnv_normalized(&n, name, strlen(name)) > 0) names += mix64(n);
+    }
+    h = fnv_u64(h, names);
+
+    // "en-US" and "en" are the same book
+    const char *language = EpubMetadata_get_language(meta);
+    h = fnv_u64(h, 0);
+    fnv_normalized(&h, language, strcspn(language, "-_"));
+
+    uint64_t fingerprint = mix64(h);
+    return fingerprint ? fingerprint : 1;
+}
@@ -0,0 +1,400 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "epubinfo/inflate.h"
+
+// Decode table entries (32 bits):
+//   bits 0-7    bits consumed by the entry (the code length, or the table
+//               bits for a subtable pointer)
+//   bits 8-11   extra bits of a length or distance, bits of a subtable
+//   bits 12-15  kind
+//   bits 16-31  literal byte, length or distance base, subtable start
+#define ENTRY_LITERAL   0x1000
+#define ENTRY_MATCH     0x2000      // a length or a distance
+#define ENTRY_END       0x4000      // end of block
+#define ENTRY_SUBTABLE  0x8000
+#define ENTRY_INVALID   0           // unused code, kind 0
+
+#define ENTRY(value, kind, extra) ((uint32_t)(value) << 16 | (kind) | (extra) << 8)
+
+#define LITLEN_TABLE_BITS 10
+#define DIST_TABLE_BITS 8
+#define PRECODE_TABLE_BITS 7
+
+// Main table and subtables. Complete codes fit with room to spare (zlib's
+// `enough` bound), the size is still checked while building.
+#define LITLEN_TABLE_SIZE 1536
+#define DIST_TABLE_SIZE 512
+#define PRECODE_TABLE_SIZE (1 << PRECODE_TABLE_BITS)
+
+#define MAX_CODE_LEN 15
+#define NUM_LITLEN 288
+#define NUM_DIST 32
+#define NUM_PRECODE 19
+
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+static const uint8_t precode_order[NUM_PRECODE] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+typedef struct {
+    const unsigned char *in;
+    const unsigned char *in_end;
+    uint64_t bitbuf;            // next bits of the stream, LSB first
+    unsigned bitsleft;          // valid bits in `bitbuf`
+    unsigned overrun;           // zero bytes made up past the end of the input
+
+    uint32_t litlen[LITLEN_TABLE_SIZE];
+    uint32_t dist[DIST_TABLE_SIZE];
+    uint32_t precode[PRECODE_TABLE_SIZE];
+    uint8_t lens[NUM_LITLEN + NUM_DIST];
+
+    // entry of every symbol, without the code length
+    uint32_t litlen_values[NUM_LITLEN];
+    uint32_t dist_values[NUM_DIST];
+    uint32_t precode_values[NUM_PRECODE];
+} Inflater;
+
+static inline uint64_t load_le64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Tops the bit buffer up to at least 56 bits. Past the end of the input,
+// zero bytes are made up so the decoder never branches on the input end;
+// reading more than 8 of them means the stream is truncated.
+static inline int refill(Inflater *d) {
+    if (d->in_end - d->in >= 8) {
+        // the bytes beyond the new `bitsleft` are loaded again next time, OR-ing the same bits
+        d->bitbuf |= load_le64(d->in) << d->bitsleft;
+        d->in += (63 - d->bitsleft) >> 3;
+        d->bitsleft |= 56;
+        return 1;
+    }
+    while (d->bitsleft <= 56) {
+        if (d->in < d->in_end) d->bitbuf |= (uint64_t)*d->in++ << d->bitsleft;
+        else d->overrun += 1;
+        d->bitsleft += 8;
+    }
+    return d->overrun <= 8;
+}
+
+static inline uint32_t peek(const Inflater *d, unsigned n) {
+    return (uint32_t)(d->bitbuf & ((1ull << n) - 1));
+}
+
+static inline void consume(Inflater *d, unsigned n) {
+    d->bitbuf >>= n;
+    d->bitsleft -= n;
+}
+
+// Reads `n` (at most 16) bits, the buffer must hold them.
+static inline uint32_t take(Inflater *d, unsigned n) {
+    uint32_t v = peek(d, n);
+    consume(d, n);
+    return v;
+}
+
+static unsigned reverse_bits(unsigned code, unsigned len) {
+    unsigned rev = 0;
+    for (unsigned i = 0; i < len; i++) {
+        rev = rev << 1 | (code & 1);
+        code >>= 1;
+    }
+    return rev;
+}
+
+// Builds a canonical Huffman decode table from code lengths. `values` is the
+// entry of every symbol, without the length. Codes longer than `table_bits`
+// go to subtables after the main table. Like zlib, an incomplete code is only
+// accepted up to `incomplete_len` (a single one bit code), unused codes then
+// decode as invalid.
+// Return 1 on success, 0 if the lengths are over-subscribed, incomplete or don't fit.
+static int build_table(uint32_t *table, size_t capacity, unsigned table_bits,
+                       const uint8_t *lens, unsigned num_syms, const uint32_t *values, unsigned incomplete_len) {
+    unsigned count[MAX_CODE_LEN + 1] = {0};
+    unsigned offsets[MAX_CODE_LEN + 2];
+    uint16_t sorted[NUM_LITLEN];
+
+    for (unsigned i = 0; i < num_syms; i++) count[lens[i]] += 1;
+    count[0] = 0;
+
+    int left = 1;
+    unsigned max_len = 0;
+    for (unsigned len = 1; len <= MAX_CODE_LEN; len++) {
+        left = (left << 1) - (int)count[len];
+        if (left < 0) return 0;
+        if (count[len]) max_len = len;
+    }
+    if (left > 0 && max_len > incomplete_len) return 0;
+
+    offsets[1] = 0;
+    for (unsigned len = 1; len <= MAX_CODE_LEN; len++) offsets[len + 1] = offsets[len] + count[len];
+    for (unsigned i = 0; i < num_syms; i++) {
+        if (lens[i]) sorted[offsets[lens[i]]++] = i;
+    }
+
+    size_t size = (size_t)1 << table_bits;
+    for (size_t i = 0; i < size; i++) table[i] = ENTRY_INVALID;
+
+    size_t next_free = size;
+    size_t sub_start = 0;
+    unsigned sub_bits = 0;
+    unsigned sub_prefix = ~0u;
+    unsigned code = 0;          // canonical code of the next symbol, MSB first
+    unsigned k = 0;
+
+    for (unsigned len = 1; len <= max_len; len++, code <<= 1) {
+        for (unsigned c = 0; c < count[len]; c++, k++, code++) {
+            uint32_t value = values[sorted[k]];
+            unsigned rev = reverse_bits(code, len);
+
+            if (len <= table_bits) {
+                for (size_t i = rev; i < size; i += (size_t)1 << len) table[i] = value | len;
+                continue;
+            }
+
+            unsigned prefix = rev & (size - 1);
+            if (prefix != sub_prefix) {
+                // big enough for every remaining code sharing this prefix
+                unsigned l = len;
+                int room = 1 << (len - table_bits);
+                while (l < max_len) {
+                    room -= l == len ? (int)(count[len] - c) : (int)count[l];
+                    if (room <= 0) break;
+                    l += 1;
+                    room <<= 1;
+                }
+                sub_bits = l - table_bits;
+
+                if (next_free + ((size_t)1 << sub_bits) > capacity) return 0;
+                sub_prefix = prefix;
+                sub_start = next_free;
+                next_free += (size_t)1 << sub_bits;
+                for (size_t i = sub_start; i < next_free; i++) table[i] = ENTRY_INVALID;
+                table[prefix] = ENTRY(sub_start, ENTRY_SUBTABLE, sub_bits) | table_bits;
+            }
+
+            unsigned sub_len = len - table_bits;
+            for (size_t i = rev >> table_bits; i < ((size_t)1 << sub_bits); i += (size_t)1 << sub_len) {
+                table[sub_start + i] = value | sub_len;
+            }
+        }
+    }
+    return 1;
+}
+
+// Decodes one symbol, the buffer must hold 15 bits.
+static inline uint32_t decode(Inflater *d, const uint32_t *table, unsigned table_bits) {
+    uint32_t entry = table[peek(d, table_bits)];
+    if (entry & ENTRY_SUBTABLE) {
+        consume(d, table_bits);
+        entry = table[(entry >> 16) + peek(d, (entry >> 8) & 0xF)];
+    }
+    consume(d, entry & 0xFF);
+    return entry;
+}
+
+static int build_code_tables(Inflater *d, unsigned num_litlen, unsigned num_dist) {
+    return build_table(d->litlen, LITLEN_TABLE_SIZE, LITLEN_TABLE_BITS, d->lens, num_litlen, d->litlen_values, 1) &&
+           build_table(d->dist, DIST_TABLE_SIZE, DIST_TABLE_BITS, &d->lens[num_litlen], num_dist, d->dist_values, 1);
+}
+
+static int read_fixed_tables(Inflater *d) {
+    unsigned i = 0;
+    for (; i < 144; i++) d->lens[i] = 8;
+    for (; i < 256; i++) d->lens[i] = 9;
+    for (; i < 280; i++) d->lens[i] = 7;
+    for (; i < NUM_LITLEN; i++) d->lens[i] = 8;
+    for (; i < NUM_LITLEN + NUM_DIST; i++) d->lens[i] = 5;
+    return build_code_tables(d, NUM_LITLEN, NUM_DIST);
+}
+
+static int read_dynamic_tables(Inflater *d) {
+    if (!refill(d)) return 0;
+    unsigned num_litlen = take(d, 5) + 257;
+    unsigned num_dist = take(d, 5) + 1;
+    unsigned num_precode = take(d, 4) + 4;
+    if (num_litlen > 286 || num_dist > 30) return 0;
+
+    uint8_t precode_lens[NUM_PRECODE] = {0};
+    for (unsigned i = 0; i < num_precode; i++) {
+        if (!refill(d)) return 0;
+        precode_lens[precode_order[i]] = take(d, 3);
+    }
+    if (!build_table(d->precode, PRECODE_TABLE_SIZE, PRECODE_TABLE_BITS, precode_lens, NUM_PRECODE, d->precode_values, 0)) return 0;
+
+    unsigned total = num_litlen + num_dist;
+    for (unsigned i = 0; i < total;) {
+        if (!refill(d)) return 0;
+        uint32_t entry = decode(d, d->precode, PRECODE_TABLE_BITS);
+        if (!(entry & ENTRY_LITERAL)) return 0;
+
+        unsigned sym = entry >> 16;
+        if (sym < 16) {
+            d->lens[i++] = sym;
+            continue;
+        }
+
+        uint8_t len = 0;
+        unsigned repeat;
+        if (sym == 16) {
+            if (i == 0) return 0;
+            len = d->lens[i - 1];
+            repeat = 3 + take(d, 2);
+        } else if (sym == 17) {
+            repeat = 3 + take(d, 3);
+        } else {
+            repeat = 11 + take(d, 7);
+        }
+        if (repeat > total - i) return 0;
+        memset(&d->lens[i], len, repeat);
+        i += repeat;
+    }
+
+    // the two code length lists are one sequence, but the tables are separate
+    if (d->lens[256] == 0) return 0;
+    return build_code_tables(d, num_litlen, num_dist);
+}
+
+static int read_stored(Inflater *d, unsigned char **out, unsigned char *out_end) {
+    // back to the byte boundary, the whole bytes still buffered go back to the input
+    consume(d, d->bitsleft & 7);
+    unsigned buffered = d->bitsleft >> 3;
+    if (d->overrun > buffered) return 0;
+    d->in -= buffered - d->overrun;
+    d->bitbuf = 0;
+    d->bitsleft = 0;
+    d->overrun = 0;
+
+    if (d->in_end - d->in < 4) return 0;
+    unsigned len = d->in[0] | d->in[1] << 8;
+    unsigned nlen = d->in[2] | d->in[3] << 8;
+    d->in += 4;
+    if ((len ^ 0xFFFF) != nlen) return 0;
+    if ((size_t)(d->in_end - d->in) < len || (size_t)(out_end - *out) < len) return 0;
+
+    memcpy(*out, d->in, len);
+    *out += len;
+    d->in += len;
+    return 1;
+}
+
+// Copies a match of `len` bytes from `dist` bytes back, both already checked.
+static inline unsigned char *copy_match(unsigned char *out, unsigned char *out_end, unsigned len, unsigned dist) {
+    const unsigned char *src = out - dist;
+    unsigned char *end = out + len;
+
+    // 8 bytes at a time may write up to 7 bytes past the match, still inside the output
+    if (dist >= 8 && (size_t)(out_end - out) >= (size_t)len + 8) {
+        do {
+            uint64_t v;
+            memcpy(&v, src, 8);
+            memcpy(out, &v, 8);
+            src += 8;
+            out += 8;
+        } while (out < end);
+        return end;
+    }
+    if (dist == 1) {
+        memset(out, *src, len);
+        return end;
+    }
+    while (out < end) *out++ = *src++;
+    return end;
+}
+
+static int read_block(Inflater *d, unsigned char *out_start, unsigned char **out_pos, unsigned char *out_end) {
+    unsigned char *out = *out_pos;
+
+    while (1) {
+        // a length and a distance with their extra bits are at most 48 bits
+        if (!refill(d)) return 0;
+        uint32_t entry = decode(d, d->litlen, LITLEN_TABLE_BITS);
+
+        if (entry & ENTRY_LITERAL) {
+            if (out == out_end) return 0;
+            *out++ = (unsigned char)(entry >> 16);
+
+            // a second literal fits in what is left of the refill
+            entry = decode(d, d->litlen, LITLEN_TABLE_BITS);
+            if (entry & ENTRY_LITERAL) {
+                if (out == out_end) return 0;
+                *out++ = (unsigned char)(entry >> 16);
+                continue;
+            }
+            if (!refill(d)) return 0;
+        }
+
+        if (entry & ENTRY_END) break;
+        if (!(entry & ENTRY_MATCH)) return 0;
+
+        unsigned len = (entry >> 16) + take(d, (entry >> 8) & 0xF);
+        entry = decode(d, d->dist, DIST_TABLE_BITS);
+        if (!(entry & ENTRY_MATCH)) return 0;
+        unsigned dist = (entry >> 16) + take(d, (entry >> 8) & 0xF);
+
+        if (dist > (size_t)(out - out_start) || len > (size_t)(out_end - out)) return 0;
+        out = copy_match(out, out_end, len, dist);
+    }
+
+    *out_pos = out;
+    return 1;
+}
+
+int inflate_oneshot(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len) {
+    Inflater d;
+    d.in = in;
+    d.in_end = in + in_len;
+    d.bitbuf = 0;
+    d.bitsleft = 0;
+    d.overrun = 0;
+
+    for (unsigned i = 0; i < 256; i++) d.litlen_values[i] = ENTRY(i, ENTRY_LITERAL, 0);
+    d.litlen_values[256] = ENTRY(0, ENTRY_END, 0);
+    for (unsigned i = 0; i < 29; i++) d.litlen_values[257 + i] = ENTRY(length_base[i], ENTRY_MATCH, length_extra[i]);
+    d.litlen_values[286] = d.litlen_values[287] = ENTRY_INVALID;
+    for (unsigned i = 0; i < 30; i++) d.dist_values[i] = ENTRY(dist_base[i], ENTRY_MATCH, dist_extra[i]);
+    d.dist_values[30] = d.dist_values[31] = ENTRY_INVALID;
+    for (unsigned i = 0; i < NUM_PRECODE; i++) d.precode_values[i] = ENTRY(i, ENTRY_LITERAL, 0);
+
+    unsigned char *pos = out;
+    unsigned char *out_end = out + out_len;
+    int final = 0;
+
+    while (!final) {
+        if (!refill(&d)) return 0;
+        final = take(&d, 1);
+        unsigned type = take(&d, 2);
+
+        int ok;
+        if (type == 0) ok = read_stored(&d, &pos, out_end);
+        else if (type == 1) ok = read_fixed_tables(&d) && read_block(&d, out, &pos, out_end);
+        else if (type == 2) ok = read_dynamic_tables(&d) && read_block(&d, out, &pos, out_end);
+        else ok = 0;
+        if (!ok) return 0;
+    }
+
+    // the made up bytes must not have been consumed
+    if (d.overrun * 8 > d.bitsleft) return 0;
+    return pos == out_end;
+}
@@ -0,0 +1,229 @@
+#include <stdalign.h>
+#include <string.h>
+
+#include "epubinfo/metadata.h"
+
+struct MetadataValue {
+    MetadataValue *next;
+    MetadataField field;
+    size_t len;
+    char text[];
+};
+
+// Every stored name has a distinct (length, first byte) pair, so one switch
+// picks the only candidate and a single memcmp confirms it. When a name is
+// added, keep the pairs distinct.
+//
+//  len | names
+// -----+---------------------
+//    5 | title
+//    6 | author
+//    7 | creator, subject
+//    8 | language
+//    9 | publisher
+//   10 | identifier
+//   11 | description
+int metadata_field_lookup(const char *name, size_t len) {
+    const char *candidate;
+    MetadataField field;
+
+    switch (len) {
+        case 5:  candidate = "title";       field = METADATA_TITLE;       break;
+        case 6:  candidate = "author";      field = METADATA_AUTHOR;      break;
+        case 7:
+            if (name[0] == 'c') { candidate = "creator"; field = METADATA_CREATOR; }
+            else                { candidate = "subject"; field = METADATA_SUBTITLE; }
+            break;
+        case 8:  candidate = "language";    field = METADATA_LANGUAGE;    break;
+        case 9:  candidate = "publisher";   field = METADATA_PUBLISHER;   break;
+        case 10: candidate = "identifier";  field = METADATA_IDENTIFIER;  break;
+        case 11: candidate = "description"; field = METADATA_DESCRIPTION; break;
+        default: return -1;
+    }
+
+    return memcmp(name, candidate, len) == 0 ? (int)field : -1;
+}
+
+void MetadataBuilder_init(MetadataBuilder *b, const EpubAllocator *allocator) {
+    memset(b, 0, sizeof(*b));
+    arena_init(&b->arena, 4096, allocator);
+}
+
+void MetadataBuilder_reset(MetadataBuilder *b) {
+    arena_reset(&b->arena);
+    b->first = NULL;
+    b->last = NULL;
+    memset(b->counts, 0, sizeof(b->counts));
+    b->strings_size = 0;
+}
+
+int MetadataBuilder_add(MetadataBuilder *b, MetadataField field, const char *text, size_t len) {
+    if (field < METADATA_FIRST_LIST && b->counts[field] > 0) return 1;
+
+    MetadataValue *value = arena_alloc(&b->arena, sizeof(MetadataValue) + len + 1, alignof(MetadataValue));
+    if (!value) return 0;
+
+    value->next = NULL;
+    value->field = field;
+    value->len = len;
+    memcpy(value->text, text, len);
+    value->text[len] = '\0';
+
+    if (b->last) b->last->next = value;
+    else b->first = value;
+    b->last = value;
+
+    b->counts[field] += 1;
+    b->strings_size += len + 1;
+    return 1;
+}
+
+uint32_t MetadataBuilder_count(const MetadataBuilder *b, MetadataField field) {
+    return b->counts[field];
+}
+
+size_t MetadataBuilder_size(const MetadataBuilder *b) {
+    size_t size = sizeof(EpubMetadata);
+    for (int i = METADATA_FIRST_LIST; i < METADATA_FIELD_COUNT; i++) {
+        size += sizeof(uint32_t) * b->counts[i];
+    }
+    size += b->strings_size;
+    return (size + 3) & ~(size_t)3;
+}
+
+EpubMetadata *MetadataBuilder_pack(const MetadataBuilder *b, void *block) {
+    EpubMetadata *meta = block;
+    unsigned char *base = block;
+    size_t size = MetadataBuilder_size(b);
+    memset(meta, 0, sizeof(EpubMetadata));
+    meta->size = size;
+
+    // list offset arrays
+    uint32_t cursor = sizeof(EpubMetadata);
+    for (int i = 0; i < METADATA_LIST_COUNT; i++) {
+        meta->lists[i].offset = cursor;
+        cursor += sizeof(uint32_t) * b->counts[METADATA_FIRST_LIST + i];
+    }
+
+    // strings, lists are filled in the order values were found
+    uint32_t filled[METADATA_LIST_COUNT] = {0};
+    for (const MetadataValue *value = b->first; value; value = value->next) {
+        memcpy(&base[cursor], value->text, value->len + 1);
+
+        if (value->field < METADATA_FIRST_LIST) {
+            meta->fields[value->field] = cursor;
+        } else {
+            int list = value->field - METADATA_FIRST_LIST;
+            uint32_t *offsets = (uint32_t *)&base[meta->lists[list].offset];
+            offsets[filled[list]++] = cursor;
+        }
+        cursor += value->len + 1;
+    }
+
+    for (int i = 0; i < METADATA_LIST_COUNT; i++) meta->lists[i].count = filled[i];
+    memset(&base[cursor], 0, size - cursor); // padding
+    return meta;
+}
+
+void MetadataBuilder_free(MetadataBuilder *b) {
+    arena_free(&b->arena);
+    b->first = NULL;
+    b->last = NULL;
+}
+
+int metadata_block_valid(const void *block, size_t size) {
+    const EpubMetadata *meta = block;
+    const unsigned char *base = block;
+    if (size < sizeof(EpubMetadata) || meta->size != size || size % 4 != 0) return 0;
+
+    // every string ends before the block does
+    if (size > sizeof(EpubMetadata) && base[size - 1] != '\0') return 0;
+
+    for (int i = 0; i < METADATA_FIRST_LIST; i++) {
+        if (meta->fields[i] && (meta->fields[i] < sizeof(EpubMetadata) || meta->fields[i] >= size)) return 0;
+    }
+
+    for (int i = 0; i < METADATA_LIST_COUNT; i++) {
+        const EpubMetadataList *list = &meta->lists[i];
+        if (list->count == 0) continue;
+        if (list->offset < sizeof(EpubMetadata) || list->offset > size || list->offset % 4 != 0) return 0;
+        if (list->count > (size - list->offset) / sizeof(uint32_t)) return 0;
+
+        const uint32_t *offsets = (const uint32_t *)&base[list->offset];
+        for (uint32_t j = 0; j < list->count; j++) {
+            if (offsets[j] < sizeof(EpubMetadata) || offsets[j] >= size) return 0;
+        }
+    }
+    return 1;
+}
+
+static const char *metadata_field(const EpubMetadata *meta, MetadataField field) {
+    if (!meta || !meta->fields[field]) return "";
+    return (const char *)meta + meta->fields[field];
+}
+
+static int metadata_list_count(const EpubMetadata *meta, MetadataField field) {
+    return meta ? (int)meta->lists[field - METADATA_FIRST_LIST].count : 0;
+}
+
+static const char *metadata_list_item(const EpubMetadata *meta, MetadataField field, int index) {
+    if (!meta) return NULL;
+
+    const EpubMetadataList *list = &meta->lists[field - METADATA_FIRST_LIST];
+    if (index < 0 || (uint32_t)index >= list->count) return NULL;
+
+    const uint32_t *offsets = (const uint32_t *)((const unsigned char *)meta + list->offset);
+    return (const char *)meta + offsets[index];
+}
+
+size_t EpubMetadata_get_size(const EpubMetadata *meta) {
+    return meta ? meta->size : 0;
+}
+
+// title
+const char* EpubMetadata_get_title(const EpubMetadata *meta) {
+    return metadata_field(meta, METADATA_TITLE);
+}
+
+const char* EpubMetadata_get_subtitle(const EpubMetadata *meta) {
+    return metadata_field(meta, METADATA_SUBTITLE);
+}
+
+const char* EpubMetadata_get_language(const EpubMetadata *meta) {
+    return metadata_field(meta, METADATA_LANGUAGE);
+}
+
+
+const char* EpubMetadata_get_description(const EpubMetadata *meta) {
+    return metadata_field(meta, METADATA_DESCRIPTION);
+}
+
+const char* EpubMetadata_get_publisher(const EpubMetadata *meta) {
+    return metadata_field(meta, METADATA_PUBLISHER);
+}
+
+
+int EpubMetadata_get_author_count(const EpubMetadata *meta) {
+    return metadata_list_count(meta, METADATA_AUTHOR);
+}
+
+const char* EpubMetadata_get_author(const EpubMetadata *meta, int index) {
+    return metadata_list_item(meta, METADATA_AUTHOR, index);
+}
+
+
+int EpubMetadata_get_creator_count(const EpubMetadata *meta) {
+    return metadata_list_count(meta, METADATA_CREATOR);
+}
+
+const char* EpubMetadata_get_creator(const EpubMetadata *meta, int index) {
+    return metadata_list_item(meta, METADATA_CREATOR, index);
+}
+
+int EpubMetadata_get_identifier_count(const EpubMetadata *meta) {
+    return metadata_list_count(meta, METADATA_IDENTIFIER);
+}
+
+const char* EpubMetadata_get_identifier(const EpubMetadata *meta, int index) {
+    return metadata_list_item(meta, METADATA_IDENTIFIER, index);
+}
@@ -0,0 +1,270 @@
+#include <string.h>
+
+#include "epubinfo/package.h"
+
+// Spine itemref kept until the whole manifest is known.
+typedef struct {
+    const char *idref;
+    size_t len;
+    int linear;
+} PendingRef;
+
+static const char *arena_strndup(Arena *arena, const char *text, size_t len) {
+    char *copy = arena_alloc(arena, len + 1, 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Return 1 if the space separated list `list` contains `word`.
+static int has_word(const char *list, const char *word) {
+    size_t word_len = strlen(word);
+    while (*list) {
+        while (*list == ' ') list++;
+        size_t len = strcspn(list, " ");
+        if (len == word_len && memcmp(list, word, word_len) == 0) return 1;
+        list += len;
+    }
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Return 1 if `href` starts with a URI scheme ("http:", "data:", ...).
+static int href_has_scheme(const char *href) {
+    char c = href[0];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) return 0;
+    for (size_t i = 1;; i++) {
+        c = href[i];
+        if (c == ':') return 1;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.')) {
+            return 0;
+        }
+    }
+}
+
+// Resolves a manifest href against the directory of the OPF, returns the
+// archive path (in `arena`), "" if it points outside the archive or NULL
+// if there is no memory.
+static const char *resolve_href(Arena *arena, const char *opf_name, const char *href) {
+    // absolute URLs and absolute paths aren't entries of the archive
+    if (href[0] == '/' || href_has_scheme(href)) return "";
+
+    const char *slash = strrchr(opf_name, '/');
+    size_t base_len = slash ? (size_t)(slash - opf_name + 1) : 0;
+    size_t href_len = strcspn(href, "#?");
+
+    ArenaMark mark = arena_mark(arena);
+    char *path = arena_alloc(arena, base_len + href_len + 1, 1);
+    if (!path) return NULL;
+    memcpy(path, opf_name, base_len);
+
+    // percent decoding, the result is never longer than the href
+    size_t len = base_len;
+    for (size_t i = 0; i < href_len; i++) {
+        int hi, lo;
+        if (href[i] == '%' && i + 2 < href_len && (hi = hex_value(href[i + 1])) >= 0 && (lo = hex_value(href[i + 2])) >= 0) {
+            path[len++] = (char)(hi << 4 | lo);
+            i += 2;
+        } else {
+            path[len++] = href[i];
+        }
+    }
+    path[len] = '\0';
+
+    // remove "." and ".." segments in place
+    size_t out = 0;
+    const char *segment = path;
+    while (*segment) {
+        const char *end = strchr(segment, '/');
+        size_t seg_len = end ? (size_t)(end - segment) : strlen(segment);
+
+        if (seg_len == 0 || (seg_len == 1 && segment[0] == '.')) {
+            // skip
+        } else if (seg_len == 2 && segment[0] == '.' && segment[1] == '.') {
+            if (out == 0) {
+                arena_rewind(arena, mark); // the path isn't kept
+                return "";
+            }
+            out -= 1; // drop the trailing '/'
+            while (out > 0 && path[out - 1] != '/') out--;
+        } else {
+            memmove(&path[out], segment, seg_len);
+            out += seg_len;
+            if (end) path[out++] = '/';
+        }
+
+        if (!end) break;
+        segment = end + 1;
+    }
+    path[out] = '\0';
+    return path;
+}
+
+static uint32_t id_hash(const char *id, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Returns the slot of `id`, or the empty slot where it would go.
+static uint32_t *EpubPackage_slot(const EpubPackage *pkg, const char *id, size_t len) {
+    size_t mask = pkg->index_capacity - 1;
+    for (size_t i = id_hash(id, len) & mask;; i = (i + 1) & mask) {
+        uint32_t *slot = &pkg->index[i];
+        if (*slot == 0) return slot;
+
+        const char *candidate = pkg->items[*slot - 1].id;
+        if (strncmp(candidate, id, len) == 0 && candidate[len] == '\0') return slot;
+    }
+}
+
+static int EpubPackage_add_item(EpubPackage *pkg, XmlValueSlice tag, size_t *capacity, const char *opf_name) {
+    XmlValueSlice id, href, media_type, properties;
+    if (!xml_slice_tag_attribute(tag, "id", &id) || !xml_slice_tag_attribute(tag, "href", &href)) return 1;
+    if (!xml_slice_tag_attribute(tag, "media-type", &media_type)) media_type.len = 0;
+    if (!xml_slice_tag_attribute(tag, "properties", &properties)) properties.len = 0;
+
+    if (pkg->count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        EpubManifestItem *items = epub_realloc(pkg->allocator, pkg->items, new_capacity * sizeof(EpubManifestItem));
+        if (!items) return 0;
+        pkg->items = items;
+        *capacity = new_capacity;
+    }
+
+    EpubManifestItem *item = &pkg->items[pkg->count];
+    item->id = arena_strndup(&pkg->strings, id.text, id.len);
+    item->href = arena_strndup(&pkg->strings, href.text, href.len);
+    item->media_type = media_type.len ? arena_strndup(&pkg->strings, media_type.text, media_type.len) : "";
+    item->properties = properties.len ? arena_strndup(&pkg->strings, properties.text, properties.len) : "";
+    if (!item->id || !item->href || !item->media_type || !item->properties) return 0;
+
+    item->path = resolve_href(&pkg->strings, opf_name, item->href);
+    if (!item->path) return 0;
+
+    pkg->count += 1;
+    return 1;
+}
+
+// Builds the id index and the entry table, and resolves the spine.
+static EpubError EpubPackage_finish(EpubPackage *pkg, const ZipDirectory *dir, const PendingRef *refs, size_t ref_count) {
+    pkg->index_capacity = 16;
+    while (pkg->index_capacity < pkg->count * 2) pkg->index_capacity *= 2;
+    pkg->index = epub_calloc(pkg->allocator, pkg->index_capacity, sizeof(uint32_t));
+    pkg->entries = epub_malloc(pkg->allocator, (pkg->count ? pkg->count : 1) * sizeof(ZipEntry *));
+    pkg->spine = epub_malloc(pkg->allocator, (ref_count ? ref_count : 1) * sizeof(EpubSpineItem));
+    if (!pkg->index || !pkg->entries || !pkg->spine) return EPUB_ERROR_NO_MEMORY;
+
+    for (size_t i = 0; i < pkg->count; i++) {
+        const EpubManifestItem *item = &pkg->items[i];
+        uint32_t *slot = EpubPackage_slot(pkg, item->id, strlen(item->id));
+        if (*slot == 0) *slot = i + 1; // the first of duplicated ids wins
+
+        pkg->entries[i] = item->path[0] ? zip_find_entry_by_filename(dir, item->path) : NULL;
+    }
+
+    for (size_t i = 0; i < ref_count; i++) {
+        const EpubManifestItem *item = EpubPackage_find(pkg, refs[i].idref, refs[i].len);
+        if (!item) continue;
+        pkg->spine[pkg->spine_count++] = (EpubSpineItem){ item, refs[i].linear };
+    }
+    return EPUB_OK;
+}
+
+EpubError EpubPackage_parse(EpubPackage *pkg, EntryTokenizer *t, const ZipDirectory *dir, const char *opf_name,
+                            const EpubAllocator *allocator) {
+    memset(pkg, 0, sizeof(*pkg));
+    pkg->allocator = allocator;
+    if (!arena_init(&pkg->strings, 4096, allocator)) return EPUB_ERROR_NO_MEMORY;
+
+    PendingRef *refs = NULL;
+    size_t ref_count = 0, ref_capacity = 0, item_capacity = 0;
+    EpubError err = EPUB_OK;
+
+    while (err == EPUB_OK) {
+        XmlToken v = EntryTokenizer_next(t);
+        if (v.type == ERROR_TAG) {
+            err = EPUB_ERROR_INFLATE;
+            break;
+        }
+        if (v.type == EOF_TAG) break;
+        if (v.type != OPEN_TAG && v.type != SELF_CLOSE_TAG && v.type != CLOSE_TAG) continue;
+
+        XmlValueSlice local = xml_slice_local_name(xml_slice_tag_name(v.value), NULL);
+        if (v.type == CLOSE_TAG) {
+            if (xml_slice_equals(local, "spine")) break;
+            continue;
+        }
+
+        XmlValueSlice attr, content;
+        if (xml_slice_equals(local, "item")) {
+            if (!EpubPackage_add_item(pkg, v.value, &item_capacity, opf_name)) err = EPUB_ERROR_NO_MEMORY;
+        } else if (xml_slice_equals(local, "itemref")) {
+            if (!xml_slice_tag_attribute(v.value, "idref", &attr)) continue;
+
+            if (ref_count == ref_capacity) {
+                size_t capacity = ref_capacity ? ref_capacity * 2 : 64;
+                PendingRef *grown = epub_realloc(pkg->allocator, refs, capacity * sizeof(PendingRef));
+                if (!grown) {
+                    err = EPUB_ERROR_NO_MEMORY;
+                    break;
+                }
+                refs = grown;
+                ref_capacity = capacity;
+            }
+
+            PendingRef *ref = &refs[ref_count++];
+            ref->idref = arena_strndup(&pkg->strings, attr.text, attr.len);
+            ref->len = attr.len;
+            ref->linear = !(xml_slice_tag_attribute(v.value, "linear", &attr) && xml_slice_equals(attr, "no"));
+            if (!ref->idref) err = EPUB_ERROR_NO_MEMORY;
+        } else if (xml_slice_equals(local, "meta") && !pkg->cover_id) {
+            if (xml_slice_tag_attribute(v.value, "name", &attr) && xml_slice_equals(attr, "cover")
+                && xml_slice_tag_attribute(v.value, "content", &content)) {
+                pkg->cover_id = arena_strndup(&pkg->strings, content.text, content.len);
+                if (!pkg->cover_id) err = EPUB_ERROR_NO_MEMORY;
+            }
+        }
+    }
+
+    if (err == EPUB_OK) err = EpubPackage_finish(pkg, dir, refs, ref_count);
+    epub_free(pkg->allocator, refs);
+    return err;
+}
+
+const EpubManifestItem *EpubPackage_find(const EpubPackage *pkg, const char *id, size_t len) {
+    if (!pkg->index) return NULL;
+    uint32_t slot = *EpubPackage_slot(pkg, id, len);
+    return slot ? &pkg->items[slot - 1] : NULL;
+}
+
+const ZipEntry *EpubPackage_entry(const EpubPackage *pkg, const EpubManifestItem *item) {
+    if (!item || item < pkg->items || item >= pkg->items + pkg->count) return NULL;
+    return pkg->entries[item - pkg->items];
+}
+
+const EpubManifestItem *EpubPackage_cover(const EpubPackage *pkg) {
+    for (size_t i = 0; i < pkg->count; i++) {
+        if (has_word(pkg->items[i].properties, "cover-image")) return &pkg->items[i];
+    }
+    return pkg->cover_id ? EpubPackage_find(pkg, pkg->cover_id, strlen(pkg->cover_id)) : NULL;
+}
+
+void EpubPackage_free(EpubPackage *pkg) {
+    arena_free(&pkg->strings);
+    epub_free(pkg->allocator, pkg->items);
+    epub_free(pkg->allocator, pkg->entries);
+    epub_free(pkg->allocator, pkg->index);
+    epub_free(pkg->allocator, pkg->spine);
+    memset(pkg, 0, sizeof(*pkg));
+}
@@ -0,0 +1,130 @@
+#include <string.h>
+
+#include "epubinfo/source.h"
+
+// Bytes read past the file name when an entry is fetched, the local extra
+// field is read blindly since only the central directory one is known.
+#define SOURCE_EXTRA_FIELD_GUESS 256
+
+void ArchiveSource_from_archive(ArchiveSource *src, const ZipArchive *za, const EpubAllocator *allocator) {
+    memset(src, 0, sizeof(*src));
+    src->whole = *za;
+    src->allocator = allocator;
+}
+
+int ArchiveSource_from_reader(ArchiveSource *src, const EpubReader *reader, const EpubAllocator *allocator) {
+    memset(src, 0, sizeof(*src));
+    src->reader = reader;
+    src->allocator = allocator;
+
+    int64_t size = reader->size(reader->ctx);
+    if (size < 0) return 0;
+    src->size = size;
+    return 1;
+}
+
+void ArchiveSource_copy(ArchiveSource *dst, const ArchiveSource *src) {
+    memset(dst, 0, sizeof(*dst));
+    dst->whole = src->whole;
+    dst->reader = src->reader;
+    dst->size = src->size;
+    dst->allocator = src->allocator;
+}
+
+static void ArchiveSource_release(ArchiveSource *src, ZipArchive *window) {
+    epub_free(src->allocator, (void *)window->data);
+    memset(window, 0, sizeof(*window));
+}
+
+// Replaces `window` with the `len` bytes at `offset`, one read_at call.
+static int ArchiveSource_fetch(ArchiveSource *src, ZipArchive *window, uint64_t offset, uint64_t len) {
+    ArchiveSource_release(src, window);
+    if (offset > src->size || len > src->size - offset || len > SIZE_MAX) {
+        src->error = EPUB_ERROR_ZIP;
+        return 0;
+    }
+
+    void *buf = epub_malloc(src->allocator, len ? len : 1);
+    if (!buf) {
+        src->error = EPUB_ERROR_NO_MEMORY;
+        return 0;
+    }
+
+    src->read_count += 1;
+    if (src->reader->read_at(src->reader->ctx, offset, buf, len) != 0) {
+        epub_free(src->allocator, buf);
+        src->error = EPUB_ERROR_IO;
+        return 0;
+    }
+
+    zip_archive_window(window, buf, len, offset, src->size);
+    return 1;
+}
+
+EpubError ArchiveSource_read_directory(ArchiveSource *src, ZipDirectory *dir) {
+    ZipEocdrHeader header;
+
+    if (!src->reader) {
+        if (!zip_valid_header(&src->whole)) return EPUB_ERROR_ZIP;
+        if (!zip_read_end_of_central_directory_record(&src->whole, &header)) return EPUB_ERROR_ZIP;
+        if (!zip_read_central_directory(&src->whole, &header, dir, src->allocator)) return EPUB_ERROR_ZIP;
+        return EPUB_OK;
+    }
+
+    // The tail read covers the whole EOCDR search span, unless the caller
+    // bets on a shorter one. A long archive comment or a ZIP64 locator
+    // outside the short tail then costs a second read of the whole span.
+    uint64_t span = src->size < ZIP_TAIL_SEARCH_LEN ? src->size : ZIP_TAIL_SEARCH_LEN;
+    uint64_t tail_len = src->tail_hint && src->tail_hint < span ? src->tail_hint : span;
+    if (!ArchiveSource_fetch(src, &src->tail, src->size - tail_len, tail_len)) return src->error;
+    if (!zip_read_end_of_central_directory_record(&src->tail, &header)) {
+        if (tail_len == span) return EPUB_ERROR_ZIP;
+        if (!ArchiveSource_fetch(src, &src->tail, src->size - span, span)) return src->error;
+        if (!zip_read_end_of_central_directory_record(&src->tail, &header)) return EPUB_ERROR_ZIP;
+    }
+
+    // small archives have their central directory inside the tail
+    const ZipArchive *window = &src->tail;
+    if (!zip_archive_contains(window, header.cent_dir_offset, header.size_cent_dir)) {
+        if (!ArchiveSource_fetch(src, &src->cent_dir, header.cent_dir_offset, header.size_cent_dir)) return src->error;
+        window = &src->cent_dir;
+    }
+
+    int ok = zip_read_central_directory(window, &header, dir, src->allocator);
+    ArchiveSource_release(src, &src->cent_dir); // names are copied to `dir`
+    return ok ? EPUB_OK : EPUB_ERROR_ZIP;
+}
+
+const ZipArchive *ArchiveSource_entry(ArchiveSource *src, const ZipEntry *entry) {
+    if (!src->reader) return &src->whole;
+    src->error = EPUB_ERROR_ZIP; // until a fetch says otherwise
+
+    if (zip_entry_raw_data(&src->tail, entry)) return &src->tail;
+    if (src->entry.data && zip_entry_raw_data(&src->entry, entry)) return &src->entry;
+
+    // The local extra field usually has the same length as the central
+    // directory one, a bounded guess avoids a separate header read.
+    uint64_t offset = entry->file_offset;
+    if (offset > src->size) return NULL;
+
+    uint64_t len = LFH_LEN_FIXED + entry->filename_len + SOURCE_EXTRA_FIELD_GUESS + entry->compressed_size;
+    if (len > src->size - offset) len = src->size - offset;
+    if (!ArchiveSource_fetch(src, &src->entry, offset, len)) return NULL;
+    if (zip_entry_raw_data(&src->entry, entry)) return &src->entry;
+
+    // bigger extra field, the header tells the exact length
+    if (src->entry.size < LFH_LEN_FIXED) return NULL;
+    const unsigned char *lfh = src->entry.data;
+    if (read_le32(lfh) != LFH_SIGNATURE) return NULL;
+
+    len = LFH_LEN_FIXED + read_le16(&lfh[LFH_OFF_FILENAME_LEN]) + read_le16(&lfh[LFH_OFF_EXTRA_FIELD_LEN]) + entry->compressed_size;
+    if (len <= src->entry.size) return NULL; // already had every byte, the entry is invalid
+    if (!ArchiveSource_fetch(src, &src->entry, offset, len)) return NULL;
+    return zip_entry_raw_data(&src->entry, entry) ? &src->entry : NULL;
+}
+
+void ArchiveSource_close(ArchiveSource *src) {
+    ArchiveSource_release(src, &src->tail);
+    ArchiveSource_release(src, &src->cent_dir);
+    ArchiveSource_release(src, &src->entry);
+}
@@ -0,0 +1,346 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "epubinfo/text.h"
+#include "epubinfo/tokenizer.h"
+#include "epubinfo/xml.h"
+
+// Chapters are handed out in spine order. The worker holding the oldest
+// chapter not delivered yet (the head) calls the callback as its buffer
+// fills, the others buffer up to TEXT_CHUNK bytes and then wait for their
+// turn. The head never waits, so the spine always makes progress, and
+// memory is bounded by the number of workers, not by the size of a chapter:
+// long text is tokenized in pieces, only a long tag grows the window (and the
+// scratch buffer), up to ENTRY_TOKENIZER_MAX.
+
+typedef struct {
+    const EpubPackage *pkg;
+    const ArchiveSource *src;
+    EpubTextCallback callback;
+    void *user;
+    atomic_size_t next;         // next spine entry to hand out
+    atomic_int stop;            // the callback asked to stop
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    size_t head;                // oldest chapter not delivered
+    EpubError error;            // first error
+    EpubTextStats stats;
+} TextJob;
+
+typedef struct {
+    TextJob *job;
+    pthread_t thread;
+    int started;
+    ArchiveSource src;
+    EntryTokenizer tokenizer;
+    char out[TEXT_CHUNK];       // text not delivered yet
+    size_t out_len;
+    char *scratch;              // decoded text token
+    size_t scratch_capacity;
+    EpubTextStats stats;
+
+    // current chapter
+    size_t chapter;
+    int is_head;
+    int skip_depth;             // inside <head>, <script> or <style>
+    int pending_space;
+    int line_start;             // nothing written on the current line
+} TextWorker;
+
+typedef enum {
+    TEXT_INLINE,
+    TEXT_BLOCK,                 // ends a line
+    TEXT_SKIPPED,               // content isn't text
+} TextTagKind;
+
+#define TEXT_TAG(name, kind) { name, sizeof(name) - 1, kind }
+
+static const struct {
+    const char *name;
+    size_t len;
+    TextTagKind kind;
+} text_tags[] = {
+    TEXT_TAG("p", TEXT_BLOCK), TEXT_TAG("br", TEXT_BLOCK), TEXT_TAG("div", TEXT_BLOCK),
+    TEXT_TAG("h1", TEXT_BLOCK), TEXT_TAG("h2", TEXT_BLOCK), TEXT_TAG("h3", TEXT_BLOCK),
+    TEXT_TAG("h4", TEXT_BLOCK), TEXT_TAG("h5", TEXT_BLOCK), TEXT_TAG("h6", TEXT_BLOCK),
+    TEXT_TAG("li", TEXT_BLOCK), TEXT_TAG("dt", TEXT_BLOCK), TEXT_TAG("dd", TEXT_BLOCK),
+    TEXT_TAG("tr", TEXT_BLOCK), TEXT_TAG("hr", TEXT_BLOCK), TEXT_TAG("pre", TEXT_BLOCK),
+    TEXT_TAG("ul", TEXT_BLOCK), TEXT_TAG("ol", TEXT_BLOCK), TEXT_TAG("dl", TEXT_BLOCK),
+    TEXT_TAG("table", TEXT_BLOCK), TEXT_TAG("blockquote", TEXT_BLOCK), TEXT_TAG("section", TEXT_BLOCK),
+    TEXT_TAG("article", TEXT_BLOCK), TEXT_TAG("aside", TEXT_BLOCK), TEXT_TAG("header", TEXT_BLOCK),
+    TEXT_TAG("footer", TEXT_BLOCK), TEXT_TAG("nav", TEXT_BLOCK), TEXT_TAG("figure", TEXT_BLOCK),
+    TEXT_TAG("figcaption", TEXT_BLOCK), TEXT_TAG("body", TEXT_BLOCK),
+    TEXT_TAG("head", TEXT_SKIPPED), TEXT_TAG("script", TEXT_SKIPPED), TEXT_TAG("style", TEXT_SKIPPED),
+};
+
+static const unsigned char text_space[256] = { [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1, ['\f'] = 1 };
+
+// HTML names are case insensitive, XHTML ones are lowercase anyway.
+static TextTagKind text_tag_kind(XmlValueSlice name) {
+    char lower[16];
+    if (name.len == 0 || name.len > sizeof(lower)) return TEXT_INLINE;
+    for (size_t i = 0; i < name.len; i++) {
+        char c = name.text[i];
+        lower[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+
+    for (size_t i = 0; i < sizeof(text_tags) / sizeof(text_tags[0]); i++) {
+        if (name.len == text_tags[i].len && lower[0] == text_tags[i].name[0] &&
+            memcmp(lower, text_tags[i].name, name.len) == 0) {
+            return text_tags[i].kind;
+        }
+    }
+    return TEXT_INLINE;
+}
+
+// Waits until the chapter of `w` is the head.
+// Return 0 if the extraction was stopped meanwhile.
+static int TextWorker_wait_turn(TextWorker *w) {
+    if (w->is_head) return !atomic_load(&w->job->stop);
+
+    TextJob *job = w->job;
+    pthread_mutex_lock(&job->lock);
+    while (job->head != w->chapter && !atomic_load(&job->stop)) pthread_cond_wait(&job->turn, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+
+    w->is_head = !atomic_load(&job->stop);
+    return w->is_head;
+}
+
+// Return 0 if the extraction was stopped.
+static int TextWorker_flush(TextWorker *w) {
+    if (w->out_len == 0) return 1;
+    if (!TextWorker_wait_turn(w)) return 0;
+
+    TextJob *job = w->job;
+    int stop = job->callback(job->user, (int)w->chapter, w->out, w->out_len);
+    w->stats.text_bytes += w->out_len;
+    w->out_len = 0;
+    if (stop) {
+        pthread_mutex_lock(&job->lock);
+        atomic_store(&job->stop, 1);
+        pthread_cond_broadcast(&job->turn);
+        pthread_mutex_unlock(&job->lock);
+        return 0;
+    }
+    return 1;
+}
+
+// Writes `text` (already decoded) with its whitespace runs collapsed. A
+// trailing space is kept pending, it's only written if more text follows
+// on the same line.
+static int TextWorker_text(TextWorker *w, const char *text, size_t len) {
+    while (len > 0) {
+        // room for the pending space and the piece
+        size_t piece = len < TEXT_CHUNK - 1 ? len : TEXT_CHUNK - 1;
+        if (w->out_len + piece + 1 > TEXT_CHUNK && !TextWorker_flush(w)) return 0;
+
+        char *out = &w->out[w->out_len];
+        size_t n = 0;
+        int prev = w->line_start;   // last byte written is a space (or nothing at a line start)
+        if (w->pending_space && !w->line_start) {
+            out[n++] = ' ';
+            prev = 1;
+        }
+
+        // branchless: every byte is written, a space only advances after a non space
+        for (size_t i = 0; i < piece; i++) {
+            unsigned char c = text[i];
+            int space = text_space[c];
+            out[n] = space ? ' ' : c;
+            n += !(space & prev);
+            prev = space;
+        }
+
+        w->pending_space = n > 0 && out[n - 1] == ' ';
+        n -= w->pending_space;
+        w->line_start = w->line_start && n == 0;
+        w->out_len += n;
+        text += piece;
+        len -= piece;
+    }
+    return 1;
+}
+
+static int TextWorker_end_line(TextWorker *w) {
+    w->pending_space = 0;
+    if (w->line_start) return 1;
+    w->line_start = 1;
+    if (w->out_len == TEXT_CHUNK && !TextWorker_flush(w)) return 0;
+    w->out[w->out_len++] = '\n';
+    return 1;
+}
+
+static int TextWorker_decode(TextWorker *w, XmlValueSlice text) {
+    if (!memchr(text.text, '&', text.len)) return TextWorker_text(w, text.text, text.len);
+
+    if (text.len > w->scratch_capacity) {
+        size_t capacity = w->scratch_capacity ? w->scratch_capacity : 4096;
+        while (capacity < text.len) capacity *= 2;
+        char *scratch = epub_realloc(w->src.allocator, w->scratch, capacity);
+        if (!scratch) return -1;
+        w->scratch = scratch;
+        w->scratch_capacity = capacity;
+    }
+    size_t len = xml_decode_entities(text.text, text.len, w->scratch);
+    return TextWorker_text(w, w->scratch, len);
+}
+
+// Writes the text of one entry, the last line is ended.
+// Return 0 if the extraction was stopped, -1 on error (`err` is set).
+static int TextWorker_chapter(TextWorker *w, const ZipEntry *entry, EpubError *err) {
+    static const char cdata[] = "<![CDATA[";
+    w->skip_depth = 0;
+    w->pending_space = 0;
+    w->line_start = 1;
+
+    const ZipArchive *window = ArchiveSource_entry(&w->src, entry);
+    if (!window) {
+        *err = w->src.reader ? w->src.error : EPUB_ERROR_ZIP;
+        return -1;
+    }
+    if (!EntryTokenizer_open(&w->tokenizer, window, entry)) {
+        *err = EPUB_ERROR_INFLATE;
+        return -1;
+    }
+
+    while (1) {
+        XmlToken v = EntryTokenizer_next(&w->tokenizer);
+        int ok = 1;
+
+        switch (v.type) {
+            case EOF_TAG:
+                return TextWorker_end_line(w);
+            case ERROR_TAG:
+                *err = EPUB_ERROR_INFLATE;
+                return TextWorker_end_line(w) ? -1 : 0;
+            case TEXT_TAG:
+                if (w->skip_depth > 0) break;
+                // the tokenizer skips the whitespace in front of a token
+                if (v.value.text > w->tokenizer.parser.content && text_space[(unsigned char)v.value.text[-1]]) w->pending_space = 1;
+                ok = TextWorker_decode(w, v.value);
+                if (ok < 0) {
+                    *err = EPUB_ERROR_NO_MEMORY;
+                    return -1;
+                }
+                break;
+            case DECLARATION_TAG:
+                if (w->skip_depth > 0 || v.value.len < sizeof(cdata) - 1 + 3) break;
+                if (memcmp(v.value.text, cdata, sizeof(cdata) - 1) != 0) break;
+                // CDATA content is text without references
+                ok = TextWorker_text(w, &v.value.text[sizeof(cdata) - 1], v.value.len - (sizeof(cdata) - 1) - 3);
+                break;
+            case OPEN_TAG:
+            case CLOSE_TAG:
+            case SELF_CLOSE_TAG: {
+                TextTagKind kind = text_tag_kind(xml_slice_local_name(xml_slice_tag_name(v.value), NULL));
+                if (kind == TEXT_SKIPPED) {
+                    if (v.type == OPEN_TAG) w->skip_depth += 1;
+                    else if (v.type == CLOSE_TAG && w->skip_depth > 0) w->skip_depth -= 1;
+                } else if (kind == TEXT_BLOCK && w->skip_depth == 0) {
+                    ok = TextWorker_end_line(w);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        if (!ok) return 0;
+    }
+}
+
+// Only (X)HTML has text worth extracting, images and fonts can be in the spine too.
+static int text_media_type(const char *media_type) {
+    return strcmp(media_type, "application/xhtml+xml") == 0 || strcmp(media_type, "text/html") == 0 ||
+           strcmp(media_type, "application/x-dtbook+xml") == 0;
+}
+
+static void *text_worker_run(void *arg) {
+    TextWorker *w = arg;
+    TextJob *job = w->job;
+    size_t count = job->pkg->spine_count;
+
+    while (!atomic_load(&job->stop)) {
+        size_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= count) break;
+
+        w->chapter = i;
+        w->is_head = 0;
+        EpubError err = EPUB_OK;
+
+        const EpubManifestItem *item = job->pkg->spine[i].item;
+        const ZipEntry *entry = EpubPackage_entry(job->pkg, item);
+        if (entry && text_media_type(item->media_type)) {
+            w->stats.chapters += 1;
+            w->stats.compressed_bytes += entry->compressed_size;
+            w->stats.input_bytes += entry->uncompressed_size;
+            if (TextWorker_chapter(w, entry, &err) == 0) break;
+        }
+
+        // deliver the rest of the chapter and pass the turn on
+        if (!TextWorker_flush(w) || !TextWorker_wait_turn(w)) break;
+        pthread_mutex_lock(&job->lock);
+        if (err != EPUB_OK && job->error == EPUB_OK) job->error = err;
+        job->head = i + 1;
+        pthread_cond_broadcast(&job->turn);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->stats.chapters += w->stats.chapters;
+    job->stats.compressed_bytes += w->stats.compressed_bytes;
+    job->stats.input_bytes += w->stats.input_bytes;
+    job->stats.text_bytes += w->stats.text_bytes;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+EpubError text_extract_spine(const EpubPackage *pkg, const ArchiveSource *src, int threads,
+                             EpubTextCallback callback, void *user, EpubTextStats *stats) {
+    if (pkg->spine_count == 0) return EPUB_OK;
+
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
+    if ((size_t)threads > pkg->spine_count) threads = pkg->spine_count;
+
+    TextWorker *workers = epub_calloc(src->allocator, threads, sizeof(TextWorker));
+    if (!workers) return EPUB_ERROR_NO_MEMORY;
+
+    TextJob job = { .pkg = pkg, .src = src, .callback = callback, .user = user };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.stop, 0);
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.turn, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].job = &job;
+        ArchiveSource_copy(&workers[i].src, src);
+        workers[i].tokenizer.allocator = src->allocator;
+        workers[i].tokenizer.text_pieces = 1;
+    }
+
+    // worker 0 is the calling thread, chapters are only taken by running workers
+    for (int i = 1; i < threads; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, text_worker_run, &workers[i]) == 0;
+    }
+    text_worker_run(&workers[0]);
+
+    for (int i = 0; i < threads; i++) {
+        if (i > 0 && workers[i].started) pthread_join(workers[i].thread, NULL);
+        EntryTokenizer_close(&workers[i].tokenizer);
+        ArchiveSource_close(&workers[i].src);
+        epub_free(src->allocator, workers[i].scratch);
+    }
+
+    pthread_cond_destroy(&job.turn);
+    pthread_mutex_destroy(&job.lock);
+    epub_free(src->allocator, workers);
+
+    if (stats) *stats = job.stats;
+    return job.error;
+}
@@ -0,0 +1,102 @@
+#include "epubinfo/tokenizer.h"
+
+int EntryTokenizer_open(EntryTokenizer *t, const ZipArchive *za, const ZipEntry *entry) {
+    t->stream.inflater.allocator = t->allocator;
+    if (!zip_entry_stream_reset(&t->stream, za, entry)) return 0;
+
+    if (!t->buffer) {
+        t->capacity = ENTRY_TOKENIZER_CHUNK;
+        t->buffer = epub_malloc(t->allocator, t->capacity);
+        if (!t->buffer) return 0;
+    }
+
+    // room for the whole entry lets the first read take the one-shot path
+    if (zip_entry_oneshot(entry) && t->capacity < entry->uncompressed_size) {
+        char *buffer = epub_realloc(t->allocator, t->buffer, entry->uncompressed_size);
+        if (!buffer) return 0;
+        t->buffer = buffer;
+        t->capacity = entry->uncompressed_size;
+    }
+
+    xml_parser_init(&t->parser, t->buffer, 0);
+    t->parser.partial = 1;
+    return 1;
+}
+
+// The window is full with the start of a token. Text is cut at the end of the
+// window, before a reference cut short, the rest stays for the next piece.
+// Return 1 if `piece` is set, 0 if the token is a tag.
+static int EntryTokenizer_text_piece(EntryTokenizer *t, XmlToken *piece) {
+    t->parser.partial = 0;
+    XmlToken value = xml_next_token(&t->parser);
+    t->parser.partial = 1;
+
+    if (value.type == TEXT_TAG) {
+        size_t keep = xml_partial_reference(value.value.text, value.value.len);
+        value.value.len -= keep;
+        t->parser.cursor -= keep;
+        if (value.value.len > 0) {
+            *piece = value;
+            return 1;
+        }
+    } else if (value.type != EOF_TAG) {
+        t->parser.cursor = 0;
+        return 0;
+    }
+
+    // only whitespace in front, the last byte of it tells the next token it follows a space
+    size_t start = value.type == EOF_TAG ? t->parser.length : (size_t)(value.value.text - t->parser.content);
+    t->parser.cursor = start - 1;
+    return 0;
+}
+
+XmlToken EntryTokenizer_next(EntryTokenizer *t) {
+    while (1) {
+        XmlToken value = xml_next_token(&t->parser);
+        if (value.type != PARTIAL_TAG) return value;
+
+        // refill the window after the unread bytes
+        size_t used = xml_parser_compact(&t->parser);
+        if (used == t->capacity && t->stream.output_left == 0) {
+            // the rest of the entry is in the window
+            t->parser.partial = 0;
+            continue;
+        }
+        if (used == t->capacity && t->text_pieces) {
+            if (EntryTokenizer_text_piece(t, &value)) return value;
+            used = xml_parser_compact(&t->parser);
+        }
+        if (used == t->capacity) {
+            size_t new_capacity = t->capacity * 2;
+            if (t->capacity >= ENTRY_TOKENIZER_MAX) {
+                value.type = ERROR_TAG;
+                return value;
+            }
+            if (new_capacity > ENTRY_TOKENIZER_MAX) new_capacity = ENTRY_TOKENIZER_MAX;
+            char *new_buffer = epub_realloc(t->allocator, t->buffer, new_capacity);
+            if (!new_buffer) {
+                value.type = ERROR_TAG;
+                return value;
+            }
+            t->buffer = new_buffer;
+            t->capacity = new_capacity;
+            t->parser.content = new_buffer;
+        }
+
+        long n = zip_entry_stream_read(&t->stream, &t->buffer[used], t->capacity - used);
+        if (n < 0) {
+            value.type = ERROR_TAG;
+            return value;
+        }
+
+        t->parser.length += n;
+        if (n == 0) t->parser.partial = 0;
+    }
+}
+
+void EntryTokenizer_close(EntryTokenizer *t) {
+    zip_entry_stream_close(&t->stream);
+    epub_free(t->allocator, t->buffer);
+    t->buffer = NULL;
+    t->capacity = 0;
+}
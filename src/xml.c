@@ -1,59 +1,130 @@
 #include <assert.h>
 #include <stdalign.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "epubinfo/arena.h"
 #include "epubinfo/xml.h"
 
-/// Gets the name of a tag
-char *xml_tag_get_name(Arena *arena, char *tag) {
-    assert(tag[0] == '<');
+static int xml_is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+XmlValueSlice xml_slice_tag_name(XmlValueSlice tag) {
+    XmlValueSlice name = {0};
+    if (tag.len < 2 || tag.text[0] != '<') return name;
 
     // close tag starts at 2
     // open/self close tag starts at 1
-    size_t start_index = tag[1] == '/' ? 2 : 1;
-
-    int end = xml_find_offset(' ', &tag[start_index]);
-    if (end == -1) end = xml_find_offset('>', &tag[start_index]);
-    if (end == -1) return NULL; // malformed tag
+    size_t start = tag.text[1] == '/' ? 2 : 1;
+    size_t end = start;
+    while (end < tag.len) {
+        char c = tag.text[end];
+        if (xml_is_space(c) || c == '/' || c == '>') break;
+        end++;
+    }
 
-    int len = end;
-    char *name = arena_alloc(arena, len + 1, alignof(char));
-    memcpy(name, &tag[start_index], len);
-    name[len] = '\0';
+    name.text = &tag.text[start];
+    name.len = end - start;
     return name;
 }
 
-/// Gets the value of an attribute in a tag
-char *xml_tag_get_attribute(Arena *arena, char *tag, char *name) {
-    const char *res = strstr(tag, name);
-    if (res == NULL) {
-        return 0;
+XmlValueSlice xml_slice_local_name(XmlValueSlice name, XmlValueSlice *prefix) {
+    const char *colon = memchr(name.text, ':', name.len);
+    XmlValueSlice local = name;
+    if (prefix) {
+        prefix->text = name.text;
+        prefix->len = colon ? (size_t)(colon - name.text) : 0;
     }
-    int cursor = res - tag + strlen(name);
+    if (colon) {
+        local.text = colon + 1;
+        local.len = name.len - (colon + 1 - name.text);
+    }
+    return local;
+}
 
-    if (tag[cursor] != '=') {
-        printf("invalid attribute/tag, `=` not found \n");
-        return 0;
+int xml_slice_next_attribute(XmlValueSlice tag, size_t *offset, XmlValueSlice *name, XmlValueSlice *value) {
+    XmlValueSlice tag_name = xml_slice_tag_name(tag);
+    if (tag_name.text == NULL) return 0;
+
+    const char *cursor = *offset ? tag.text + *offset : tag_name.text + tag_name.len;
+    const char *end = tag.text + tag.len;
+
+    while (cursor < end) {
+        while (cursor < end && xml_is_space(*cursor)) cursor++;
+
+        // attribute name
+        const char *attr = cursor;
+        while (cursor < end && *cursor != '=' && *cursor != '>' && *cursor != '/' && !xml_is_space(*cursor)) cursor++;
+        size_t attr_len = cursor - attr;
+        if (attr_len == 0) {
+            cursor++; // '/', '>' or stray '='
+            continue;
+        }
+
+        while (cursor < end && xml_is_space(*cursor)) cursor++;
+        if (cursor == end || *cursor != '=') continue; // attribute without value
+        cursor++;
+        while (cursor < end && xml_is_space(*cursor)) cursor++;
+        if (cursor == end || (*cursor != '"' && *cursor != '\'')) return 0;
+
+        char quote = *cursor++;
+        const char *closing = memchr(cursor, quote, end - cursor);
+        if (closing == NULL) return 0;
+
+        name->text = attr;
+        name->len = attr_len;
+        value->text = cursor;
+        value->len = closing - cursor;
+        *offset = closing + 1 - tag.text;
+        return 1;
     }
-    cursor += 1;
 
-    const char *equal_sign = strchr(&tag[cursor + 2], '"');
-    if (equal_sign == NULL) {
-        printf("invalid atribute/tag, `\"` not found.\n");
-        return 0;
+    *offset = tag.len;
+    return 0;
+}
+
+int xml_slice_tag_attribute(XmlValueSlice tag, const char *name, XmlValueSlice *value) {
+    size_t offset = 0;
+    XmlValueSlice attr;
+    while (xml_slice_next_attribute(tag, &offset, &attr, value)) {
+        if (xml_slice_equals(attr, name)) return 1;
     }
+    return 0;
+}
 
-    int start = cursor + 1; // skip "
-    int end = equal_sign - tag; // ignore ""
-    int len = end - start;
+int xml_slice_equals(XmlValueSlice slice, const char *str) {
+    size_t len = strlen(str);
+    return slice.len == len && memcmp(slice.text, str, len) == 0;
+}
+
+char *xml_slice_dup(Arena *arena, XmlValueSlice slice) {
+    char *str = arena_alloc(arena, slice.len + 1, alignof(char));
+    if (str == NULL) return NULL;
+    memcpy(str, slice.text, slice.len);
+    str[slice.len] = '\0';
+    return str;
+}
 
-    char *attribute = arena_alloc(arena, sizeof(char) * len + 1, alignof(char));
-    memcpy(attribute, &tag[start], len);
-    attribute[len] = 0;
+static XmlValueSlice xml_slice_from_tag(char *tag) {
+    XmlValueSlice slice = { tag, strlen(tag) };
+    return slice;
+}
 
-    return attribute;
+/// Gets the name of a tag
+char *xml_tag_get_name(Arena *arena, char *tag) {
+    assert(tag[0] == '<');
+
+    XmlValueSlice name = xml_slice_tag_name(xml_slice_from_tag(tag));
+    if (name.text == NULL) return NULL; // malformed tag
+    return xml_slice_dup(arena, name);
+}
+
+/// Gets the value of an attribute in a tag
+char *xml_tag_get_attribute(Arena *arena, char *tag, char *name) {
+    XmlValueSlice value;
+    if (!xml_slice_tag_attribute(xml_slice_from_tag(tag), name, &value)) return NULL;
+    return xml_slice_dup(arena, value);
 }
 
 /// Returns the XML tag type
@@ -77,68 +148,233 @@ int xml_find_offset(char c, char *content) {
     return res - content;
 }
 
-/// Doesn't free any resource from the arena.
-/// XmlValue.content is allocated in the arena.
-XmlValue xml_next(Arena *arena, XmlParser *parser) {
+void xml_parser_init(XmlParser *parser, char *content, size_t length) {
+    parser->cursor = 0;
+    parser->content = content;
+    parser->length = length;
+    parser->partial = 0;
+    parser->scanner = xml_scanner_best();
+}
+
+size_t xml_parser_compact(XmlParser *parser) {
+    size_t left = parser->length - parser->cursor;
+    memmove(parser->content, &parser->content[parser->cursor], left);
+    parser->cursor = 0;
+    parser->length = left;
+    return left;
+}
+
+/// Returns the offset of `seq` in `content[0..len)`, -1 if not found.
+static long xml_find_sequence(const char *content, size_t len, const char *seq, size_t seq_len) {
+    const char *cursor = content;
+    const char *end = content + len;
+    while ((size_t)(end - cursor) >= seq_len) {
+        cursor = memchr(cursor, seq[0], end - cursor - seq_len + 1);
+        if (cursor == NULL) return -1;
+        if (memcmp(cursor, seq, seq_len) == 0) return cursor - content;
+        cursor++;
+    }
+    return -1;
+}
+
+/// Returns the offset of the '>' closing the tag starting at `tag[0]`.
+/// Quoted attribute values, comments and CDATA sections may contain '>'.
+/// Returns -1 if the tag doesn't end in `tag[0..len)`.
+static long xml_find_tag_end(const XmlScanner *scanner, const char *tag, size_t len) {
+    static const char comment[] = "<!--";
+    static const char cdata[] = "<![CDATA[";
+
+    if (len > 1 && tag[1] == '!') {
+        // wait until there are enough bytes to tell a comment or CDATA apart
+        size_t n = len < sizeof(cdata) - 1 ? len : sizeof(cdata) - 1;
+        if (memcmp(tag, cdata, n) == 0) {
+            if (n < sizeof(cdata) - 1) return -1;
+            long end = xml_find_sequence(tag, len, "]]>", 3);
+            return end < 0 ? -1 : end + 2;
+        }
+
+        n = len < sizeof(comment) - 1 ? len : sizeof(comment) - 1;
+        if (memcmp(tag, comment, n) == 0) {
+            if (n < sizeof(comment) - 1) return -1;
+            long end = xml_find_sequence(&tag[4], len - 4, "-->", 3);
+            return end < 0 ? -1 : end + 4 + 2;
+        }
+    }
+
+    size_t end = scanner->tag_end(tag, len);
+    return end == len ? -1 : (long)end;
+}
+
+XmlToken xml_next_token(XmlParser *parser) {
 
-    assert(arena != NULL);
     assert(parser != NULL);
     assert(parser->content != NULL);
 
-    XmlValue value = {0};
+    XmlToken token = {0};
+    const XmlScanner *scanner = parser->scanner ? parser->scanner : &xml_scanner_scalar;
+    size_t begin = parser->cursor; // restored on PARTIAL_TAG, the skipped whitespace is kept
 
-    while (parser->content[parser->cursor]) {
+    // indentation is usually a few bytes, only long runs go through the scanner
+    for (int i = 0; i < 8 && parser->cursor < parser->length; i++) {
         char c = parser->content[parser->cursor];
-        if (c == '\n' || c == '\r' || c == ' ' || c == '\t') {
-            parser->cursor++;
-            continue;
+        if (!xml_is_space(c)) break;
+        parser->cursor++;
+        if (i == 7) {
+            parser->cursor += scanner->whitespace(&parser->content[parser->cursor], parser->length - parser->cursor);
         }
+    }
+
+    if (parser->cursor == parser->length) {
+        if (parser->partial) parser->cursor = begin;
+        token.type = parser->partial ? PARTIAL_TAG : EOF_TAG;
+        return token;
+    }
+
+    char *start = &parser->content[parser->cursor];
+    size_t available = parser->length - parser->cursor;
+    size_t len;
 
-        switch (c) {
-            case '<': {
-                int offset = xml_find_offset('>', &parser->content[parser->cursor]);
-                if (offset < 0) {
-                    value.type = ERROR_TAG;
-                    return value;
-                }
-                int len = offset + 1; // include '>'
-                char *str = arena_alloc(arena, len + 1, alignof(char));
-                memcpy(str, &parser->content[parser->cursor], len);
-                str[len] = '\0';
-                parser->cursor += len;
-
-                value.content = str;
-                value.type = get_tag_type(str, len);
-                return value;
-            }
-
-
-            case '&': {
-
-                printf("unhandled character: &\n");
-                parser->cursor++;
-                break;
-            }
-
-
-            default: {
-                int end = xml_find_offset('<', &parser->content[parser->cursor]);
-                if (end < 0) {
-                    end = strlen(&parser->content[parser->cursor]);
-                }
-                int len = end;
-                char *str = arena_alloc(arena, len + 1, alignof(char));
-                memcpy(str, &parser->content[parser->cursor], len);
-                str[len] = '\0';
-                parser->cursor += len;
-
-                value.content = str;
-                value.type = TEXT_TAG;
-                return value;
-            }
+    if (*start == '<') {
+        long end = xml_find_tag_end(scanner, start, available);
+        if (end < 0) {
+            if (parser->partial) parser->cursor = begin;
+            token.type = parser->partial ? PARTIAL_TAG : ERROR_TAG;
+            return token;
+        }
+        len = end + 1; // include '>'
+        token.type = get_tag_type(start, len);
+    } else {
+        // entity references are kept as they are in the text
+        len = scanner->text_end(start, available);
+        if (len == available && parser->partial) {
+            parser->cursor = begin;
+            token.type = PARTIAL_TAG;
+            return token;
         }
+        token.type = TEXT_TAG;
     }
 
-    value.type = EOF_TAG;
+    parser->cursor += len;
+    token.value.text = start;
+    token.value.len = len;
+    return token;
+}
+
+/// Doesn't free any resource from the arena.
+/// XmlValue.content is allocated in the arena, it's `NULL` when there is no memory.
+XmlValue xml_next(Arena *arena, XmlParser *parser) {
+    assert(arena != NULL);
+
+    XmlToken token = xml_next_token(parser);
+    XmlValue value = { token.type, NULL };
+    if (token.value.text) value.content = xml_slice_dup(arena, token.value);
     return value;
 }
+
+// Writes `cp` as UTF-8, returns the number of bytes (1 to 4).
+static size_t xml_put_utf8(char *out, uint32_t cp) {
+    if (cp == 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) cp = 0xFFFD;
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | cp >> 6);
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | cp >> 12);
+        out[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | cp >> 18);
+    out[1] = (char)(0x80 | (cp >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (cp >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+// The XML entities and the HTML ones books use the most (XHTML 1.1 DTD).
+static const struct {
+    const char *name;
+    uint32_t cp;
+} xml_named_entities[] = {
+    { "amp", '&' }, { "lt", '<' }, { "gt", '>' }, { "quot", '"' }, { "apos", '\'' },
+    { "nbsp", 0xA0 }, { "shy", 0xAD }, { "copy", 0xA9 }, { "reg", 0xAE }, { "trade", 0x2122 },
+    { "ndash", 0x2013 }, { "mdash", 0x2014 }, { "hellip", 0x2026 }, { "middot", 0xB7 }, { "bull", 0x2022 },
+    { "lsquo", 0x2018 }, { "rsquo", 0x2019 }, { "ldquo", 0x201C }, { "rdquo", 0x201D },
+    { "laquo", 0xAB }, { "raquo", 0xBB },
+};
+
+// Longest reference read, ';' included: "&#x10FFFF;" with a couple of leading zeros.
+#define XML_REFERENCE_MAX 12
+
+// Decodes the reference at `ref[0]` ('&'), returns its length (';' included)
+// and sets `cp`, or returns 0 if it isn't a known, well formed reference.
+static size_t xml_decode_reference(const char *ref, size_t len, uint32_t *cp) {
+    size_t max = len < XML_REFERENCE_MAX ? len : XML_REFERENCE_MAX;
+    const char *semicolon = memchr(ref, ';', max);
+    if (!semicolon) return 0;
+    size_t ref_len = semicolon - ref + 1;
+
+    if (ref_len > 3 && ref[1] == '#') {
+        int hex = ref[2] == 'x' || ref[2] == 'X';
+        uint32_t value = 0;
+        for (const char *c = &ref[2 + hex]; c < semicolon; c++) {
+            int digit;
+            if (*c >= '0' && *c <= '9') digit = *c - '0';
+            else if (hex && *c >= 'a' && *c <= 'f') digit = *c - 'a' + 10;
+            else if (hex && *c >= 'A' && *c <= 'F') digit = *c - 'A' + 10;
+            else return 0;
+            value = value * (hex ? 16 : 10) + digit;
+            if (value > 0x10FFFF) value = 0x110000; // stays out of range, no overflow
+        }
+        if (&ref[2 + hex] == semicolon) return 0;
+        *cp = value;
+        return ref_len;
+    }
+
+    for (size_t i = 0; i < sizeof(xml_named_entities) / sizeof(xml_named_entities[0]); i++) {
+        size_t name_len = strlen(xml_named_entities[i].name);
+        if (name_len == ref_len - 2 && memcmp(&ref[1], xml_named_entities[i].name, name_len) == 0) {
+            *cp = xml_named_entities[i].cp;
+            return ref_len;
+        }
+    }
+    return 0;
+}
+
+size_t xml_decode_entities(const char *text, size_t len, char *out) {
+    size_t in = 0, written = 0;
+    while (in < len) {
+        const char *amp = memchr(&text[in], '&', len - in);
+        size_t run = amp ? (size_t)(amp - &text[in]) : len - in;
+        memmove(&out[written], &text[in], run);
+        written += run;
+        in += run;
+        if (!amp) break;
+
+        uint32_t cp;
+        size_t ref_len = xml_decode_reference(&text[in], len - in, &cp);
+        if (ref_len == 0) {
+            out[written++] = '&'; // kept as is
+            in += 1;
+            continue;
+        }
+        // a reference is never shorter than its UTF-8 encoding
+        written += xml_put_utf8(&out[written], cp);
+        in += ref_len;
+    }
+    return written;
+}
+
+size_t xml_partial_reference(const char *text, size_t len) {
+    size_t stop = len < XML_REFERENCE_MAX - 1 ? 0 : len - (XML_REFERENCE_MAX - 1);
+    for (size_t i = len; i > stop; i--) {
+        if (text[i - 1] == ';') return 0;
+        if (text[i - 1] == '&') return len - (i - 1);
+    }
+    return 0;
+}
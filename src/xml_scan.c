@@ -0,0 +1,210 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "epubinfo/xml.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XML_SCAN_X86 1
+#endif
+
+static const unsigned char whitespace_table[256] = {
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1,
+};
+
+// `*quote` is the quote character the scan is inside of, 0 if none.
+// It's carried between the vector blocks and the scalar tail.
+static size_t scalar_tag_end_from(const char *content, size_t i, size_t len, char *quote) {
+    for (; i < len; i++) {
+        char c = content[i];
+        if (*quote) {
+            if (c == *quote) *quote = 0;
+        } else if (c == '>') {
+            return i;
+        } else if (c == '"' || c == '\'') {
+            *quote = c;
+        }
+    }
+    return len;
+}
+
+static size_t scalar_tag_end(const char *content, size_t len) {
+    char quote = 0;
+    return scalar_tag_end_from(content, 0, len, &quote);
+}
+
+static size_t scalar_text_end(const char *content, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (content[i] == '<') return i;
+    }
+    return len;
+}
+
+static size_t scalar_whitespace(const char *content, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!whitespace_table[(unsigned char)content[i]]) return i;
+    }
+    return len;
+}
+
+#ifdef XML_SCAN_X86
+
+// Bit i of the result is the xor of bits 0..i of `x`.
+static inline unsigned prefix_xor(unsigned x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    return x;
+}
+
+// Finds the '>' closing a tag inside one block of `bits` bytes.
+// `gt`, `dq` and `sq` have a bit set for every '>', '"' and '\'' of the block.
+// `*quote` is the quote the block starts inside of (0 if none) and it's
+// updated to the state at the end of the block.
+// Returns the bit index of the closing '>', -1 if the tag doesn't end in the block.
+static inline int tag_end_in_block(unsigned gt, unsigned dq, unsigned sq, int bits, char *quote) {
+    // With a single quote kind in play, the bytes inside quotes are the
+    // prefix xor of the quote bits, no need to walk them one by one.
+    if (!sq && *quote != '\'') {
+        unsigned inside = prefix_xor(dq) ^ (*quote ? ~0u : 0u);
+        unsigned outside = gt & ~inside;
+        if (outside) return __builtin_ctz(outside);
+        *quote = (inside >> (bits - 1)) & 1 ? '"' : 0;
+        return -1;
+    }
+    if (!dq && *quote != '"') {
+        unsigned inside = prefix_xor(sq) ^ (*quote ? ~0u : 0u);
+        unsigned outside = gt & ~inside;
+        if (outside) return __builtin_ctz(outside);
+        *quote = (inside >> (bits - 1)) & 1 ? '\'' : 0;
+        return -1;
+    }
+
+    // both kinds of quotes, walk the bits in order
+    unsigned mask = gt | dq | sq;
+    while (mask) {
+        int bit = __builtin_ctz(mask);
+        unsigned b = 1u << bit;
+        if (*quote) {
+            if ((*quote == '"' && (dq & b)) || (*quote == '\'' && (sq & b))) *quote = 0;
+        } else if (gt & b) {
+            return bit;
+        } else {
+            *quote = (dq & b) ? '"' : '\'';
+        }
+        mask &= mask - 1;
+    }
+    return -1;
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_tag_end(const char *content, size_t len) {
+    char quote = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&content[i]);
+        unsigned gt = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+        unsigned dq = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+        unsigned sq = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+        int bit = tag_end_in_block(gt, dq, sq, 16, &quote);
+        if (bit >= 0) return i + bit;
+    }
+    return scalar_tag_end_from(content, i, len, &quote);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_text_end(const char *content, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&content[i]);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scalar_text_end(&content[i], len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t sse2_whitespace(const char *content, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&content[i]);
+        __m128i ws = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        int mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scalar_whitespace(&content[i], len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_tag_end(const char *content, size_t len) {
+    char quote = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&content[i]);
+        unsigned gt = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+        unsigned dq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')));
+        unsigned sq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\'')));
+        int bit = tag_end_in_block(gt, dq, sq, 32, &quote);
+        if (bit >= 0) return i + bit;
+    }
+    return scalar_tag_end_from(content, i, len, &quote);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_lt_mask(__m256i v) {
+    return _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<'));
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_text_end(const char *content, size_t len) {
+    size_t i = 0;
+    // text runs can be long (descriptions, chapters), check 128 bytes per branch
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = avx2_lt_mask(_mm256_loadu_si256((const __m256i *)&content[i]));
+        __m256i b = avx2_lt_mask(_mm256_loadu_si256((const __m256i *)&content[i + 32]));
+        __m256i c = avx2_lt_mask(_mm256_loadu_si256((const __m256i *)&content[i + 64]));
+        __m256i d = avx2_lt_mask(_mm256_loadu_si256((const __m256i *)&content[i + 96]));
+        __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+        if (_mm256_testz_si256(any, any)) continue;
+
+        uint64_t low = (uint32_t)_mm256_movemask_epi8(a) | (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+        if (low) return i + __builtin_ctzll(low);
+        uint64_t high = (uint32_t)_mm256_movemask_epi8(c) | (uint64_t)(uint32_t)_mm256_movemask_epi8(d) << 32;
+        return i + 64 + __builtin_ctzll(high);
+    }
+    for (; i + 32 <= len; i += 32) {
+        unsigned mask = _mm256_movemask_epi8(avx2_lt_mask(_mm256_loadu_si256((const __m256i *)&content[i])));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + sse2_text_end(&content[i], len - i);
+}
+
+// Whitespace runs are short (indentation), 16 bytes at a time is enough.
+#define avx2_whitespace sse2_whitespace
+
+#else
+
+#define sse2_tag_end scalar_tag_end
+#define sse2_text_end scalar_text_end
+#define sse2_whitespace scalar_whitespace
+#define avx2_tag_end scalar_tag_end
+#define avx2_text_end scalar_text_end
+#define avx2_whitespace scalar_whitespace
+
+#endif
+
+const XmlScanner xml_scanner_scalar = { scalar_tag_end, scalar_text_end, scalar_whitespace, "scalar" };
+const XmlScanner xml_scanner_sse2 = { sse2_tag_end, sse2_text_end, sse2_whitespace, "sse2" };
+const XmlScanner xml_scanner_avx2 = { avx2_tag_end, avx2_text_end, avx2_whitespace, "avx2" };
+
+const XmlScanner *xml_scanner_best(void) {
+#ifdef XML_SCAN_X86
+    if (__builtin_cpu_supports("avx2")) return &xml_scanner_avx2;
+    if (__builtin_cpu_supports("sse2")) return &xml_scanner_sse2;
+#endif
+    return &xml_scanner_scalar;
+}
@@ -1,26 +1,125 @@
-#include <stdio.h>
-#include <time.h>
+#define _GNU_SOURCE // copy_file_range
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <zlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include "epubinfo/crc32.h"
 #include "epubinfo/zip.h"
+#ifdef ZIP_ONESHOT_INFLATE
+#include "epubinfo/inflate.h"
+#endif
 
 uint16_t read_le16(const unsigned char *p) {
     return p[0] | (p[1] << 8);
 }
 
 uint32_t read_le32(const unsigned char *p) {
-    return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint64_t read_le64(const unsigned char *p) {
+    return read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+// Fills `header` from the ZIP64 record pointed by the locator that ends at `eocdr_offset`,
+// `header` is left untouched if there is no valid record.
+// `eocdr_offset` is absolute.
+static int zip_read_zip64_eocdr(const ZipArchive *za, uint64_t eocdr_offset, ZipEocdrHeader *header) {
+    if (eocdr_offset < ZIP64_EOCDL_LEN + ZIP64_EOCDR_LEN_FIXED) return 0;
+    if (!zip_archive_contains(za, eocdr_offset - ZIP64_EOCDL_LEN, ZIP64_EOCDL_LEN)) return 0;
+    const unsigned char *locator = &za->data[eocdr_offset - ZIP64_EOCDL_LEN - za->base];
+    if (read_le32(locator) != ZIP64_EOCDL_SIGNATURE) return 0;
+
+    uint64_t offset = read_le64(&locator[ZIP64_EOCDL_OFF_EOCDR_OFFSET]);
+    if (offset > eocdr_offset - ZIP64_EOCDL_LEN - ZIP64_EOCDR_LEN_FIXED) return 0;
+    if (!zip_archive_contains(za, offset, ZIP64_EOCDR_LEN_FIXED)) return 0;
+
+    const unsigned char *record = &za->data[offset - za->base];
+    if (read_le32(record) != ZIP64_EOCDR_SIGNATURE) return 0;
+
+    // parsed aside, a rejected record must leave the values of the EOCDR untouched
+    ZipEocdrHeader zip64;
+    zip64.disk_num            = read_le32(&record[ZIP64_EOCDR_OFF_DISK_NUM]);
+    zip64.start_cent_dir_disk = read_le32(&record[ZIP64_EOCDR_OFF_START_CDIR_DISK]);
+    zip64.num_of_entries_disk = read_le64(&record[ZIP64_EOCDR_OFF_ENTRIES_DISK]);
+    zip64.num_of_entries      = read_le64(&record[ZIP64_EOCDR_OFF_TOTAL_ENTRIES]);
+    zip64.size_cent_dir       = read_le64(&record[ZIP64_EOCDR_OFF_CDIR_SIZE]);
+    zip64.cent_dir_offset     = read_le64(&record[ZIP64_EOCDR_OFF_CDIR_OFFSET]);
+
+    // the central directory must end before the ZIP64 record
+    if (zip64.cent_dir_offset > offset || zip64.size_cent_dir > offset - zip64.cent_dir_offset) return 0;
+    *header = zip64;
+    return 1;
 }
 
 // public
-int zip_valid_header(FILE *fp) {
-    unsigned char header_buffer[ZIP_HEADER_LEN];
-    fread(header_buffer, sizeof(unsigned char), ZIP_HEADER_LEN, fp);
+int zip_archive_open(ZipArchive *za, const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    // the fd is kept for kernel side copies (zip_entry_extract_to_fd)
+    za->data = data;
+    za->size = st.st_size;
+    za->mapped = 1;
+    za->fd = fd;
+    za->base = 0;
+    za->archive_size = st.st_size;
+    return 1;
+}
+
+void zip_archive_from_memory(ZipArchive *za, const void *data, size_t size) {
+    zip_archive_window(za, data, size, 0, size);
+}
+
+void zip_archive_window(ZipArchive *za, const void *data, size_t size, uint64_t base, uint64_t archive_size) {
+    za->data = data;
+    za->size = size;
+    za->mapped = 0;
+    za->fd = -1;
+    za->base = base;
+    za->archive_size = archive_size;
+}
+
+int zip_archive_contains(const ZipArchive *za, uint64_t offset, uint64_t len) {
+    return offset >= za->base && offset - za->base <= za->size && len <= za->size - (offset - za->base);
+}
+
+void zip_archive_close(ZipArchive *za) {
+    if (za->mapped && za->data) munmap((void *)za->data, za->size);
+    if (za->mapped) close(za->fd);
+    za->data = NULL;
+    za->size = 0;
+    za->mapped = 0;
+}
+
+int zip_valid_header(const ZipArchive *za) {
+    if (za->base != 0 || za->size < ZIP_HEADER_LEN) return 0;
+    const unsigned char *header_buffer = za->data;
     return header_buffer[0] == 0x50 && header_buffer[1] == 0x4b && header_buffer[2] == 0x03 && header_buffer[3] == 0x04;
 }
 
-int zip_read_end_of_central_directory_record(FILE *fp, ZipEocdrHeader *header) {
+int zip_read_end_of_central_directory_record(const ZipArchive *za, ZipEocdrHeader *header) {
     // Bytes | Description
     // ------+-------------------------------------------------------------------------
     //     4 | Signature (0x06054b50)
@@ -35,48 +134,111 @@ int zip_read_end_of_central_directory_record(FILE *fp, ZipEocdrHeader *header) {
     // ------+--------------------
     //  22+n + Total length
 
-    const int BUFFER_SIZE = 2048;
-    unsigned char buffer[BUFFER_SIZE];
+    if (za->size < EOCDR_LEN_NO_COMMENT || za->base + za->size != za->archive_size) return 0;
+
+    // The record is at the end of the file, followed only by its comment,
+    // so it can't start before the last 64 KiB + 22 bytes.
+    size_t last = za->size - EOCDR_LEN_NO_COMMENT;
+    size_t first = last > EOCDR_MAX_COMMENT_LEN ? last - EOCDR_MAX_COMMENT_LEN : 0;
 
-    fseek(fp, 0, SEEK_END);
-    long filesize = ftell(fp);
-    long position = filesize > BUFFER_SIZE ? filesize - BUFFER_SIZE : 0;
-    long signature_start_position = -1;
+    for (size_t i = last + 1; i-- > first;) {
+        const unsigned char *buffer = &za->data[i];
+        if (buffer[0] != 0x50 || read_le32(buffer) != EOCDR_SIGNATURE) continue;
 
-    while (position >= 0) {
-        fseek(fp, position, SEEK_SET);
-        size_t bytes_read = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, fp);
+        // comment must fit in the remaining bytes
+        uint16_t comment_len = read_le16(&buffer[EOCDR_OFF_COMMENT_LEN]);
+        if (comment_len > last - i) continue;
+
+        header->disk_num            = read_le16(&buffer[EOCDR_OFF_DISK_NUM]);
+        header->start_cent_dir_disk = read_le16(&buffer[EOCDR_OFF_START_CDIR_DISK]);
+        header->num_of_entries_disk = read_le16(&buffer[EOCDR_OFF_ENTRIES_DISK]);
+        header->num_of_entries      = read_le16(&buffer[EOCDR_OFF_TOTAL_ENTRIES]);
+        header->size_cent_dir       = read_le32(&buffer[EOCDR_OFF_CDIR_SIZE]);
+        header->cent_dir_offset     = read_le32(&buffer[EOCDR_OFF_CDIR_OFFSET]);
+
+        // any saturated field means the real values live in the ZIP64 record
+        int zip64 = header->num_of_entries == ZIP64_MARKER_16
+            || header->size_cent_dir == ZIP64_MARKER_32
+            || header->cent_dir_offset == ZIP64_MARKER_32;
+
+        uint64_t record_offset = za->base + i;
+        if (zip_read_zip64_eocdr(za, record_offset, header)) return 1;
+        if (zip64) continue;
+
+        // the central directory must end before the record
+        if (header->cent_dir_offset > record_offset || header->size_cent_dir > record_offset - header->cent_dir_offset) continue;
+        return 1;
+    }
+
+    return 0;
+}
 
-        // find eocd logic and return if found
-        for (size_t i = 0; i < bytes_read - EOCDR_SIGNATURE_LEN + 1; i++) {
-            uint32_t found_signature = *(uint32_t *)(buffer + i);
-            if (found_signature == EOCDR_SIGNATURE) {
-                signature_start_position = position + i;
-                break;
+// Replaces the saturated 32 bits fields of `entry` with the ones in the
+// ZIP64 extra field. Only saturated fields are present, in this order.
+static void zip_apply_zip64_extra(ZipEntry *entry, const unsigned char *extra, uint16_t extra_len) {
+    size_t cursor = 0;
+    while (extra_len - cursor >= 4) {
+        uint16_t id = read_le16(&extra[cursor]);
+        uint16_t len = read_le16(&extra[cursor + 2]);
+        cursor += 4;
+        if (len > extra_len - cursor) return;
+
+        if (id == ZIP64_EXTRA_ID) {
+            const unsigned char *field = &extra[cursor];
+            const unsigned char *end = field + len;
+            if (entry->uncompressed_size == ZIP64_MARKER_32 && end - field >= 8) {
+                entry->uncompressed_size = read_le64(field);
+                field += 8;
             }
+            if (entry->compressed_size == ZIP64_MARKER_32 && end - field >= 8) {
+                entry->compressed_size = read_le64(field);
+                field += 8;
+            }
+            if (entry->file_offset == ZIP64_MARKER_32 && end - field >= 8) {
+                entry->file_offset = read_le64(field);
+            }
+            return;
         }
-
-        position -= (BUFFER_SIZE - EOCDR_SIGNATURE_LEN);
+        cursor += len;
     }
+}
 
-    if (signature_start_position == -1) {
-        printf("Signature not found\n");
-        return 0;
+// FNV-1a
+static uint32_t zip_hash_name(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    fseek(fp, signature_start_position, SEEK_SET);
-    fread(buffer, sizeof(unsigned char), EOCDR_LEN_NO_COMMENT, fp);
+// Directories aren't indexed and the first entry wins on duplicated names.
+static void zip_index_insert(ZipDirectory *dir, size_t i) {
+    const ZipEntry *entry = &dir->entries[i];
+    const char *name = &dir->names[entry->filename_offset];
+    if (entry->filename_len == 0 || name[entry->filename_len - 1] == '/') return;
+
+    uint32_t hash = zip_hash_name(name, entry->filename_len);
+    size_t mask = dir->index_capacity - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        ZipIndexSlot *s = &dir->index[slot];
+        if (s->entry == 0) {
+            s->hash = hash;
+            s->entry = i + 1;
+            return;
+        }
 
-    header->disk_num            = read_le16(&buffer[EOCDR_OFF_DISK_NUM]);
-    header->start_cent_dir_disk = read_le16(&buffer[EOCDR_OFF_START_CDIR_DISK]);
-    header->num_of_entries_disk = read_le16(&buffer[EOCDR_OFF_ENTRIES_DISK]);
-    header->num_of_entries      = read_le16(&buffer[EOCDR_OFF_TOTAL_ENTRIES]);
-    header->size_cent_dir       = read_le32(&buffer[EOCDR_OFF_CDIR_SIZE]);
-    header->cent_dir_offset     = read_le32(&buffer[EOCDR_OFF_CDIR_OFFSET]);
-    return 1;
+        const ZipEntry *other = &dir->entries[s->entry - 1];
+        if (s->hash == hash && other->filename_len == entry->filename_len
+            && memcmp(&dir->names[other->filename_offset], name, entry->filename_len) == 0) {
+            return;
+        }
+    }
 }
 
-ZipEntry* zip_read_central_directory(FILE *fp, ZipEocdrHeader header) {
+int zip_read_central_directory(const ZipArchive *za, const ZipEocdrHeader *header, ZipDirectory *dir,
+                               const EpubAllocator *allocator) {
     // Bytes | Description
     // ------+-------------------------------------------------------------------------
     //     4 | Signature (0x02014b50)
@@ -102,91 +264,429 @@ ZipEntry* zip_read_central_directory(FILE *fp, ZipEocdrHeader header) {
     //     m | Extra field
     //     k | File comment
 
-    ZipEntry *entries = malloc(sizeof(ZipEntry) * header.num_of_entries);
-    if (!entries) return NULL;
+    if (!zip_archive_contains(za, header->cent_dir_offset, header->size_cent_dir)) return 0;
+    if (header->size_cent_dir > UINT32_MAX) return 0; // name offsets are 32 bits
+    // every record takes at least CDR_LEN_FIXED bytes
+    if (header->num_of_entries > header->size_cent_dir / CDR_LEN_FIXED) return 0;
+
+    // Names are copied with their null terminator. Each one comes from a
+    // record at least CDR_LEN_FIXED bytes long, so the directory size bounds the pool.
+    size_t count = header->num_of_entries;
+    size_t index_capacity = 16;
+    while (index_capacity < count * 2) index_capacity <<= 1;
+
+    size_t entries_size = sizeof(ZipEntry) * count;
+    size_t index_size = sizeof(ZipIndexSlot) * index_capacity;
+    unsigned char *block = epub_malloc(allocator, entries_size + index_size + header->size_cent_dir);
+    if (!block) return 0;
+
+    dir->allocator = allocator;
+    dir->entries = (ZipEntry *)block;
+    dir->num_of_entries = count;
+    dir->index = (ZipIndexSlot *)(block + entries_size);
+    dir->index_capacity = index_capacity;
+    dir->names = (char *)(block + entries_size + index_size);
+    memset(dir->index, 0, index_size);
+
+    const unsigned char *cursor = &za->data[header->cent_dir_offset - za->base];
+    const unsigned char *end = cursor + header->size_cent_dir;
+    size_t names_len = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (end - cursor < CDR_LEN_FIXED) goto truncated;
+        if (read_le32(cursor) != CDR_OFF_SIGNATURE) goto truncated;
+
+        uint16_t filename_len = read_le16(&cursor[CDR_OFF_FILENAME_LEN]);
+        uint16_t extra_len = read_le16(&cursor[CDR_OFF_EXTRA_FIELD_LEN]);
+        uint16_t comment_len = read_le16(&cursor[CDR_OFF_FILE_COMMENT_LEN]);
+        if (end - cursor - CDR_LEN_FIXED < filename_len + extra_len + comment_len) goto truncated;
+
+        ZipEntry *entry = &dir->entries[i];
+        entry->file_offset = read_le32(&cursor[CDR_OFF_FILE_HEADER]);
+        entry->compression_method = read_le16(&cursor[CDR_OFF_COMPRESSION_METHOD]);
+        entry->crc32 = read_le32(&cursor[CDR_OFF_CRC32]);
+        entry->compressed_size = read_le32(&cursor[CDR_OFF_COMPRESSED_SIZE]);
+        entry->uncompressed_size = read_le32(&cursor[CDR_OFF_UNCOMPRESSED_SIZE]);
+        entry->filename_len = filename_len;
+        entry->filename_offset = names_len;
+        zip_apply_zip64_extra(entry, &cursor[CDR_OFF_FILENAME + filename_len], extra_len);
+
+        memcpy(&dir->names[names_len], &cursor[CDR_OFF_FILENAME], filename_len);
+        dir->names[names_len + filename_len] = '\0';
+        names_len += filename_len + 1;
+
+        zip_index_insert(dir, i);
+        cursor += CDR_LEN_FIXED + filename_len + extra_len + comment_len;
+    }
+
+    return 1;
+
+truncated:
+    zip_directory_free(dir);
+    return 0;
+}
+
+void zip_directory_free(ZipDirectory *dir) {
+    epub_free(dir->allocator, dir->entries);
+    dir->entries = NULL;
+    dir->num_of_entries = 0;
+    dir->names = NULL;
+    dir->index = NULL;
+    dir->index_capacity = 0;
+}
+
+const char *zip_entry_filename(const ZipDirectory *dir, const ZipEntry *entry) {
+    return &dir->names[entry->filename_offset];
+}
+
+const unsigned char *zip_entry_raw_data(const ZipArchive *za, const ZipEntry *entry) {
+    // The local header repeats name and extra field, but the extra field
+    // length may differ from the central directory one, so read it here.
+    if (!zip_archive_contains(za, entry->file_offset, LFH_LEN_FIXED)) return NULL;
+
+    const unsigned char *lfh = &za->data[entry->file_offset - za->base];
+    if (read_le32(lfh) != LFH_SIGNATURE) return NULL;
 
-    size_t offset = header.cent_dir_offset;
+    uint64_t offset = entry->file_offset + LFH_LEN_FIXED + read_le16(&lfh[LFH_OFF_FILENAME_LEN]) + read_le16(&lfh[LFH_OFF_EXTRA_FIELD_LEN]);
+    if (!zip_archive_contains(za, offset, entry->compressed_size)) return NULL;
 
-    for (int i = 0; i < header.num_of_entries; i++) {
-        unsigned char buffer[CDR_LEN_FIXED];
-        fseek(fp, offset, SEEK_SET);
-        fread(buffer, sizeof(unsigned char), CDR_LEN_FIXED, fp);
+    return &za->data[offset - za->base];
+}
 
-        uint16_t filename_len = read_le16(&buffer[CDR_OFF_FILENAME_LEN]);
-        uint16_t extra_len = read_le16(&buffer[CDR_OFF_EXTRA_FIELD_LEN]);
-        uint16_t comment_len = read_le16(&buffer[CDR_OFF_FILE_COMMENT_LEN]);
+const char *zip_entry_stored_data(const ZipArchive *za, const ZipEntry *entry, size_t *len) {
+    if (entry->compression_method != ZIP_METHOD_STORED) return NULL;
 
-        ZipEntry entry;
-        entry.file_offset = read_le32(&buffer[CDR_OFF_FILE_HEADER]);
-        fread(entry.filename, sizeof(char), filename_len, fp);
-        entry.filename[filename_len] = 0;
-        entry.filename_len = filename_len;
+    const unsigned char *data = zip_entry_raw_data(za, entry);
+    if (data == NULL) return NULL;
 
-        entry.compression_method = read_le16(&buffer[CDR_OFF_COMPRESSION_METHOD]);
-        entry.compressed_size = read_le32(&buffer[CDR_OFF_COMPRESSED_SIZE]);
-        entry.uncompressed_size = read_le32(&buffer[CDR_OFF_UNCOMPRESSED_SIZE]);
-        entry.extra_field_len = extra_len;
+    *len = entry->compressed_size;
+    return (const char *)data;
+}
 
-        entries[i] = entry;
-        offset += CDR_LEN_FIXED + filename_len + extra_len + comment_len;
+static voidpf zip_zalloc(voidpf opaque, uInt items, uInt size) {
+    return epub_malloc(opaque, (size_t)items * size);
+}
+
+static void zip_zfree(voidpf opaque, voidpf address) {
+    epub_free(opaque, address);
+}
+
+int zip_inflater_reset(ZipInflater *inflater) {
+    if (inflater->initialized) return inflateReset(&inflater->strm) == Z_OK;
+
+    memset(&inflater->strm, 0, sizeof(inflater->strm));
+    if (inflater->allocator) {
+        inflater->strm.zalloc = zip_zalloc;
+        inflater->strm.zfree = zip_zfree;
+        inflater->strm.opaque = (voidpf)inflater->allocator;
     }
+    if (inflateInit2(&inflater->strm, -MAX_WBITS) != Z_OK) return 0;
+    inflater->initialized = 1;
+    return 1;
+}
 
-    return entries;
+void zip_inflater_free(ZipInflater *inflater) {
+    if (inflater->initialized) inflateEnd(&inflater->strm);
+    inflater->initialized = 0;
 }
 
-char *zip_uncompress_entry(FILE *fp, ZipEntry *entry) {
-    // clock_t t0 = clock();
-    fseek(fp, LFH_LEN_FIXED + entry->file_offset + entry->filename_len + entry->extra_field_len, SEEK_SET);
+int zip_entry_oneshot(const ZipEntry *entry) {
+#ifdef ZIP_ONESHOT_INFLATE
+    return entry->compression_method == ZIP_METHOD_DEFLATED && entry->uncompressed_size <= ZIP_ONESHOT_MAX;
+#else
+    (void)entry;
+    return 0;
+#endif
+}
+
+// Output handed to inflate() at once when a checksum is computed, so it's
+// still in cache when it's added to the CRC.
+#define ZIP_CRC_CHUNK 65536
+
+int zip_inflater_inflate(ZipInflater *inflater, const unsigned char *in, uint64_t in_len, unsigned char *out, uint64_t out_len,
+                         uint32_t *crc) {
+#ifdef ZIP_ONESHOT_INFLATE
+    if (out_len <= ZIP_ONESHOT_MAX && in_len <= SIZE_MAX) {
+        if (!inflate_oneshot(in, in_len, out, out_len)) return 0;
+        if (crc) *crc = zip_crc32(*crc, out, out_len);
+        return 1;
+    }
+#endif
+    if (!zip_inflater_reset(inflater)) return 0;
+
+    z_stream *strm = &inflater->strm;
+    strm->next_in = (Bytef *)in;
+    strm->next_out = out;
+    strm->avail_in = 0;
+    strm->avail_out = 0;
+
+    // z_stream counters are 32 bits wide, feed ZIP64 entries in pieces
+    uint64_t out_chunk = crc ? ZIP_CRC_CHUNK : UINT32_MAX;
+    int ret = Z_OK;
+    while (ret == Z_OK) {
+        if (strm->avail_in == 0) {
+            strm->avail_in = in_len > UINT32_MAX ? UINT32_MAX : (uInt)in_len;
+            in_len -= strm->avail_in;
+        }
+        if (strm->avail_out == 0) {
+            strm->avail_out = out_len > out_chunk ? (uInt)out_chunk : (uInt)out_len;
+            out_len -= strm->avail_out;
+        }
+
+        unsigned char *chunk = strm->next_out;
+        ret = inflate(strm, Z_NO_FLUSH);
+        if (crc) *crc = zip_crc32(*crc, chunk, strm->next_out - chunk);
+    }
+
+    // the stream must end exactly at the announced size
+    return ret == Z_STREAM_END && strm->avail_out == 0 && out_len == 0;
+}
 
-    unsigned char *compressed_data = malloc(entry->compressed_size);
+char *zip_inflater_uncompress_entry(ZipInflater *inflater, const ZipArchive *za, const ZipEntry *entry) {
+    const unsigned char *compressed_data = zip_entry_raw_data(za, entry);
     if (compressed_data == NULL) return NULL;
 
-    fread(compressed_data, sizeof(unsigned char), entry->compressed_size, fp);
-    char *output = malloc(entry->uncompressed_size);
+    if (entry->uncompressed_size >= SIZE_MAX) return NULL;
+    char *output = epub_malloc(inflater->allocator, (size_t)entry->uncompressed_size + 1);
     if (output == NULL) return NULL;
 
-    if (entry->compression_method == 0) {
-        memcpy(output, compressed_data, entry->uncompressed_size);
-    } else if (entry->compression_method == 8) {
-        z_stream strm = {0};
-        strm.next_in = compressed_data;
-        strm.avail_in = entry->compressed_size;
-        strm.next_out = (Bytef *)output;
-        strm.avail_out = entry->uncompressed_size;
-
-        if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
-            free(compressed_data);
-            free(output);
-            printf("error inflateInit2\n");
-            return NULL;
+    int ok = 0;
+    uint32_t crc = 0;
+    if (entry->compression_method == ZIP_METHOD_STORED) {
+        ok = entry->compressed_size == entry->uncompressed_size;
+        if (ok) memcpy(output, compressed_data, entry->uncompressed_size);
+        if (ok && inflater->verify) crc = zip_crc32(0, output, entry->uncompressed_size);
+    } else if (entry->compression_method == ZIP_METHOD_DEFLATED) {
+        ok = zip_inflater_inflate(inflater, compressed_data, entry->compressed_size,
+                                  (unsigned char *)output, entry->uncompressed_size, inflater->verify ? &crc : NULL);
+    }
+    if (inflater->verify && crc != entry->crc32) ok = 0;
+
+    if (!ok) {
+        epub_free(inflater->allocator, output);
+        return NULL;
+    }
+    output[entry->uncompressed_size] = '\0';
+    return output;
+}
+
+char *zip_uncompress_entry(const ZipArchive *za, const ZipEntry *entry) {
+    ZipInflater inflater = {0};
+    char *output = zip_inflater_uncompress_entry(&inflater, za, entry);
+    zip_inflater_free(&inflater);
+    return output;
+}
+
+int zip_entry_stream_open(ZipEntryStream *stream, const ZipArchive *za, const ZipEntry *entry,
+                          const EpubAllocator *allocator) {
+    memset(stream, 0, sizeof(*stream));
+    stream->inflater.allocator = allocator;
+    return zip_entry_stream_reset(stream, za, entry);
+}
+
+int zip_entry_stream_reset(ZipEntryStream *stream, const ZipArchive *za, const ZipEntry *entry) {
+    const unsigned char *input = zip_entry_raw_data(za, entry);
+    if (input == NULL) return 0;
+
+    stream->input = input;
+    stream->input_left = entry->compressed_size;
+    stream->output_left = entry->uncompressed_size;
+    stream->compression_method = entry->compression_method;
+    stream->started = 0;
+    stream->crc = 0;
+    stream->expected_crc = entry->crc32;
+
+    if (entry->compression_method == ZIP_METHOD_STORED) {
+        return entry->compressed_size == entry->uncompressed_size;
+    }
+
+    if (entry->compression_method != ZIP_METHOD_DEFLATED) return 0;
+    if (zip_entry_oneshot(entry)) return 1; // zlib is only set up if the first read is partial
+    if (!zip_inflater_reset(&stream->inflater)) return 0;
+    stream->inflater.strm.avail_in = 0;
+    return 1;
+}
+
+// Adds the `n` bytes just read to the checksum, the read that completes a
+// corrupt entry fails.
+static long zip_entry_stream_checked(ZipEntryStream *stream, const void *buf, size_t n) {
+    if (!stream->inflater.verify) return (long)n;
+    stream->crc = zip_crc32(stream->crc, buf, n);
+    if (stream->output_left == 0 && stream->crc != stream->expected_crc) return -1;
+    return (long)n;
+}
+
+long zip_entry_stream_read(ZipEntryStream *stream, void *buf, size_t len) {
+    if (len > LONG_MAX) len = LONG_MAX;
+    if (len > stream->output_left) len = stream->output_left;
+    if (len == 0) return zip_entry_stream_checked(stream, buf, 0); // empty entries have a CRC too
+
+    if (stream->compression_method == ZIP_METHOD_STORED) {
+        memcpy(buf, stream->input, len);
+        stream->input += len;
+        stream->output_left -= len;
+        return zip_entry_stream_checked(stream, buf, len);
+    }
+
+    z_stream *strm = &stream->inflater.strm;
+    if (!stream->started) {
+        stream->started = 1;
+#ifdef ZIP_ONESHOT_INFLATE
+        if (stream->output_left <= ZIP_ONESHOT_MAX) {
+            // `len` was capped to what's left, so the whole entry fits
+            if (len == stream->output_left) {
+                if (!inflate_oneshot(stream->input, stream->input_left, buf, len)) return -1;
+                stream->input += stream->input_left;
+                stream->input_left = 0;
+                stream->output_left = 0;
+                return zip_entry_stream_checked(stream, buf, len);
+            }
+            if (!zip_inflater_reset(&stream->inflater)) return -1;
+            strm->avail_in = 0;
         }
+#endif
+    }
 
-        int ret;
-        if ((ret = inflate(&strm, Z_FINISH)) != Z_STREAM_END) {
-            free(compressed_data);
-            free(output);
-            printf("error: inflate\n");
-            return NULL;
+    strm->next_out = buf;
+    strm->avail_out = len > UINT32_MAX ? UINT32_MAX : (uInt)len;
+    uInt requested = strm->avail_out;
+
+    while (strm->avail_out > 0) {
+        if (strm->avail_in == 0) {
+            if (stream->input_left == 0) return -1; // truncated deflate stream
+            strm->next_in = (Bytef *)stream->input;
+            strm->avail_in = stream->input_left > UINT32_MAX ? UINT32_MAX : (uInt)stream->input_left;
+            stream->input += strm->avail_in;
+            stream->input_left -= strm->avail_in;
         }
 
-        inflateEnd(&strm);
+        int ret = inflate(strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            // the stream ended before the size of the central directory
+            if (stream->output_left - (requested - strm->avail_out) > 0) return -1;
+            break;
+        }
+        if (ret != Z_OK) return -1;
     }
 
-    free(compressed_data);
-    // printf("[INFO] %.*s uncompressed in %0.2fms\n", entry->filename_len, entry->filename, 1000 * (double)(clock() - t0) / CLOCKS_PER_SEC);
-    return output;
+    size_t produced = requested - strm->avail_out;
+    stream->output_left -= produced;
+    return zip_entry_stream_checked(stream, buf, produced);
+}
+
+void zip_entry_stream_close(ZipEntryStream *stream) {
+    zip_inflater_free(&stream->inflater);
+}
+
+// Size of the buffer deflated entries are inflated into by zip_entry_extract_to_fd.
+#define ZIP_EXTRACT_CHUNK 65536
+// Inflated input is released from the mapping in steps of this size.
+#define ZIP_RELEASE_STEP (1 << 20)
+
+static int zip_write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Copies `len` bytes at `offset` of `in_fd` to `out_fd` inside the kernel.
+// Returns the number of bytes copied, it stops early when the kernel can't
+// copy between these files and the caller writes the rest itself.
+static uint64_t zip_copy_range(int in_fd, uint64_t offset, uint64_t len, int out_fd) {
+    uint64_t done = 0;
+#ifdef __linux__
+    int use_copy_file_range = 1;
+    while (done < len) {
+        size_t chunk = len - done > (1u << 30) ? (1u << 30) : len - done;
+        off_t in_offset = offset + done;
+        ssize_t n;
+
+        // copy_file_range fails across filesystems on older kernels, sendfile doesn't
+        if (use_copy_file_range) {
+            n = copy_file_range(in_fd, &in_offset, out_fd, NULL, chunk, 0);
+            if (n < 0 && errno != EINTR) {
+                use_copy_file_range = 0;
+                continue;
+            }
+        } else {
+            n = sendfile(out_fd, in_fd, &in_offset, chunk);
+            if (n < 0 && errno != EINTR) break;
+        }
+        if (n == 0) break;
+        if (n > 0) done += n;
+    }
+#else
+    (void)in_fd; (void)offset; (void)len; (void)out_fd;
+#endif
+    return done;
 }
 
+EpubError zip_entry_extract_to_fd(const ZipArchive *za, const ZipEntry *entry, int fd, const EpubAllocator *allocator) {
+    if (entry->compression_method == ZIP_METHOD_STORED) {
+        const unsigned char *data = zip_entry_raw_data(za, entry);
+        if (data == NULL || entry->compressed_size != entry->uncompressed_size) return EPUB_ERROR_INFLATE;
+
+        uint64_t done = 0;
+        if (za->mapped) done = zip_copy_range(za->fd, za->base + (data - za->data), entry->compressed_size, fd);
+        return zip_write_all(fd, &data[done], entry->compressed_size - done) ? EPUB_OK : EPUB_ERROR_IO;
+    }
+
+    ZipEntryStream stream;
+    if (!zip_entry_stream_open(&stream, za, entry, allocator)) {
+        zip_entry_stream_close(&stream);
+        return EPUB_ERROR_INFLATE;
+    }
 
-ZipEntry* zip_find_entry_by_filename(ZipEntry *entries, uint16_t num_of_entries, char *filename) {
-    for (int i = 0; i < num_of_entries; i++) {
-        if (entries[i].filename_len == 0) continue;
-        if (entries[i].filename[entries[i].filename_len - 1] == '/') continue;
+    // Input pages already inflated are dropped from the mapping as the
+    // stream advances, so large entries don't pile up in the resident set.
+    long page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t released = (uintptr_t)za->data;
+
+    unsigned char buf[ZIP_EXTRACT_CHUNK];
+    EpubError err = EPUB_OK;
+    while (err == EPUB_OK) {
+        long n = zip_entry_stream_read(&stream, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0) err = EPUB_ERROR_INFLATE;
+            break;
+        }
+        if (!zip_write_all(fd, buf, n)) err = EPUB_ERROR_IO;
 
-        if (strcmp(entries[i].filename, filename) == 0) {
-            return &entries[i];
+        uintptr_t consumed = (uintptr_t)stream.inflater.strm.next_in & ~(uintptr_t)(page_size - 1);
+        if (za->mapped && consumed >= released + ZIP_RELEASE_STEP) {
+            madvise((void *)released, consumed - released, MADV_DONTNEED);
+            released = consumed;
         }
     }
 
-    return NULL;
+    zip_entry_stream_close(&stream);
+    return err;
+}
+
+const ZipEntry* zip_find_entry(const ZipDirectory *dir, const char *name, size_t name_len) {
+    if (dir->index_capacity == 0) return NULL;
+
+    uint32_t hash = zip_hash_name(name, name_len);
+    size_t mask = dir->index_capacity - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        const ZipIndexSlot *s = &dir->index[slot];
+        if (s->entry == 0) return NULL;
+
+        const ZipEntry *entry = &dir->entries[s->entry - 1];
+        if (s->hash == hash && entry->filename_len == name_len
+            && memcmp(&dir->names[entry->filename_offset], name, name_len) == 0) {
+            return entry;
+        }
+    }
+}
+
+const ZipEntry* zip_find_entry_by_filename(const ZipDirectory *dir, const char *filename) {
+    return zip_find_entry(dir, filename, strlen(filename));
 }
@@ -0,0 +1,394 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "epubinfo/inflate.h"
+
+// Differential test of the one-shot decoder against zlib raw inflate:
+// out/inflate_test [cases] [seed]
+//
+// Every case compresses generated data (random bytes, text, runs, copies
+// from far back) with zlib, switching level and strategy between chunks so
+// stored, fixed and dynamic blocks follow each other in one stream. The
+// stream must decode to the same bytes, and be rejected for one byte less
+// or more of output. Bit-flipped, truncated and random streams must then be
+// accepted by inflate_oneshot exactly when zlib ends them with that output.
+// A hand-written block with the longest codes and extra bits goes through the
+// same checks first: zlib's output for generated data never gets that far.
+// Buffers are allocated at their exact size, so build with `SANITIZE=1` to
+// catch reads or writes past them. A failing case prints the seed that
+// reproduces it alone: out/inflate_test 1 <seed>
+
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static size_t rng_below(size_t n) {
+    return n ? rng() % n : 0;
+}
+
+static size_t random_size(void) {
+    switch (rng_below(16)) {
+        case 0: return 64 * 1024 + rng_below(256 * 1024);
+        case 1: case 2: return rng_below(16);
+        case 3: case 4: case 5: return rng_below(64 * 1024);
+        default: return rng_below(4096);
+    }
+}
+
+static void generate(unsigned char *data, size_t len) {
+    static const char *const words[] = {
+        "the ", "of ", "and ", "<p>", "</p>\n", "chapter ", "epub ", "class=\"calibre\" ", "東京", "\n",
+    };
+    size_t i = 0;
+    while (i < len) {
+        size_t n = 1 + rng_below(i < 1024 ? 64 : 2048);
+        if (n > len - i) n = len - i;
+        switch (rng_below(5)) {
+            case 0: // incompressible
+                for (size_t k = 0; k < n; k++) data[i + k] = (unsigned char)rng();
+                break;
+            case 1: // text
+                for (size_t k = 0; k < n;) {
+                    const char *w = words[rng_below(sizeof(words) / sizeof(words[0]))];
+                    size_t wlen = strlen(w);
+                    if (wlen > n - k) wlen = n - k;
+                    memcpy(&data[i + k], w, wlen);
+                    k += wlen;
+                }
+                break;
+            case 2: { // runs, short distances overlap their own output
+                size_t period = 1 + rng_below(9);
+                for (size_t k = 0; k < n; k++) data[i + k] = k < period ? (unsigned char)rng() : data[i + k - period];
+                break;
+            }
+            case 3: // copies from up to the whole window back
+                if (i > 0) {
+                    size_t dist = 1 + rng_below(i < 32768 ? i : 32768);
+                    for (size_t k = 0; k < n; k++) data[i + k] = data[i + k - dist];
+                    break;
+                }
+                // fall through
+            default: // few symbols, skewed Huffman codes
+                for (size_t k = 0; k < n; k++) data[i + k] = "aaaaaaabbbc\n"[rng_below(12)];
+                break;
+        }
+        i += n;
+    }
+}
+
+// Compresses `data` into a new buffer, return NULL if zlib fails.
+static unsigned char *compress_raw(const unsigned char *data, size_t len, size_t *out_len) {
+    static const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED };
+    size_t capacity = len + len / 8 + 4096;
+    unsigned char *out = malloc(capacity);
+    if (!out) return NULL;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, (int)rng_below(10), Z_DEFLATED, -15, 8, strategies[rng_below(5)]) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    strm.next_out = out;
+    strm.avail_out = (uInt)capacity;
+
+    int ok = 1;
+    size_t done = 0;
+    while (ok && done < len) {
+        size_t chunk = 1 + rng_below(len - done < 32768 ? len - done : 32768);
+        if (done > 0 && rng_below(3) == 0) {
+            ok = deflateParams(&strm, (int)rng_below(10), strategies[rng_below(5)]) == Z_OK;
+        }
+        strm.next_in = (unsigned char *)&data[done];
+        strm.avail_in = (uInt)chunk;
+        int flush = rng_below(8) == 0 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        ok = ok && deflate(&strm, flush) == Z_OK && strm.avail_in == 0;
+        done += chunk;
+    }
+    ok = ok && deflate(&strm, Z_FINISH) == Z_STREAM_END;
+    *out_len = strm.total_out;
+    deflateEnd(&strm);
+
+    if (!ok) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// zlib's verdict: 1 if the stream ends with exactly `expected` bytes of output.
+static int zlib_inflate(const unsigned char *in, size_t in_len, unsigned char *out, size_t expected) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK) return -1;
+
+    // one byte of room more tells a longer stream apart
+    strm.next_in = (unsigned char *)in;
+    strm.avail_in = (uInt)in_len;
+    strm.next_out = out;
+    strm.avail_out = (uInt)(expected + 1);
+    int ret = inflate(&strm, Z_FINISH);
+    int ok = ret == Z_STREAM_END && strm.total_out == expected;
+    inflateEnd(&strm);
+    return ok;
+}
+
+static int failures;
+
+static void fail(const char *name, const char *what) {
+    printf("FAIL %s: %s\n", name, what);
+    failures++;
+}
+
+// Runs inflate_oneshot on a copy of `in` and `out_len` bytes, both allocated at their exact size.
+static int oneshot(const unsigned char *in, size_t in_len, unsigned char *out_copy, size_t out_len) {
+    unsigned char *in_copy = malloc(in_len ? in_len : 1);
+    unsigned char *out = malloc(out_len ? out_len : 1);
+    if (!in_copy || !out) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    memcpy(in_copy, in, in_len);
+    int ok = inflate_oneshot(in_copy, in_len, out, out_len);
+    if (ok && out_copy) memcpy(out_copy, out, out_len);
+    free(in_copy);
+    free(out);
+    return ok;
+}
+
+// Counts of checked streams, by kind.
+typedef struct {
+    size_t valid, mutated, mutated_accepted;
+} Stats;
+
+// Compares both decoders on a corrupt stream, decoding to `expected` bytes.
+static void check_mutated(const char *name, const unsigned char *in, size_t in_len, size_t expected,
+                          unsigned char *ref, unsigned char *got, Stats *stats, const char *what) {
+    int want = zlib_inflate(in, in_len, ref, expected);
+    int have = oneshot(in, in_len, got, expected);
+    stats->mutated++;
+    if (want) stats->mutated_accepted++;
+
+    char msg[128];
+    if (want != have) {
+        snprintf(msg, sizeof(msg), "%s stream %s by zlib, %s by inflate_oneshot", what,
+                 want ? "accepted" : "rejected", have ? "accepted" : "rejected");
+        fail(name, msg);
+    } else if (want && memcmp(ref, got, expected) != 0) {
+        snprintf(msg, sizeof(msg), "%s stream decodes to other bytes than zlib", what);
+        fail(name, msg);
+    }
+}
+
+// Checks the valid stream `comp` of `data`, then corrupt streams made from it.
+static void check_stream(const char *name, const unsigned char *comp, size_t comp_len, const unsigned char *data,
+                         size_t len, Stats *stats) {
+    unsigned char *ref = malloc(len + 2);
+    unsigned char *got = malloc(len + 1);
+    unsigned char *mutated = malloc(comp_len + 1);
+    if (!ref || !got || !mutated) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+
+    stats->valid++;
+    if (!oneshot(comp, comp_len, got, len)) {
+        fail(name, "valid stream rejected");
+    } else if (memcmp(got, data, len) != 0) {
+        fail(name, "valid stream decodes to other bytes");
+    }
+    if (len > 0 && oneshot(comp, comp_len, NULL, len - 1)) fail(name, "valid stream accepted with one byte less of output");
+    if (oneshot(comp, comp_len, NULL, len + 1)) fail(name, "valid stream accepted with one byte more of output");
+
+    // bit flips, mostly in the block headers and code lengths at the start
+    for (int round = 0; comp_len > 0 && round < 4; round++) {
+        memcpy(mutated, comp, comp_len);
+        int flips = 1 + (int)rng_below(3);
+        for (int k = 0; k < flips; k++) {
+            size_t at = rng_below(2) ? rng_below(comp_len < 64 ? comp_len : 64) : rng_below(comp_len);
+            mutated[at] ^= (unsigned char)(1u << rng_below(8));
+        }
+        check_mutated(name, mutated, comp_len, len, ref, got, stats, "bit-flipped");
+    }
+
+    // truncations, the last bytes of the stream most often
+    for (int round = 0; comp_len > 0 && round < 3; round++) {
+        size_t cut = round == 0 ? 1 + rng_below(comp_len < 16 ? comp_len : 16) : 1 + rng_below(comp_len);
+        check_mutated(name, comp, comp_len - cut, len, ref, got, stats, "truncated");
+    }
+
+    // random bytes, decoding to whatever size zlib found
+    unsigned char noise[64];
+    size_t noise_len = 1 + rng_below(sizeof(noise));
+    for (size_t k = 0; k < noise_len; k++) noise[k] = (unsigned char)rng();
+    if (len > 0) check_mutated(name, noise, noise_len, rng_below(len), ref, got, stats, "random");
+
+    free(ref);
+    free(got);
+    free(mutated);
+}
+
+static void run_case(uint64_t seed, Stats *stats) {
+    rng_state = seed ? seed : 1;
+    char name[64];
+    snprintf(name, sizeof(name), "case seed %llu", (unsigned long long)seed);
+
+    size_t len = random_size();
+    unsigned char *data = malloc(len + 1);
+    size_t comp_len;
+    unsigned char *comp = data ? (generate(data, len), compress_raw(data, len, &comp_len)) : NULL;
+    if (!comp) {
+        fprintf(stderr, "%s: can't compress the input\n", name);
+        exit(2);
+    }
+    check_stream(name, comp, comp_len, data, len, stats);
+    free(comp);
+    free(data);
+}
+
+// Deflate bits, LSB first.
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    uint32_t bits;
+    unsigned count;
+} BitWriter;
+
+static void put_bits(BitWriter *w, uint32_t value, unsigned n) {
+    w->bits |= value << w->count;
+    w->count += n;
+    while (w->count >= 8) {
+        w->data[w->len++] = (unsigned char)w->bits;
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+}
+
+// Huffman codes go MSB first.
+static void put_code(BitWriter *w, const uint16_t *codes, const uint8_t *lens, unsigned symbol) {
+    uint32_t reversed = 0;
+    for (unsigned i = 0; i < lens[symbol]; i++) reversed |= ((codes[symbol] >> i) & 1u) << (lens[symbol] - 1 - i);
+    put_bits(w, reversed, lens[symbol]);
+}
+
+static void canonical_codes(const uint8_t *lens, unsigned n, uint16_t *codes) {
+    unsigned count[16] = {0}, next[16] = {0};
+    for (unsigned i = 0; i < n; i++) count[lens[i]]++;
+    count[0] = 0;
+    for (unsigned bits = 1, code = 0; bits < 16; bits++) {
+        code = (code + count[bits - 1]) << 1;
+        next[bits] = code;
+    }
+    for (unsigned i = 0; i < n; i++) codes[i] = lens[i] ? next[lens[i]]++ : 0;
+}
+
+#define LONGEST_LITERAL 'A'
+#define LONGEST_ROUNDS 8
+
+// zlib never gives the rarest symbols of generated data codes longer than
+// ~13 bits, so this dynamic block is written by hand: a 15 bits literal, then
+// a 15 bits length code with 5 extra bits and a 15 bits distance code with 13
+// extra bits, 63 bits right after a refill. It's repeated at every bit offset
+// (each round is 65 bits, 1 mod 8), so at least once there are fewer bits
+// buffered than the match needs and the decoder must refill in between.
+static unsigned char *longest_codes_stream(size_t *comp_len, size_t *data_len) {
+    uint8_t lens[285 + 30] = {0};
+    uint8_t *lit_lens = lens, *dist_lens = &lens[285];
+    // complete codes: lengths 1 to 14 once, 15 twice
+    for (unsigned i = 0; i < 13; i++) lit_lens[i] = i + 1;
+    lit_lens[256] = 14;
+    lit_lens[LONGEST_LITERAL] = 15;
+    lit_lens[284] = 15;
+    for (unsigned i = 0; i < 14; i++) dist_lens[i] = i + 1;
+    dist_lens[28] = dist_lens[29] = 15;
+
+    uint16_t lit_codes[285], dist_codes[30], pre_codes[19];
+    uint8_t pre_lens[19] = {0};
+    for (unsigned i = 0; i < 16; i++) pre_lens[i] = 4;
+    canonical_codes(lit_lens, 285, lit_codes);
+    canonical_codes(dist_lens, 30, dist_codes);
+    canonical_codes(pre_lens, 19, pre_codes);
+
+    BitWriter w = { malloc(8192), 0, 0, 0 };
+    if (!w.data) return NULL;
+    put_bits(&w, 1, 1); // BFINAL
+    put_bits(&w, 2, 2); // dynamic
+    put_bits(&w, 285 - 257, 5);
+    put_bits(&w, 30 - 1, 5);
+    put_bits(&w, 19 - 4, 4);
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    for (unsigned i = 0; i < 19; i++) put_bits(&w, pre_lens[order[i]], 3);
+    for (unsigned i = 0; i < 285 + 30; i++) put_code(&w, pre_codes, pre_lens, lens[i]);
+
+    // 32 KiB of 1 bit zeros so the farthest distances are valid, an even count keeps
+    // the next literal first after a refill
+    size_t len = 0;
+    for (; len < 32768; len++) put_code(&w, lit_codes, lit_lens, 0);
+    for (unsigned round = 0; round < LONGEST_ROUNDS; round++) {
+        put_code(&w, lit_codes, lit_lens, LONGEST_LITERAL);
+        put_code(&w, lit_codes, lit_lens, 284);
+        put_bits(&w, 256 - 227, 5);
+        put_code(&w, dist_codes, dist_lens, 29);
+        put_bits(&w, 30000 - 24577, 13);
+        put_code(&w, lit_codes, lit_lens, 0);
+        put_code(&w, lit_codes, lit_lens, 0);
+        len += 1 + 256 + 2;
+    }
+    put_code(&w, lit_codes, lit_lens, 256);
+    if (w.count > 0) put_bits(&w, 0, 8 - w.count);
+
+    *comp_len = w.len;
+    *data_len = len;
+    return w.data;
+}
+
+static void check_longest_codes(Stats *stats) {
+    const char *name = "longest codes stream";
+    rng_state = 1;
+
+    size_t comp_len, len;
+    unsigned char *comp = longest_codes_stream(&comp_len, &len);
+    unsigned char *data = malloc(len + 1);
+    if (!comp || !data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(2);
+    }
+    if (zlib_inflate(comp, comp_len, data, len) != 1) {
+        fail(name, "zlib rejects it, the test is wrong");
+    } else {
+        check_stream(name, comp, comp_len, data, len, stats);
+    }
+    free(comp);
+    free(data);
+}
+
+int main(int argc, char **argv) {
+    unsigned long long cases = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000;
+    unsigned long long seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+
+    Stats stats = {0};
+    check_longest_codes(&stats);
+
+    rng_state = seed ? seed : 1;
+    for (unsigned long long i = 0; i < cases; i++) {
+        // every case starts from its own seed, printed when it fails
+        uint64_t case_seed = i == 0 ? seed : rng();
+        uint64_t next = rng_state;
+        run_case(case_seed, &stats);
+        rng_state = next;
+    }
+
+    printf("cases: %llu, valid streams: %zu, corrupt streams: %zu (zlib accepted %zu), failures: %d\n", cases,
+           stats.valid, stats.mutated, stats.mutated_accepted, failures);
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "epubinfo/epubinfo.h"
+
+// Regression checks over the archives of tests/fixtures:
+//   earlyend.epub  the first deflate block of ch.xhtml has BFINAL set, so the
+//                  stream ends at half the size of the central directory with
+//                  compressed bytes left over (`unzip -t`: bad CRC)
+
+static int failures;
+
+static void check(int ok, const char *fixture, const char *what) {
+    printf("%s %s: %s\n", ok ? "ok  " : "FAIL", fixture, what);
+    if (!ok) failures++;
+}
+
+static int count_text(void *user, int chapter, const char *text, size_t len) {
+    (void)chapter;
+    (void)text;
+    *(size_t *)user += len;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = argc > 1 ? argv[1] : "tests/fixtures";
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/earlyend.epub", dir);
+
+    EpubContext *ctx = EpubContext_new();
+    EpubError err;
+    EpubDocument *doc = EpubContext_open_file(ctx, path, EPUB_FIELD_ALL, &err);
+    check(doc != NULL, "earlyend.epub", "opens (the OPF is intact)");
+    if (doc) {
+        const char *bad_entry = NULL;
+        err = EpubDocument_verify(doc, &bad_entry);
+        check(err == EPUB_ERROR_INFLATE || err == EPUB_ERROR_CHECKSUM, "earlyend.epub", "verify fails");
+        check(bad_entry && strcmp(bad_entry, "ch.xhtml") == 0, "earlyend.epub", "verify names ch.xhtml");
+
+        size_t text = 0;
+        err = EpubDocument_extract_text(doc, 1, count_text, &text, NULL);
+        check(err == EPUB_ERROR_INFLATE, "earlyend.epub", "text extraction fails");
+        EpubDocument_free(doc);
+    }
+    EpubContext_free(ctx);
+
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}